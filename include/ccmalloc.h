@@ -41,6 +41,11 @@ void *cocall_malloc(size_t len);
 void *cocall_calloc(size_t num, size_t length);
 void cocall_free(void*);
 
+void ccslab_init(void);
+void *ccslab_alloc(size_t len);
+void *ccslab_bound(void *obj, size_t len);
+void ccslab_free(void *obj);
+
 static __always_inline inline void *
 cocall_flexible_malloc(size_t len)
 {
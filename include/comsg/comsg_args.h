@@ -38,6 +38,8 @@
 #include <comsg/namespace.h>
 #include <comsg/namespace_object.h>
 
+#include <sys/uio.h>
+
 #pragma push_macro("UKERN_ENDPOINT")
 #define UKERN_ENDPOINT(name)    COCALL_##name,
 typedef enum cocall_ops {
@@ -116,19 +118,54 @@ struct comsg_args {
         }; //coprovide, coprovide2 
         struct {
             coport_type_t coport_type;
+            coport_flags_t coport_flags;
+            size_t coport_capacity;
             coport_t *port;
-        }; //coopen, coclose
+            struct _cocarrier_userq *userq;
+            _Atomic size_t *userq_cons;
+        }; //coopen, coclose, cosubscribe, cocarrier_userq
         struct {
             pollcoport_t *coports;
             uint ncoports;
             long timeout; 
         }; //copoll
+        struct {
+            copoll_set_t *copoll_set;
+            copoll_ctl_op_t copoll_op;
+            coport_t *copoll_port;
+            coport_eventmask_t copoll_events;
+            pollcoport_t *ready;
+            uint nready;
+            long copoll_timeout;
+        }; //copoll_create, copoll_ctl, copoll_wait
         struct {
             coport_t *cocarrier;
             void *message;
             size_t length;
             comsg_attachment_set_t oob_data;
-        }; //cosend/corecv
+            union {
+                struct iovec *iov;
+                void **messages;
+            };
+            size_t nmessages;
+            comsg_handle_t msg_handle;
+            comsg_handle_t *msg_handles; /* corecvv; one per message, or NULL */
+            union {
+                long recv_timeout; /* ms; negative waits forever */
+                long send_timeout;
+            };
+            coport_t *reply_port;
+            uint64_t corr_id; /* set by ipcd; 0 unless the message is part of a cotransact */
+        }; //cosend/corecv, cosendv/corecvv, cosend_iov (message NULL), coport_msg_free, slorecv, slosend, cotransact
+        struct {
+            coport_t *stat_port;
+            coport_stats_t stats;
+        }; //costat
+        struct {
+            coport_t *splice_src;
+            coport_t *splice_dst;
+            size_t splice_max; /* most messages to move */
+        }; //cosplice
         struct {
             coevent_subject_t subject;
             coevent_t *coevent;
@@ -146,12 +183,17 @@ struct comsg_args {
 
 typedef struct comsg_args comsg_args_t;
 typedef struct comsg_args copoll_args_t;
+typedef struct comsg_args copoll_set_args_t;
 typedef struct comsg_args cosend_args_t;
 typedef struct comsg_args corecv_args_t;
+typedef struct comsg_args cosendv_args_t;
+typedef struct comsg_args corecvv_args_t;
 typedef struct comsg_args codiscover_args_t;
 typedef struct comsg_args coprovide_args_t;
 typedef struct comsg_args coopen_args_t;
 typedef struct comsg_args coclose_args_t;
+typedef struct comsg_args costat_args_t;
+typedef struct comsg_args cosplice_args_t;
 typedef struct comsg_args coselect_args_t;
 typedef struct comsg_args coinsert_args_t;
 typedef struct comsg_args coproc_init_args_t;
@@ -37,7 +37,9 @@
 #include <sys/param.h>
 #include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <sys/types.h>
 
 #include <comsg/namespace.h>
 
@@ -59,12 +61,49 @@
                 to the sent message
     COPIPE    - direct copy ipc.whereby recipients publish a capability for the
                 sender to copy data into
+    COBROADCAST - as COCARRIER, but each message is copied once into a shared 
+                ring and every subscriber receives it. Received messages are
+                not freed: a slot's buffer is overwritten in place once every
+                subscriber has received it, so a received message is only 
+                good until depth more messages have been sent. Copy out 
+                anything that must last longer.
 */
-typedef enum {COPORT_OP_COSEND = 0, COPORT_OP_CORECV = 1, COPORT_OP_POLL = 2} coport_op_t;
-typedef enum {INVALID_COPORT = 0, COPIPE = 1, COCARRIER = 2, COCHANNEL = 3} coport_type_t;
+typedef enum {COPORT_OP_COSEND = 0, COPORT_OP_CORECV = 1, COPORT_OP_POLL = 2, COPORT_OP_POST = 3, COPORT_OP_COMPLETE = 4} coport_op_t;
+typedef enum {INVALID_COPORT = 0, COPIPE = 1, COCARRIER = 2, COCHANNEL = 3, COBROADCAST = 4} coport_type_t;
 typedef enum {COPORT_CLOSED = 0, COPORT_OPEN = 1, COPORT_BUSY = 2, COPORT_READY = 4, COPORT_DONE = 8, COPORT_CLOSING = 16, COPORT_POLLING = 32} coport_status_t;
 typedef enum {NOEVENT = 0, COPOLL_CLOSED = 1, COPOLL_IN = 2, COPOLL_OUT = 4, COPOLL_RERR = 8, COPOLL_WERR = 16} coport_eventmask_t;
-typedef enum {RECV = 1, SEND = 2, CREAT = 4, EXCL = 8, ONEWAY = 16} coport_flags_t; //currently unimplemented
+/* 
+    COPORT_RING - COCHANNEL only. framed lock-free ring; corecv returns whole 
+                  messages. single producer/single consumer unless COPORT_MPMC
+    COPORT_MPMC - multiple producers and consumers may share a COPORT_RING
+    COPORT_RECVQ - COPIPE only. the receiver posts a queue of buffers ahead of
+                   time with copipe_post; senders fill them back to back and 
+                   the receiver collects them with copipe_complete
+    COPORT_USERDEQ - COCARRIER only. ipcd also publishes messages to a ring the
+                   receiver can read, so cocarrier_consume dequeues without a
+                   cocall while messages are ready
+    COPORT_WAIT_SPIN - COPIPE only (not COPORT_RECVQ). waiting senders and 
+                   receivers busy-wait and never sleep
+    COPORT_WAIT_BLOCK - COPIPE only (not COPORT_RECVQ). waiters sleep at once on
+                   a process-shared condvar
+    COPORT_WAIT_HYBRID - both of the above; spin for about the cost of a sleep
+                   and wakeup, then sleep on the condvar. copipes with neither
+                   flag spin and then park on the status word
+    COPORT_CREDIT - COCARRIER only (not COPORT_USERDEQ). senders take a credit
+                   (a free slot) before their message is copied in, and 
+                   cosend_timed sleeps in ipcd until receivers return one
+    COPORT_SUPERPAGE - COCARRIER or COCHANNEL only. large messages and the 
+                   cochannel ring come from a pool of pre-faulted, 
+                   superpage-backed buffers in ipcd that is reused across 
+                   messages
+    COPORT_INLINE - COCARRIER only (not COPORT_USERDEQ). messages of up to 
+                   COCARRIER_INLINE_LEN bytes are stored in the queue slot. 
+                   they need not be freed, and stay valid only until the slot
+                   is reused, i.e. until the queue wraps
+*/
+typedef enum {RECV = 1, SEND = 2, CREAT = 4, EXCL = 8, ONEWAY = 16, COPORT_RING = 32, COPORT_MPMC = 64, COPORT_RECVQ = 128, COPORT_USERDEQ = 256, COPORT_WAIT_SPIN = 512, COPORT_WAIT_BLOCK = 1024, COPORT_CREDIT = 2048, COPORT_SUPERPAGE = 4096, COPORT_INLINE = 8192} coport_flags_t; //RECV-ONEWAY currently unimplemented
+#define COPORT_WAIT_HYBRID ( COPORT_WAIT_SPIN | COPORT_WAIT_BLOCK )
+#define COPORT_VALID_FLAGS ( COPORT_RING | COPORT_MPMC | COPORT_RECVQ | COPORT_USERDEQ | COPORT_WAIT_HYBRID | COPORT_CREDIT | COPORT_SUPERPAGE | COPORT_INLINE )
 
 
 #define COPOLL_INIT_EVENTS ( COPOLL_OUT )
@@ -80,6 +119,8 @@ typedef enum {RECV = 1, SEND = 2, CREAT = 4, EXCL = 8, ONEWAY = 16} coport_flags
 
 #define COPORT_LOAD_CAP_BUFFER_PERMS ( CHERI_PERM_LOAD_CAP | CHERI_PERM_LOAD | COPORT_PERMS_ARCH_SPECIFIC )
 #define COCARRIER_MSG_PERMS (CHERI_PERM_LOAD | CHERI_PERM_GLOBAL)
+#define COCARRIER_PERM_INLINE (CHERI_PERM_SW0) /* message lives in its queue slot */
+#define COCARRIER_ZC_PERMS (CHERI_PERM_LOAD | CHERI_PERM_STORE | CHERI_PERM_GLOBAL) /* zero-copy buffers, before sending */
 #define COCARRIER_OOB_PERMS ( COPORT_LOAD_CAP_BUFFER_PERMS )
 #define DEFAULT_BUFFER_PERMS ( COPORT_LOAD_CAP_BUFFER_PERMS | CHERI_PERM_GLOBAL )
 #define COPIPE_BUFFER_PERMS ( COPORT_LOAD_CAP_BUFFER_PERMS |\
@@ -87,6 +128,8 @@ typedef enum {RECV = 1, SEND = 2, CREAT = 4, EXCL = 8, ONEWAY = 16} coport_flags
 #define COPIPE_RECVBUF_PERMS ( CHERI_PERM_STORE | CHERI_PERM_GLOBAL )
 #define COCARRIER_BUF_PERMS ( CHERI_PERM_STORE | CHERI_PERM_STORE_CAP | COPORT_LOAD_CAP_BUFFER_PERMS | CHERI_PERM_GLOBAL )
 #define COCHANNEL_BUF_PERMS ( CHERI_PERM_STORE | CHERI_PERM_LOAD | CHERI_PERM_GLOBAL )
+#define COCARRIER_USERQ_PERMS ( COPORT_LOAD_CAP_BUFFER_PERMS | CHERI_PERM_GLOBAL )
+#define COCARRIER_USERQ_CONS_PERMS ( CHERI_PERM_STORE | CHERI_PERM_LOAD | CHERI_PERM_GLOBAL )
 
 #define COPORT_INBUF_PERMS (CHERI_PERM_LOAD | CHERI_PERM_GLOBAL)
 #define COPORT_OUTBUF_PERMS (CHERI_PERM_STORE | CHERI_PERM_GLOBAL)
@@ -94,33 +137,196 @@ typedef enum {RECV = 1, SEND = 2, CREAT = 4, EXCL = 8, ONEWAY = 16} coport_flags
 
 //TODO-PBB: better definition of these
 #define COCARRIER_MAX_MSG_LEN (1024 * 1024 * 2)
+#define COCARRIER_INLINE_LEN (128) /* largest COPORT_INLINE message kept in its slot */
 #define COPORT_BUF_LEN (4096)
+#define COPORT_MIN_BUF_LEN (64)
+#define COPORT_MAX_BUF_LEN (1024 * 1024 * 4)
 
 #define COCARRIER_SIZE (COPORT_BUF_LEN / CHERICAP_SIZE)
+#define COCARRIER_MIN_SIZE (4)
+#define COCARRIER_MAX_SIZE (COPORT_MAX_BUF_LEN / CHERICAP_SIZE)
+#define COCARRIER_MAX_BATCH (64) /* messages per cosendv/corecvv cocall */
+#define COPIPE_RECVQ_DEPTH (16) /* default posted buffers for COPORT_RECVQ */
+#define COPIPE_RECVQ_MAX_DEPTH (1024)
+
+/* operations for copoll_ctl */
+typedef enum {COPOLL_CTL_ADD = 1, COPOLL_CTL_MOD = 2, COPOLL_CTL_DEL = 3} copoll_ctl_op_t;
+
+struct copoll_waiter;
+struct _coport;
+struct _cosubscriber;
+struct _cobroadcast_spare;
+typedef struct _copoll_set copoll_set_t;
 
 typedef struct __no_subobject_bounds _coport_listener {
     LIST_ENTRY(_coport_listener) entries;
     _Atomic bool removed;
-    pthread_cond_t *wakeup;
+    struct copoll_waiter *wakeup;
     coport_eventmask_t events; 
     coport_eventmask_t revent;
+    /* Only used by listeners that persist in a copoll set */
+    copoll_set_t *set;
+    struct _coport *coport;
+    struct _coport *handle; /* as passed to copoll_ctl */
+    LIST_ENTRY(_coport_listener) set_entries;
+    TAILQ_ENTRY(_coport_listener) ready_entries;
+    bool ready;
 } coport_listener_t;
 
+/* 
+ * Indices are free-running byte counts into a power-of-two buffer. Producer and
+ * consumer indices are kept on separate cache lines so senders and receivers 
+ * touch disjoint lines. head is claimed before copying, tail is published after.
+ */
+struct _coport_ring {
+    _Alignas(CACHE_LINE_SIZE) _Atomic size_t prod_head;
+    _Atomic size_t prod_tail;
+    _Alignas(CACHE_LINE_SIZE) _Atomic size_t cons_head;
+    _Atomic size_t cons_tail;
+};
+
+/* Each message in a COPORT_RING is preceded by its length */
+#define COCHANNEL_RING_HDR_LEN (sizeof(size_t))
+
+/* 
+ * COPORT_RECVQ copipes. Slots between reaped and posted hold buffers posted by
+ * the receiver. Senders claim them at fill_head and complete them, in order, 
+ * at fill_tail; slots between reaped and fill_tail are ready to collect.
+ */
+struct _copipe_recvq {
+    _Alignas(CACHE_LINE_SIZE) _Atomic size_t posted;
+    _Atomic size_t reaped;
+    _Alignas(CACHE_LINE_SIZE) _Atomic size_t fill_head;
+    _Atomic size_t fill_tail;
+};
+
+/* COPORT_WAIT_BLOCK copipes. Set up once per table slot and kept on reuse */
+struct _copipe_sync {
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    bool initialised;
+};
+
+struct copipe_recv_slot {
+    void *buf;
+    ssize_t len; /* set on completion; -1 if the message did not fit */
+};
+
+/* 
+ * COPORT_USERDEQ cocarriers. ipcd publishes messages at prod; receivers, in 
+ * userspace or in ipcd, claim them by advancing cons with a CAS. Receivers map
+ * the struct read-only and get a separate capability to cons alone; ipcd keeps
+ * its own copies of prod, depth and slots.
+ */
+struct cocarrier_userq_slot {
+    void *buf; /* read-only, bounded to the message */
+    size_t nattachments; /* non-zero messages must be received via ipcd */
+};
+
+struct _cocarrier_userq {
+    _Alignas(CACHE_LINE_SIZE) _Atomic size_t prod;
+    size_t depth;
+    const struct cocarrier_userq_slot *slots;
+    _Alignas(CACHE_LINE_SIZE) _Atomic size_t cons;
+};
+
+/* Intrusive node for ipcd's copoll notifier queues */
+struct _coport_event {
+    struct _coport_event *_Atomic next;
+    _Atomic bool queued;
+    _Atomic int notifier; /* near the most recent poller; -1 if none */
+    struct _coport *coport;
+};
+
 typedef union {
     struct {
         LIST_HEAD(, _coport_listener) listeners;
         coport_eventmask_t levent; /* bitwise or of listener events */
+        struct _coport_event pending;
+        /* COPORT_USERDEQ only; NULL otherwise */
+        struct _cocarrier_userq *userq;
+        struct cocarrier_userq_slot *userq_slots;
+        size_t userq_prod;
+        char *inline_slots; /* COPORT_INLINE only; COCARRIER_INLINE_LEN per slot */
+        /* COPORT_CREDIT only; free slots not yet claimed by a sender */
+        _Atomic uint32_t credits;
+        _Atomic uint32_t credit_waiters;
     };  /* COCARRIER */
+    struct _coport_ring ring; /* COCHANNEL (COPORT_RING) */
+    struct {
+        struct _copipe_recvq recvq; /* COPORT_RECVQ */
+        struct _copipe_sync sync; /* COPORT_WAIT_BLOCK */
+    }; /* COPIPE */
+    struct {
+        /* laid out as for COCARRIER, so that copoll can treat both alike */
+        LIST_HEAD(, _coport_listener) listeners;
+        coport_eventmask_t levent;
+        struct _coport_event pending;
+        LIST_HEAD(, _cosubscriber) subscribers;
+        SLIST_HEAD(, _cobroadcast_spare) spares; /* buffers outgrown by their slots */
+        _Atomic size_t head; /* sequence number of the next message */
+    } bcast; /* COBROADCAST */
 } coport_typedep_t;
 
+/* 
+ * Per-coport counters, bumped with relaxed atomics by whichever side does the
+ * operation (ipcd for COCARRIER/COBROADCAST, libcomsg for COCHANNEL/COPIPE).
+ * costat returns a snapshot as coport_stats_t.
+ */
+struct _coport_counters {
+    _Atomic uint64_t sends;
+    _Atomic uint64_t recvs;
+    _Atomic uint64_t bytes_sent;
+    _Atomic uint64_t bytes_recvd;
+    _Atomic uint64_t send_full; /* sends refused with EAGAIN/COPOLL_WERR */
+    _Atomic uint64_t recv_empty; /* receives refused with EAGAIN/COPOLL_RERR */
+    _Atomic uint64_t cas_retries; /* failed attempts to take the coport status */
+    _Atomic uint64_t high_water; /* most messages (bytes for COCHANNEL) queued */
+};
+
 typedef struct {
     _Atomic size_t length; 
     _Atomic size_t start;
     _Atomic size_t end;
     _Atomic coport_status_t status;
     _Atomic coport_eventmask_t event;
+    _Atomic uint32_t waiters; /* threads parked on status */
+    _Atomic uint64_t gen; /* bumped when ipcd recycles the coport's slot */
+    _Atomic uint32_t users; /* libcomsg copipe/cochannel ops in progress */
+    /* off the status line, so counting CAS retries does not contend with the lock */
+    _Alignas(CACHE_LINE_SIZE) struct _coport_counters stats;
 } coport_info_t; //bad name :c and too many atomics (I think)
 
+/* Set in users while coclose waits for them to finish; no new op may start */
+#define COPORT_USERS_DRAINING (1U << 31)
+
+#define COPORT_STAT_ADD(port, field, n) \
+    atomic_fetch_add_explicit(&(port)->info->stats.field, (n), memory_order_relaxed)
+#define COPORT_STAT_INC(port, field) COPORT_STAT_ADD(port, field, 1)
+
+static inline void
+coport_stat_level(coport_info_t *info, uint64_t level)
+{
+    uint64_t high;
+
+    high = atomic_load_explicit(&info->stats.high_water, memory_order_relaxed);
+    while (level > high && !atomic_compare_exchange_weak_explicit(&info->stats.high_water, &high, level, memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+typedef struct _coport_stats {
+    coport_type_t type;
+    size_t length; /* messages (bytes for COCHANNEL) queued now */
+    uint64_t sends;
+    uint64_t recvs;
+    uint64_t bytes_sent;
+    uint64_t bytes_recvd;
+    uint64_t send_full;
+    uint64_t recv_empty;
+    uint64_t cas_retries;
+    uint64_t high_water;
+} coport_stats_t;
+
 typedef struct {
     void *buf;
 } coport_buf_t;
@@ -128,10 +334,36 @@ typedef struct {
 struct _coport {
     coport_info_t *info; //Read and Write data only
     coport_type_t type; 
+    coport_flags_t flags;
     coport_buf_t *buffer;  //Permissions vary on type
     coport_typedep_t *cd; //Read and Write + R/W Caps
+    uint64_t gen; //Slot generation the handle was issued at
+    uint32_t slot; //Index of the coport in ipcd's table
 }; //Pointer to whole struct has Load + Load caps, but no store
 
 typedef struct _coport coport_t; 
 
+/* 
+ * ipcd recycles the table slots of closed coports. Each open gets its own 
+ * handle, a copy of the coport made by ipcd that records the slot generation
+ * it was issued at, so a handle to a recycled slot stops matching its 
+ * coport_info_t.
+ */
+static inline bool
+coport_handle_current(const coport_t *port)
+{
+    if (!cheri_gettag(port))
+        return (false);
+    return (port->gen == atomic_load_explicit(&port->info->gen, memory_order_acquire));
+}
+
+/* 
+ * Returned by cocarrier receives. slot is sealed by ipcd and names the 
+ * message's slot in the cocarrier; gen is the slot generation at receipt.
+ */
+typedef struct _comsg_handle {
+    void *slot;
+    uint64_t gen;
+} comsg_handle_t;
+
 #endif
\ No newline at end of file
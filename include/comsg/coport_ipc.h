@@ -40,13 +40,29 @@
 
 __BEGIN_DECLS
 
+typedef struct _cocarrier_consumer cocarrier_consumer_t;
+
 nsobject_t *open_named_coport(const char *, coport_type_t, namespace_t *);
 coport_t *open_coport(coport_type_t);
+coport_t *open_coport2(coport_type_t, coport_flags_t, size_t);
 
 ssize_t cosend(const coport_t *, const void *, size_t);
 ssize_t corecv(const coport_t *,  void ** const, size_t);
+ssize_t corecv_handle(const coport_t *, void ** const, size_t, comsg_handle_t *);
+ssize_t cosend_timed(const coport_t *, const void *, size_t, int);
+ssize_t corecv_timed(const coport_t *, void ** const, size_t, int, comsg_handle_t *);
+cocarrier_consumer_t *cocarrier_consumer(const coport_t *);
+ssize_t cocarrier_consume(cocarrier_consumer_t *, void ** const, int);
+void cocarrier_consumer_free(cocarrier_consumer_t *);
 ssize_t cosend_oob(const coport_t *, const void *, size_t, comsg_attachment_t *, size_t);
 ssize_t corecv_oob(const coport_t *, void ** const, size_t, comsg_attachment_set_t *);
+ssize_t cosendv(const coport_t *, const struct iovec *, size_t);
+ssize_t cosend_iov(const coport_t *, const struct iovec *, size_t);
+ssize_t corecvv(const coport_t *, void **, comsg_handle_t *, size_t);
+int copipe_post(const coport_t *, void *, size_t);
+ssize_t copipe_complete(const coport_t *, void **);
+coport_t *cobroadcast_subscribe(const coport_t *);
+int cobroadcast_unsubscribe(coport_t *);
 coport_type_t coport_gettype(const coport_t *);
 void make_pollcoport(pollcoport_t *, coport_t *, coport_eventmask_t);
 void set_coport_handle_type(coport_t *, coport_type_t);
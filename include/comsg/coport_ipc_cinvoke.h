@@ -50,6 +50,8 @@ extern const coport_func_ptr *cosend_codecap_cochannel;
 extern const coport_func_ptr *corecv_codecap_cochannel;
 
 extern const coport_ready_func_ptr *copipe_ready_codecap;
+extern const coport_func_ptr *copipe_post_codecap;
+extern const coport_func_ptr *copipe_complete_codecap;
 
 extern const void **return_stack_sealcap;
 
@@ -64,6 +66,8 @@ extern ssize_t cochannel_corecv_cinvoke(void *codecap, const coport_t *coport, v
 extern ssize_t copipe_cosend_cinvoke(void *codecap, const coport_t *coport, const void *buf, const void *ret_sealcap, size_t len);
 extern ssize_t copipe_corecv_cinvoke(void *codecap, const coport_t *coport, void *buf, const void *ret_sealcap, size_t len);
 extern bool copipe_ready_cinvoke(void *codecap, coport_t *coport, const void *ret_sealcap);
+extern ssize_t copipe_post_cinvoke(void *codecap, const coport_t *coport, void *buf, const void *ret_sealcap, size_t len);
+extern ssize_t copipe_complete_cinvoke(void *codecap, const coport_t *coport, void *buf, const void *ret_sealcap, size_t len);
 
 static inline __always_inline bool
 copipe_ready(const coport_t *coport)
@@ -83,6 +87,18 @@ corecv_cinvoke_copipe(const coport_t *port, void *buffer, size_t length)
     return (copipe_corecv_cinvoke(*corecv_codecap_copipe, port, buffer, (*return_stack_sealcap), length));
 }
 
+static inline __always_inline ssize_t 
+post_cinvoke_copipe(const coport_t *port, void *buffer, size_t length)
+{
+    return (copipe_post_cinvoke(*copipe_post_codecap, port, buffer, (*return_stack_sealcap), length));
+}
+
+static inline __always_inline ssize_t 
+complete_cinvoke_copipe(const coport_t *port, void **buffer)
+{
+    return (copipe_complete_cinvoke(*copipe_complete_codecap, port, buffer, (*return_stack_sealcap), sizeof(void *)));
+}
+
 static inline __always_inline ssize_t 
 cosend_cinvoke_cochannel(const coport_t *port, const void *buffer, size_t length)
 {
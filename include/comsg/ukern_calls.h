@@ -65,17 +65,39 @@ int codrop(namespace_t *, namespace_t *);
 int codelete(nsobject_t *, namespace_t *);
 nsobject_t *coupdate(nsobject_t *, nsobject_type_t, void *);
 coport_t *coopen(coport_type_t);
+coport_t *coopen2(coport_type_t, coport_flags_t, size_t);
+coport_t *cosubscribe(coport_t *);
+int counsubscribe(coport_t *);
+int costat(const coport_t *, coport_stats_t *);
+ssize_t cosplice(const coport_t *, const coport_t *, size_t);
+struct _cocarrier_userq *cocarrier_userq(const coport_t *, _Atomic size_t **);
 int cocarrier_recv(const coport_t *, void ** const, size_t);
+int cocarrier_recv_handle(const coport_t *, void ** const, size_t, comsg_handle_t *);
+int cocarrier_recv_timed(const coport_t *, void ** const, size_t, int, comsg_handle_t *);
 int cocarrier_send(const coport_t *, const void *, size_t);
+int cocarrier_send_timed(const coport_t *, const void *, size_t, int);
+int cotransact(const coport_t *, const coport_t *, const void *, size_t, void ** const, int, comsg_handle_t *);
+int cocarrier_recv_request(const coport_t *, void ** const, size_t, uint64_t *);
+int cocarrier_send_reply(const coport_t *, const void *, size_t, uint64_t);
 int cocarrier_recv_oob(const coport_t *, void ** const, size_t, comsg_attachment_set_t *);
 int cocarrier_send_oob(const coport_t *, const void *, size_t, comsg_attachment_t *, size_t);
+int cocarrier_sendv(const coport_t *, const struct iovec *, size_t);
+int cocarrier_send_iov(const coport_t *, const struct iovec *, size_t);
+int cocarrier_recvv(const coport_t *, void **, comsg_handle_t *, size_t);
 int copoll(pollcoport_t *, int , int );
+copoll_set_t *copoll_create(void);
+int copoll_ctl(copoll_set_t *, copoll_ctl_op_t, coport_t *, coport_eventmask_t);
+int copoll_wait(copoll_set_t *, pollcoport_t *, int, int);
+int copoll_destroy(copoll_set_t *);
 int coclose(coport_t *);
 int ccb_install(cocallback_func_t *, struct cocallback_args *, coevent_t *);
 cocallback_func_t *ccb_register(void *, cocallback_flags_t);
 coevent_t *colisten(coevent_type_t , coevent_subject_t);
 void *codiscover2(coservice_t *);
 int coport_msg_free(coport_t *, void *);
+void *coport_msg_alloc(coport_t *, size_t, comsg_handle_t *);
+int cocarrier_send_zc(const coport_t *, const void *, size_t, const comsg_handle_t *);
+int coport_msg_free_handle(coport_t *, const comsg_handle_t *);
 
 void set_ukern_target(cocall_num_t , void *);
 void set_ukern_func(nsobject_t *, cocall_num_t);
@@ -82,6 +82,7 @@ struct benchmark_result {
 	coport_type_t coport_type;
 	coport_op op;
 	ssize_t buf_len;
+	bool zero_copy;
 	struct msg_checksum sum;
 	statcounters_bank_t statcounter_diff;
 	struct rusage rusage_diff;
@@ -117,6 +118,10 @@ static _Thread_local coport_op mode = OP_CORECV;
 static coport_t *copipe = NULL;
 static coport_t *cocarrier = NULL;
 static coport_t *cochannel = NULL;
+static coport_flags_t cochannel_flags = 0;
+static coport_flags_t copipe_flags = 0;
+static ssize_t cochannel_capacity = COPORT_BUF_LEN;
+static ssize_t cochannel_max_len = COPORT_BUF_LEN;
 
 static char *message_text = NULL;
 static _Thread_local char *buffer = NULL;
@@ -137,6 +142,8 @@ static bool cocarrier_enabled = false;
 static bool dummy_workload_enabled = false;
 static bool sha_workload_enabled = true;
 static bool enable_qemu_tracing = false;
+static bool cocarrier_zero_copy = false;
+static _Thread_local bool zero_copy_pass = false;
 static _Thread_local struct msg_checksum checksum;
 static _Thread_local SHA256_CTX *sha_ctx;
 
@@ -448,9 +455,9 @@ do_recv_setup(void)
 	recver_pid = getpid();
 	spawn_ukernel(recver_pid);
 	//open coports and pass to child process (sender)
-	copipe = open_coport(COPIPE);
+	copipe = open_coport2(COPIPE, copipe_flags, 0);
 	cocarrier = open_coport(COCARRIER);
-	cochannel = open_coport(COCHANNEL);
+	cochannel = open_coport2(COCHANNEL, cochannel_flags, cochannel_capacity);
 
 	if (copipe == NULL 
 		|| cocarrier == NULL 
@@ -536,7 +543,7 @@ do_warmup_recv(void)
 	}
 	//warmup run to synchronise sender/recver and warm up caches, touch memory, etc
 	for (retries = 0; retries < max_retries; retries++) {
-		error = corecv(cochannel, (void**)&buffer, MIN(message_len, COPORT_BUF_LEN));
+		error = corecv(cochannel, (void**)&buffer, MIN(message_len, cochannel_max_len));
 		if (error < 0) {
 			if (errno == EAGAIN) {
 				if (retries < max_retries){
@@ -594,7 +601,7 @@ do_warmup_send(void)
 	if (error < 0)
 		err(EX_SOFTWARE, "%s: error occurred in cocarrier cosend", __func__);
 	//warmup run to synchronise sender/recver and warm up caches, touch memory, etc
-	error = cosend(cochannel, buffer, MIN(message_len, COPORT_BUF_LEN));
+	error = cosend(cochannel, buffer, MIN(message_len, cochannel_max_len));
 	if (error < 0)
 		err(EX_SOFTWARE, "%s: error occurred in cochannel cosend", __func__);
 	error = cosend(copipe, &sender_lwpid, sizeof(sender_lwpid));
@@ -651,18 +658,33 @@ do_benchmark_send(void *buf, size_t buffer_length, coport_t *port)
 	int intval;
 	coport_type_t coport_type;
 	struct msg_checksum b;
+	comsg_handle_t zc_handle;
+	bool zero_copy;
 
+	coport_type = coport_gettype(port);
+	zero_copy = (zero_copy_pass && coport_type == COCARRIER);
+	if (zero_copy) {
+		/* 
+		 * Write the message straight into a pool buffer, as a zero-copy 
+		 * sender would. Like the copy-mode buffer, this is not timed.
+		 */
+		buf = coport_msg_alloc(port, buffer_length, &zc_handle);
+		if (buf == NULL)
+			err(EX_SOFTWARE, "%s: coport_msg_alloc failed (try fewer iterations)", __func__);
+	}
 	
 	memcpy(buf, message_text, buffer_length);
 	message_text = __builtin_cheri_offset_increment(message_text, buffer_length);
 	if (cheri_getaddress(message_text) + buffer_length > cheri_gettop(message_text)) {
 		message_text = cheri_setoffset(message_text, (cheri_getoffset(message_text) + buffer_length) % cheri_getlen(message_text));
 	}
-	buf = cheri_setbounds(buffer, buffer_length);
+	if (zero_copy)
+		buf = cheri_setbounds(buf, buffer_length);
+	else
+		buf = cheri_setbounds(buffer, buffer_length);
 
-	coport_type = coport_gettype(port);
 	if (coport_type == COCHANNEL)
-		buffer_length = MIN(COPORT_BUF_LEN, buffer_length);
+		buffer_length = MIN(cochannel_max_len, buffer_length);
 	else if (coport_type == COPIPE) {
 		while(!copipe_ready(port)) {
 			sched_yield(); //wait for recver to be ready
@@ -686,7 +708,10 @@ do_benchmark_send(void *buf, size_t buffer_length, coport_t *port)
 	}
 	//perform operation
 	b = dummy_workload((char *)buf, buffer_length);
-	status = cosend(port, buf, buffer_length);
+	if (zero_copy)
+		status = cocarrier_send_zc(port, buf, buffer_length, &zc_handle);
+	else
+		status = cosend(port, buf, buffer_length);
 	
 	if (!aggregate_mode) {
 		//get new values for counters
@@ -706,13 +731,16 @@ do_benchmark_send(void *buf, size_t buffer_length, coport_t *port)
 	}
 
 	if (status < 0) {
-		if (errno == EWOULDBLOCK || errno == EMSGSIZE || errno == EOPNOTSUPP)
+		if (errno == EWOULDBLOCK || errno == EMSGSIZE || errno == EOPNOTSUPP) {
+			if (zero_copy)
+				coport_msg_free(port, buf);
 			return (NULL);
-		else
+		} else
 			err(EX_SOFTWARE, "%s: error occurred in cosend for coport type %d", __func__, coport_type);
 	}
 
 	result = calloc(1, sizeof(struct benchmark_result));
+	result->zero_copy = zero_copy;
 	if (coport_type != COCARRIER) {
 		if (!dummy_workload_enabled)
 			checksum = do_dummy_workload(buf, buffer_length);
@@ -762,7 +790,7 @@ do_benchmark_recv(void **buf, size_t buffer_length, coport_t *port)
 
 	coport_type = coport_gettype(port);
 	if (coport_type == COCHANNEL)
-		buffer_length = MIN(COPORT_BUF_LEN, buffer_length);
+		buffer_length = MIN(cochannel_max_len, buffer_length);
 	//statcounters
 	statcounters_zero(&start_bank);
 	statcounters_zero(&end_bank);
@@ -830,6 +858,7 @@ do_benchmark_recv(void **buf, size_t buffer_length, coport_t *port)
 	result->op = OP_CORECV;
 	result->buf_len = buffer_length;
 	result->coport_type = coport_type;
+	result->zero_copy = (zero_copy_pass && coport_type == COCARRIER);
 
 	//output
 	return (result);
@@ -896,6 +925,32 @@ aggregate_sample_end(struct benchmark_result *result, coport_op op_mode, coport_
 	
 }
 
+static void
+do_cocarrier_benchmark(coport_op op_mode)
+{
+	struct benchmark_result *result;
+	ssize_t i;
+
+	if (op_mode == OP_CORECV && enable_qemu_tracing)
+		sleep(5);
+	if (aggregate_mode){
+		result = calloc(1, sizeof(struct benchmark_result));
+		result->zero_copy = zero_copy_pass;
+		aggregate_sample_start(result, op_mode, COCARRIER);
+	}
+	for (i = 0; i < iterations; i++) {
+		do_benchmark_run(op_mode, cocarrier);
+		if (op_mode == OP_CORECV)
+			cocarrier_msgs[i] = cocarrier_buf;
+	}
+	if (aggregate_mode)
+		aggregate_sample_end(result, op_mode, COCARRIER);
+	if (op_mode == OP_CORECV) {
+		for (i = 0; i < iterations; i++)
+			coport_msg_free(cocarrier, cocarrier_msgs[i]);
+	}
+}
+
 static void
 do_benchmark(coport_op op_mode)
 {
@@ -928,29 +983,18 @@ do_benchmark(coport_op op_mode)
 	}
 
 	if (cocarrier_enabled) {
-		if (op_mode == OP_CORECV && enable_qemu_tracing)
-			sleep(5);
-		if (aggregate_mode){
-			result = calloc(1, sizeof(struct benchmark_result));
-			aggregate_sample_start(result, op_mode, COCARRIER);
-		}
-		for (i = 0; i < iterations; i++) {
-			do_benchmark_run(op_mode, cocarrier);
-			if (op_mode == OP_CORECV)
-				cocarrier_msgs[i] = cocarrier_buf;
-		}
-		if (aggregate_mode)
-			aggregate_sample_end(result, op_mode, COCARRIER);
-		if (op_mode == OP_CORECV) {
-			for (i = 0; i < iterations; i++)
-				coport_msg_free(cocarrier, cocarrier_msgs[i]);
+		do_cocarrier_benchmark(op_mode);
+		if (cocarrier_zero_copy && message_len <= COCARRIER_MAX_MSG_LEN) {
+			zero_copy_pass = true;
+			do_cocarrier_benchmark(op_mode);
+			zero_copy_pass = false;
 		}
 	}
 	if (cochannel_enabled) {
-		if (message_len > COPORT_BUF_LEN)
+		if (message_len > cochannel_max_len)
 			return;
 
-		x = ((COPORT_BUF_LEN + message_len - 1) / message_len);
+		x = ((cochannel_capacity + message_len - 1) / message_len);
 		if (aggregate_mode){
 			result = calloc(1, sizeof(struct benchmark_result));
 			aggregate_sample_start(result, op_mode, COCHANNEL);
@@ -978,12 +1022,13 @@ process_results(void)
 	char *bandwidth;
 	struct benchmark_result *run;
 	float printable_bw;
+	double msg_ns, cpu_us, nmsgs;
 	ssize_t buf_len;
 	pid_t pid;
 	int status;
 	bool incl_headers;
 
-	bool started[3] = {false, false, false};
+	bool started[4] = {false, false, false, false};
 	int idx_a, idx_b;
 
 	SLIST_FOREACH(run, &results_list, entries) {
@@ -1006,8 +1051,13 @@ process_results(void)
 			idx_b = 0;
 			break;
 		case COCARRIER:
-			phase = strdup("COCARRIER");
-			idx_b = 1;
+			if (run->zero_copy) {
+				phase = strdup("COCARRIER-ZC");
+				idx_b = 3;
+			} else {
+				phase = strdup("COCARRIER");
+				idx_b = 1;
+			}
 			run->sum = do_dummy_workload(run->sum.buf, message_len);
 			break;
 		case COCHANNEL:
@@ -1019,11 +1069,16 @@ process_results(void)
 			break;
 		}
 		printable_bw = ((float)run->buf_len / 1024.0) / (((float) run->timespec_diff.tv_sec + (float)run->timespec_diff.tv_nsec) / 1000000000);
+		/* spinning shows up as cpu time; sleeping only as latency */
+		nmsgs = aggregate_mode ? (double)iterations : 1.0;
+		msg_ns = ((double)run->timespec_diff.tv_sec * 1000000000.0 + (double)run->timespec_diff.tv_nsec) / nmsgs;
+		cpu_us = ((double)(run->rusage_diff.ru_utime.tv_sec + run->rusage_diff.ru_stime.tv_sec) * 1000000.0 + 
+		    (double)(run->rusage_diff.ru_utime.tv_usec + run->rusage_diff.ru_stime.tv_usec)) / nmsgs;
 
 		if (!run->sum.is_sha) {
-			printf("%s -- %s: %.2FKB/s (checksum: %lx)\n", progname, phase, printable_bw, run->sum.sum);
+			printf("%s -- %s: %.2FKB/s, %.0Fns/msg, %.2Fus cpu/msg (checksum: %lx)\n", progname, phase, printable_bw, msg_ns, cpu_us, run->sum.sum);
 		} else {
-			printf("%s -- %s: %.2FKB/s (checksum: ", progname, phase, printable_bw);
+			printf("%s -- %s: %.2FKB/s, %.0Fns/msg, %.2Fus cpu/msg (checksum: ", progname, phase, printable_bw, msg_ns, cpu_us);
 			for (size_t i = 0; i < SHA256_DIGEST_LENGTH; i++) {
 				printf("%02x", run->sum.sha_sum[i]);
 			}
@@ -1200,7 +1255,7 @@ int main(int argc, char *const argv[])
 	int opt, error;
 	char *strptr;
 
-	while((opt = getopt(argc, argv, "sb:i:ahSPBdQlc")) != -1) {
+	while((opt = getopt(argc, argv, "sb:i:ahSPBRC:dQlcZW:")) != -1) {
 		switch (opt) {
 		case 'h':
 			format = HUMAN_READABLE;
@@ -1233,6 +1288,15 @@ int main(int argc, char *const argv[])
 		case 'B':
 			cochannel_enabled = true;
 			break;
+		case 'R':
+			cochannel_flags = COPORT_RING;
+			break;
+		case 'C':
+			cochannel_capacity = strtol(optarg, &strptr, 10);
+			if (*optarg == '\0' || *strptr != '\0' || cochannel_capacity < COPORT_MIN_BUF_LEN || 
+				cochannel_capacity > COPORT_MAX_BUF_LEN || !powerof2(cochannel_capacity))
+				err(EX_USAGE, "invalid cochannel capacity");
+			break;
 		case 'c':
 			sha_workload_enabled = true;
 			dummy_workload_enabled = true;
@@ -1244,12 +1308,28 @@ int main(int argc, char *const argv[])
 		case 'Q':
 			enable_qemu_tracing = true;
 			break;
+		case 'Z':
+			cocarrier_zero_copy = true;
+			break;
+		case 'W':
+			if (strcmp(optarg, "spin") == 0)
+				copipe_flags = COPORT_WAIT_SPIN;
+			else if (strcmp(optarg, "block") == 0)
+				copipe_flags = COPORT_WAIT_BLOCK;
+			else if (strcmp(optarg, "hybrid") == 0)
+				copipe_flags = COPORT_WAIT_HYBRID;
+			else
+				err(EX_USAGE, "invalid copipe wait policy (spin, block or hybrid)");
+			break;
 		case '?':
 		default: 
 			err(EX_USAGE, "invalid flag '%c'", (char)optopt);
 			break;
 		}
 	}
+	cochannel_max_len = cochannel_capacity;
+	if ((cochannel_flags & COPORT_RING) != 0)
+		cochannel_max_len -= COCHANNEL_RING_HDR_LEN;
 	if (!(copipe_enabled || cocarrier_enabled || cochannel_enabled)) {
 		copipe_enabled = true;
 		cocarrier_enabled = true;
@@ -1260,9 +1340,9 @@ int main(int argc, char *const argv[])
 	recver_pid = getpid();
 
 	spawn_ukernel(recver_pid);
-	copipe = open_coport(COPIPE);
+	copipe = open_coport2(COPIPE, copipe_flags, 0);
 	cocarrier = open_coport(COCARRIER);
-	cochannel = open_coport(COCHANNEL);
+	cochannel = open_coport2(COCHANNEL, cochannel_flags, cochannel_capacity);
 	rtprio_thread(RTP_LOOKUP, 0, &rtp_params);
 #endif
 	run_in_thread();
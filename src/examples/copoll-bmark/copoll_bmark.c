@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2020 Peter S. Blandford-Baker
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology) under DARPA contract HR0011-18-C-0016 ("ECATS"), as part of the
+ * DARPA SSITH research programme.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <comsg/coport_ipc.h>
+#include <comsg/ukern_calls.h>
+#include <comsg/coport.h>
+#include <comsg/namespace.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/errno.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Measures how copoll wakeups scale with the number of independent cocarrier
+ * pairs. Each pair has its own cocarrier, a sender thread and a receiver 
+ * thread that blocks in copoll before every corecv. Pairs share nothing, so
+ * aggregate throughput should grow with the number of pairs until we run out 
+ * of cores.
+ */
+
+extern char **environ;
+
+static char *coprocd_args[] = {"/usr/bin/coprocd", NULL};
+
+static size_t max_pairs = 8;
+static size_t iterations = 10000;
+static size_t message_len = 64;
+
+struct bmark_pair {
+	coport_t *port;
+	pthread_t sender;
+	pthread_t recver;
+};
+
+static pthread_barrier_t start_barrier;
+
+static void
+start_microkernel(void)
+{
+	int error;
+	pid_t my_pid, coprocd_pid;
+	void *coproc_init;
+
+	error = colookup(U_COPROC_INIT, &coproc_init);
+	if (error != 0) {
+		my_pid = getpid();
+		coprocd_pid = vfork();
+		if (coprocd_pid == 0)
+			coexecve(my_pid, coprocd_args[0], coprocd_args, environ);
+		do {
+			sleep(1);
+			error = colookup(U_COPROC_INIT, &coproc_init);
+		} while(error != 0);
+	}
+	set_ukern_target(COCALL_COPROC_INIT, coproc_init);
+}
+
+static void
+wait_for(coport_t *port, coport_eventmask_t event)
+{
+	pollcoport_t pcpt;
+
+	make_pollcoport(&pcpt, port, event);
+	if (copoll(&pcpt, 1, -1) < 0)
+		err(EX_SOFTWARE, "%s: copoll failed", __func__);
+}
+
+static void *
+sender_thread(void *argp)
+{
+	struct bmark_pair *pair;
+	char *message;
+
+	pair = argp;
+	message = calloc(1, message_len);
+	pthread_barrier_wait(&start_barrier);
+	for (size_t i = 0; i < iterations; i++) {
+		while (cosend(pair->port, message, message_len) < 0) {
+			if (errno != EAGAIN)
+				err(EX_SOFTWARE, "%s: cosend failed", __func__);
+			wait_for(pair->port, COPOLL_OUT);
+		}
+	}
+	free(message);
+	return (NULL);
+}
+
+static void *
+recver_thread(void *argp)
+{
+	struct bmark_pair *pair;
+	comsg_handle_t handle;
+	void *message;
+
+	pair = argp;
+	pthread_barrier_wait(&start_barrier);
+	for (size_t i = 0; i < iterations; i++) {
+		wait_for(pair->port, COPOLL_IN);
+		while (corecv_handle(pair->port, &message, message_len, &handle) < 0) {
+			if (errno != EAGAIN)
+				err(EX_SOFTWARE, "%s: corecv failed", __func__);
+			wait_for(pair->port, COPOLL_IN);
+		}
+		coport_msg_free_handle(pair->port, &handle);
+	}
+	return (NULL);
+}
+
+static double
+run_pairs(size_t npairs)
+{
+	struct bmark_pair *pairs;
+	struct timespec start, end;
+	double elapsed;
+
+	pairs = calloc(npairs, sizeof(struct bmark_pair));
+	for (size_t i = 0; i < npairs; i++) {
+		pairs[i].port = open_coport(COCARRIER);
+		if (pairs[i].port == NULL)
+			err(EX_SOFTWARE, "%s: could not open cocarrier", __func__);
+	}
+
+	pthread_barrier_init(&start_barrier, NULL, (npairs * 2) + 1);
+	for (size_t i = 0; i < npairs; i++) {
+		pthread_create(&pairs[i].recver, NULL, recver_thread, &pairs[i]);
+		pthread_create(&pairs[i].sender, NULL, sender_thread, &pairs[i]);
+	}
+	pthread_barrier_wait(&start_barrier);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (size_t i = 0; i < npairs; i++) {
+		pthread_join(pairs[i].sender, NULL);
+		pthread_join(pairs[i].recver, NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	pthread_barrier_destroy(&start_barrier);
+
+	for (size_t i = 0; i < npairs; i++)
+		coclose(pairs[i].port);
+	free(pairs);
+
+	elapsed = (end.tv_sec - start.tv_sec) + ((end.tv_nsec - start.tv_nsec) / 1e9);
+	return ((npairs * iterations) / elapsed);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: copoll-bmark [-n max_pairs] [-i iterations] [-b message_len]\n");
+	exit(EX_USAGE);
+}
+
+int 
+main(int argc, char *const argv[])
+{
+	double rate, base_rate;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:i:b:")) != -1) {
+		switch (opt) {
+		case 'n':
+			max_pairs = strtoul(optarg, NULL, 10);
+			break;
+		case 'i':
+			iterations = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			message_len = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (max_pairs == 0 || iterations == 0 || message_len == 0 || message_len > COCARRIER_MAX_MSG_LEN)
+		usage();
+
+	start_microkernel();
+	do {
+		root_ns = coproc_init(NULL, NULL, NULL, NULL);
+		if (errno == EAGAIN)
+			sched_yield();
+	} while (root_ns == NULL);
+
+	printf("pairs,msgs_per_sec,speedup\n");
+	base_rate = 0;
+	for (size_t npairs = 1; npairs <= max_pairs; npairs *= 2) {
+		rate = run_pairs(npairs);
+		if (npairs == 1)
+			base_rate = rate;
+		printf("%zu,%.0f,%.2f\n", npairs, rate, rate / base_rate);
+	}
+	return (0);
+}
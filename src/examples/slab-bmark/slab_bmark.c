@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2020 Peter S. Blandford-Baker
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology) under DARPA contract HR0011-18-C-0016 ("ECATS"), as part of the
+ * DARPA SSITH research programme.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <ccmalloc.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <sys/param.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Compares ccslab against malloc for the mix of message sizes seen by ipcd.
+ * Each thread keeps a window of live allocations and replaces a random one
+ * on every iteration, touching the first bytes of each new buffer as
+ * cocarrier_send would.
+ */
+
+#define WINDOW_LEN (64)
+
+static size_t nthreads = 4;
+static size_t iterations = 100000;
+static size_t min_shift = 6;
+static size_t max_shift = 21;
+static bool use_slab;
+
+static pthread_barrier_t start_barrier;
+
+static size_t
+next_rand(size_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return (*state);
+}
+
+static size_t
+pick_len(size_t *state)
+{
+	size_t shift, r;
+
+	/* 3 in 4 messages are within the smallest few classes */
+	r = next_rand(state);
+	if (r % 4 == 0)
+		shift = min_shift + (r >> 2) % (max_shift - min_shift + 1);
+	else
+		shift = MIN(min_shift + (r >> 2) % 3, max_shift);
+	return ((1UL << shift) - (r % 17));
+}
+
+static void
+bmark_free(void *buf, void *alloc)
+{
+	if (use_slab)
+		ccslab_free(alloc);
+	else
+		free(buf);
+}
+
+static void *
+bmark_thread(void *argp)
+{
+	void *bufs[WINDOW_LEN];
+	void *allocs[WINDOW_LEN];
+	size_t state, idx, len;
+
+	state = (size_t)(uintptr_t)argp * 2654435761UL + 1;
+	for (size_t i = 0; i < WINDOW_LEN; i++) {
+		len = pick_len(&state);
+		allocs[i] = use_slab ? ccslab_alloc(len) : NULL;
+		bufs[i] = use_slab ? ccslab_bound(allocs[i], len) : malloc(len);
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	for (size_t i = 0; i < iterations; i++) {
+		idx = next_rand(&state) % WINDOW_LEN;
+		bmark_free(bufs[idx], allocs[idx]);
+		len = pick_len(&state);
+		if (use_slab) {
+			allocs[idx] = ccslab_alloc(len);
+			if (allocs[idx] == NULL)
+				err(EX_OSERR, "%s: ccslab_alloc of %zu bytes failed", __func__, len);
+			bufs[idx] = ccslab_bound(allocs[idx], len);
+		} else {
+			bufs[idx] = malloc(len);
+			if (bufs[idx] == NULL)
+				err(EX_OSERR, "%s: malloc of %zu bytes failed", __func__, len);
+		}
+		memset(bufs[idx], 0xa5, MIN(len, 64));
+	}
+
+	for (size_t i = 0; i < WINDOW_LEN; i++)
+		bmark_free(bufs[i], allocs[i]);
+	return (NULL);
+}
+
+static double
+run_bmark(bool slab)
+{
+	pthread_t *threads;
+	struct timespec start, end;
+	double elapsed;
+
+	use_slab = slab;
+	threads = calloc(nthreads, sizeof(pthread_t));
+	pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+	for (size_t i = 0; i < nthreads; i++)
+		pthread_create(&threads[i], NULL, bmark_thread, (void *)(uintptr_t)(i + 1));
+
+	pthread_barrier_wait(&start_barrier);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (size_t i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	pthread_barrier_destroy(&start_barrier);
+	free(threads);
+	elapsed = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+	return (elapsed / (nthreads * iterations));
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: slab-bmark [-t threads] [-i iterations] [-m min_shift] [-M max_shift]\n");
+	exit(EX_USAGE);
+}
+
+int 
+main(int argc, char *const argv[])
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:i:m:M:")) != -1) {
+		switch (opt) {
+		case 't':
+			nthreads = strtoul(optarg, NULL, 10);
+			break;
+		case 'i':
+			iterations = strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			min_shift = strtoul(optarg, NULL, 10);
+			break;
+		case 'M':
+			max_shift = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (nthreads == 0 || iterations == 0 || min_shift > max_shift || max_shift > 21)
+		usage();
+
+	ccslab_init();
+	printf("malloc: %.1f ns/op\n", run_bmark(false));
+	printf("ccslab: %.1f ns/op\n", run_bmark(true));
+	return (0);
+}
@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 2020 Peter S. Blandford-Baker
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology) under DARPA contract HR0011-18-C-0016 ("ECATS"), as part of the
+ * DARPA SSITH research programme.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <ccmalloc.h>
+
+#include <comsg/utils.h>
+
+#include <assert.h>
+#include <cheri/cheric.h>
+#include <cheri/cherireg.h>
+#include <err.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sysexits.h>
+#include <sys/errno.h>
+#include <sys/param.h>
+
+/*
+ * Power-of-two size classes for ipcd message bodies. Small classes are carved
+ * from shared chunks; classes of at least SLAB_CHUNK_LEN are allocated one
+ * object at a time. Freed objects go onto a per-class bounded MPMC queue
+ * (Vyukov) so that alloc/free are lock-free in the common case. When the
+ * queue is full, small objects spill to a locked overflow stack and large
+ * objects are returned to the system allocator.
+ */
+#define SLAB_MIN_SHIFT (6)
+#define SLAB_MAX_SHIFT (21)
+#define SLAB_NCLASSES (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+#define SLAB_CHUNK_LEN (1024 * 1024)
+#define SLAB_CACHE_LEN (16 * 1024 * 1024) /* per-class bytes kept on the queue */
+#define SLAB_MIN_CELLS (16)
+#define SLAB_MAX_CELLS (4096)
+
+struct slab_cell {
+	_Atomic size_t seq;
+	void *obj;
+};
+
+struct slab_class {
+	size_t size;
+	size_t mask;
+	struct slab_cell *cells;
+	_Alignas(CACHE_LINE_SIZE) _Atomic size_t enqueue_pos;
+	_Alignas(CACHE_LINE_SIZE) _Atomic size_t dequeue_pos;
+	_Alignas(CACHE_LINE_SIZE) _Atomic(void *) chunk;
+	pthread_mutex_t lock; /* protects chunk refills and overflow */
+	void **overflow;
+	_Atomic size_t noverflow;
+	size_t overflow_len;
+};
+
+static struct slab_class slab_classes[SLAB_NCLASSES];
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+
+static bool
+slab_enqueue(struct slab_class *class, void *obj)
+{
+	struct slab_cell *cell;
+	size_t pos, seq;
+	int64_t diff;
+
+	pos = atomic_load_explicit(&class->enqueue_pos, memory_order_relaxed);
+	for (;;) {
+		cell = &class->cells[pos & class->mask];
+		seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		diff = (int64_t)(seq - pos);
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&class->enqueue_pos, &pos, pos + 1, 
+			    memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (diff < 0)
+			return (false); /* full */
+		else
+			pos = atomic_load_explicit(&class->enqueue_pos, memory_order_relaxed);
+	}
+	cell->obj = obj;
+	atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+	return (true);
+}
+
+static void *
+slab_dequeue(struct slab_class *class)
+{
+	struct slab_cell *cell;
+	size_t pos, seq;
+	int64_t diff;
+	void *obj;
+
+	pos = atomic_load_explicit(&class->dequeue_pos, memory_order_relaxed);
+	for (;;) {
+		cell = &class->cells[pos & class->mask];
+		seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		diff = (int64_t)(seq - (pos + 1));
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&class->dequeue_pos, &pos, pos + 1, 
+			    memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (diff < 0)
+			return (NULL); /* empty */
+		else
+			pos = atomic_load_explicit(&class->dequeue_pos, memory_order_relaxed);
+	}
+	obj = cell->obj;
+	atomic_store_explicit(&cell->seq, pos + class->mask + 1, memory_order_release);
+	return (obj);
+}
+
+static void
+init_slab_class(struct slab_class *class, size_t size)
+{
+	size_t ncells;
+
+	ncells = MIN(MAX(SLAB_CACHE_LEN / size, SLAB_MIN_CELLS), SLAB_MAX_CELLS);
+	class->size = size;
+	class->mask = ncells - 1;
+	class->cells = calloc(ncells, sizeof(struct slab_cell));
+	if (class->cells == NULL)
+		err(EX_SOFTWARE, "%s: calloc failed", __func__);
+	for (size_t i = 0; i < ncells; i++)
+		atomic_store_explicit(&class->cells[i].seq, i, memory_order_relaxed);
+	class->enqueue_pos = 0;
+	class->dequeue_pos = 0;
+	class->chunk = NULL;
+	class->overflow = NULL;
+	class->noverflow = 0;
+	class->overflow_len = 0;
+	pthread_mutex_init(&class->lock, NULL);
+}
+
+static void
+init_slab_classes(void)
+{
+	for (size_t i = 0; i < SLAB_NCLASSES; i++)
+		init_slab_class(&slab_classes[i], 1UL << (SLAB_MIN_SHIFT + i));
+	atomic_thread_fence(memory_order_release);
+}
+
+void
+ccslab_init(void)
+{
+	pthread_once(&slab_once, init_slab_classes);
+}
+
+static struct slab_class *
+get_slab_class(size_t len)
+{
+	int shift;
+
+	if (len <= (1UL << SLAB_MIN_SHIFT))
+		return (&slab_classes[0]);
+	shift = flsl(len - 1);
+	if (shift > SLAB_MAX_SHIFT)
+		return (NULL);
+	return (&slab_classes[shift - SLAB_MIN_SHIFT]);
+}
+
+static void *
+slab_carve(struct slab_class *class)
+{
+	void *cap, *new_cap, *chunk, *obj;
+
+	cap = atomic_load_explicit(&class->chunk, memory_order_acquire);
+	for (;;) {
+		if (cap == NULL || cheri_getlen(cap) - cheri_getoffset(cap) < class->size) {
+			pthread_mutex_lock(&class->lock);
+			cap = atomic_load_explicit(&class->chunk, memory_order_acquire);
+			if (cap == NULL || cheri_getlen(cap) - cheri_getoffset(cap) < class->size) {
+				/* objects are naturally aligned so their bounds are exact */
+				chunk = aligned_alloc(class->size, SLAB_CHUNK_LEN);
+				if (chunk == NULL) {
+					pthread_mutex_unlock(&class->lock);
+					return (NULL);
+				}
+				atomic_store_explicit(&class->chunk, chunk, memory_order_release);
+				cap = chunk;
+			}
+			pthread_mutex_unlock(&class->lock);
+		}
+		new_cap = cheri_incoffset(cap, class->size);
+		if (atomic_compare_exchange_weak_explicit(&class->chunk, &cap, new_cap, 
+		    memory_order_acq_rel, memory_order_acquire))
+			break;
+	}
+	obj = cheri_setboundsexact(cap, class->size);
+	return (obj);
+}
+
+static void *
+slab_pop_overflow(struct slab_class *class)
+{
+	void *obj;
+
+	obj = NULL;
+	pthread_mutex_lock(&class->lock);
+	if (class->noverflow != 0)
+		obj = class->overflow[--class->noverflow];
+	pthread_mutex_unlock(&class->lock);
+	return (obj);
+}
+
+static void
+slab_push_overflow(struct slab_class *class, void *obj)
+{
+	pthread_mutex_lock(&class->lock);
+	if (class->noverflow == class->overflow_len) {
+		class->overflow_len = MAX(class->overflow_len * 2, SLAB_MIN_CELLS);
+		class->overflow = realloc(class->overflow, class->overflow_len * sizeof(void *));
+		if (class->overflow == NULL)
+			err(EX_SOFTWARE, "%s: realloc failed", __func__);
+	}
+	class->overflow[class->noverflow++] = obj;
+	pthread_mutex_unlock(&class->lock);
+}
+
+/*
+ * Returns an object of the smallest class that fits len. The object's bounds
+ * cover the whole class; use ccslab_bound to get a capability for len bytes.
+ */
+void *
+ccslab_alloc(size_t len)
+{
+	struct slab_class *class;
+	void *obj;
+
+	class = get_slab_class(len);
+	if (class == NULL) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	assert(class->cells != NULL);
+
+	obj = slab_dequeue(class);
+	if (obj != NULL)
+		return (obj);
+	if (class->size >= SLAB_CHUNK_LEN) {
+		obj = aligned_alloc(class->size, class->size);
+		if (obj == NULL)
+			return (NULL);
+		return (cheri_setboundsexact(obj, class->size));
+	} 
+	if (atomic_load_explicit(&class->noverflow, memory_order_relaxed) != 0) {
+		obj = slab_pop_overflow(class);
+		if (obj != NULL)
+			return (obj);
+	}
+	return (slab_carve(class));
+}
+
+/*
+ * Bounds obj to len bytes. If the bounds have to be rounded up to be 
+ * representable, the extra bytes are zeroed so no stale data is exposed.
+ */
+void *
+ccslab_bound(void *obj, size_t len)
+{
+	void *buf;
+	size_t buf_len;
+
+	buf = cheri_setbounds(obj, len);
+	buf_len = cheri_getlen(buf);
+	if (buf_len > len)
+		memset((char *)buf + len, '\0', buf_len - len);
+	return (buf);
+}
+
+void
+ccslab_free(void *obj)
+{
+	struct slab_class *class;
+	size_t len;
+
+	len = cheri_getlen(obj);
+	class = get_slab_class(len);
+	if (class == NULL || class->size != len || cheri_getoffset(obj) != 0)
+		err(EX_SOFTWARE, "%s: %p is not a slab object", __func__, obj);
+
+	if (slab_enqueue(class, obj))
+		return;
+	else if (class->size >= SLAB_CHUNK_LEN)
+		free(obj);
+	else
+		slab_push_overflow(class, obj);
+}
@@ -66,6 +66,18 @@ copipe_corecv_cinvoke(void *codecap, const coport_t *coport, void *buf, const vo
     return (coport_cinvoke(codecap, coport, buf, ret_sealcap, len, COPORT_OP_CORECV));
 }
 
+ssize_t 
+copipe_post_cinvoke(void *codecap, const coport_t *coport, void *buf, const void *ret_sealcap, size_t len)
+{
+    return (coport_cinvoke(codecap, coport, buf, ret_sealcap, len, COPORT_OP_POST));
+}
+
+ssize_t 
+copipe_complete_cinvoke(void *codecap, const coport_t *coport, void *buf, const void *ret_sealcap, size_t len)
+{
+    return (coport_cinvoke(codecap, coport, buf, ret_sealcap, len, COPORT_OP_COMPLETE));
+}
+
 ssize_t 
 cochannel_cosend_cinvoke(void *codecap, const coport_t *coport, const void *buf, const void *ret_sealcap, size_t len)
 {
@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2020 Peter S. Blandford-Baker
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology) under DARPA contract HR0011-18-C-0016 ("ECATS"), as part of the
+ * DARPA SSITH research programme.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cochannel_ring.h"
+
+#include <comsg/coport.h>
+
+#include <cheri/cheric.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/errno.h>
+#include <sys/param.h>
+
+#define RING_SPINS_BEFORE_YIELD (64)
+
+static inline size_t
+ring_frame_len(size_t len)
+{
+    /* keep headers aligned so they never straddle the end of the buffer */
+    return (roundup2(COCHANNEL_RING_HDR_LEN + len, COCHANNEL_RING_HDR_LEN));
+}
+
+static inline bool
+ring_closed(const coport_t *port)
+{
+    coport_status_t status;
+
+    status = atomic_load_explicit(&port->info->status, memory_order_relaxed);
+    return (status == COPORT_CLOSING || status == COPORT_CLOSED);
+}
+
+static void
+ring_copy_in(char *ring_buf, size_t ring_len, size_t pos, const void *src, size_t len)
+{
+    size_t offset, len_to_end;
+
+    offset = pos & (ring_len - 1);
+    len_to_end = ring_len - offset;
+    if (len > len_to_end) {
+        memcpy(&ring_buf[offset], src, len_to_end);
+        memcpy(ring_buf, (const char *)src + len_to_end, len - len_to_end);
+    } else
+        memcpy(&ring_buf[offset], src, len);
+}
+
+static void
+ring_copy_out(void *dst, const char *ring_buf, size_t ring_len, size_t pos, size_t len)
+{
+    size_t offset, len_to_end;
+
+    offset = pos & (ring_len - 1);
+    len_to_end = ring_len - offset;
+    if (len > len_to_end) {
+        memcpy(dst, &ring_buf[offset], len_to_end);
+        memcpy((char *)dst + len_to_end, ring_buf, len - len_to_end);
+    } else
+        memcpy(dst, &ring_buf[offset], len);
+}
+
+/*
+ * With multiple producers (or consumers), slots are claimed in order but may
+ * be filled out of order. Wait for earlier claimants to publish before we do.
+ */
+static void
+ring_wait_tail(_Atomic size_t *tail, size_t expected)
+{
+    int i;
+
+    for (i = 1; atomic_load_explicit(tail, memory_order_relaxed) != expected; i++) {
+        if ((i % RING_SPINS_BEFORE_YIELD) == 0)
+            sched_yield();
+    }
+}
+
+/*
+ * Recompute COPOLL_IN and COPOLL_OUT from the published tails, as the locked
+ * cochannel path does after each op. Ops race here, so retry until the tails
+ * we based the mask on are still current once it is stored.
+ */
+static void
+ring_update_events(const coport_t *port)
+{
+    struct _coport_ring *ring;
+    coport_eventmask_t event, new_event;
+    size_t ring_len, prod, cons;
+
+    ring = &port->cd->ring;
+    ring_len = cheri_getlen(port->buffer->buf);
+    event = atomic_load_explicit(&port->info->event, memory_order_relaxed);
+    for (;;) {
+        prod = atomic_load_explicit(&ring->prod_tail, memory_order_acquire);
+        cons = atomic_load_explicit(&ring->cons_tail, memory_order_acquire);
+        new_event = event & ~(COPOLL_IN | COPOLL_OUT);
+        if (prod != cons)
+            new_event |= COPOLL_IN;
+        if (ring_len - (prod - cons) >= ring_frame_len(1))
+            new_event |= COPOLL_OUT;
+        if (!atomic_compare_exchange_weak_explicit(&port->info->event, &event,
+            new_event, memory_order_acq_rel, memory_order_relaxed))
+            continue;
+        if (prod == atomic_load_explicit(&ring->prod_tail, memory_order_acquire) &&
+            cons == atomic_load_explicit(&ring->cons_tail, memory_order_acquire))
+            break;
+        event = new_event;
+    }
+}
+
+ssize_t
+cochannel_ring_send(const coport_t *port, const void *buf, size_t len)
+{
+    struct _coport_ring *ring;
+    char *ring_buf;
+    size_t ring_len, frame_len, head, next, tail;
+    bool mpmc;
+
+    if (ring_closed(port)) {
+        errno = EPIPE;
+        return (-1);
+    }
+    ring = &port->cd->ring;
+    ring_buf = port->buffer->buf;
+    ring_len = cheri_getlen(ring_buf);
+    frame_len = ring_frame_len(len);
+    if (cheri_getlen(buf) < len || frame_len > ring_len) {
+        errno = EMSGSIZE;
+        return (-1);
+    }
+    mpmc = ((port->flags & COPORT_MPMC) != 0);
+
+    head = atomic_load_explicit(&ring->prod_head, memory_order_relaxed);
+    for (;;) {
+        tail = atomic_load_explicit(&ring->cons_tail, memory_order_acquire);
+        if (ring_len - (head - tail) < frame_len) {
+            errno = EWOULDBLOCK;
+            return (-1);
+        }
+        next = head + frame_len;
+        if (!mpmc) {
+            atomic_store_explicit(&ring->prod_head, next, memory_order_relaxed);
+            break;
+        } else if (atomic_compare_exchange_weak_explicit(&ring->prod_head, 
+            &head, next, memory_order_relaxed, memory_order_relaxed))
+            break;
+    }
+
+    ring_copy_in(ring_buf, ring_len, head, &len, COCHANNEL_RING_HDR_LEN);
+    ring_copy_in(ring_buf, ring_len, head + COCHANNEL_RING_HDR_LEN, 
+        cheri_andperm(buf, COPORT_INBUF_PERMS), len);
+
+    if (mpmc)
+        ring_wait_tail(&ring->prod_tail, head);
+    atomic_store_explicit(&ring->prod_tail, next, memory_order_release);
+    coport_stat_level(port->info, next - tail);
+    ring_update_events(port);
+
+    return ((ssize_t)len);
+}
+
+ssize_t
+cochannel_ring_recv(const coport_t *port, void *buf, size_t len)
+{
+    struct _coport_ring *ring;
+    char *ring_buf;
+    size_t ring_len, msg_len, head, next, tail;
+    bool mpmc;
+
+    ring = &port->cd->ring;
+    ring_buf = port->buffer->buf;
+    ring_len = cheri_getlen(ring_buf);
+    mpmc = ((port->flags & COPORT_MPMC) != 0);
+    if (cheri_getlen(buf) < len) {
+        errno = EMSGSIZE;
+        return (-1);
+    }
+
+    head = atomic_load_explicit(&ring->cons_head, memory_order_relaxed);
+    for (;;) {
+        tail = atomic_load_explicit(&ring->prod_tail, memory_order_acquire);
+        if (head == tail) {
+            /* messages sent before close can still be drained */
+            errno = ring_closed(port) ? EPIPE : EAGAIN;
+            return (-1);
+        }
+        ring_copy_out(&msg_len, ring_buf, ring_len, head, COCHANNEL_RING_HDR_LEN);
+        if (mpmc && head != atomic_load_explicit(&ring->cons_head, memory_order_acquire)) {
+            /* another consumer took this frame; header may be stale */
+            head = atomic_load_explicit(&ring->cons_head, memory_order_relaxed);
+            continue;
+        } 
+        if (msg_len > len) {
+            /* leave the message queued for a larger buffer */
+            errno = EMSGSIZE;
+            return (-1);
+        }
+        next = head + ring_frame_len(msg_len);
+        if (!mpmc) {
+            atomic_store_explicit(&ring->cons_head, next, memory_order_relaxed);
+            break;
+        } else if (atomic_compare_exchange_weak_explicit(&ring->cons_head, 
+            &head, next, memory_order_relaxed, memory_order_relaxed))
+            break;
+    }
+
+    ring_copy_out(cheri_andperm(buf, COPORT_OUTBUF_PERMS), ring_buf, ring_len, 
+        head + COCHANNEL_RING_HDR_LEN, msg_len);
+
+    if (mpmc)
+        ring_wait_tail(&ring->cons_tail, head);
+    atomic_store_explicit(&ring->cons_tail, next, memory_order_release);
+    ring_update_events(port);
+
+    return ((ssize_t)msg_len);
+}
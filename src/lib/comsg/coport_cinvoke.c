@@ -43,10 +43,13 @@
 #include <cheri/cheric.h>
 #include <cheri/cherireg.h>
 #include <err.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <sys/errno.h>
 #include <sys/sysctl.h>
 #include <sys/types.h>
+#include <sys/umtx.h>
 
 static coport_func_ptr _cosend_codecap = NULL;
 static coport_func_ptr _corecv_codecap = NULL;
@@ -54,6 +57,8 @@ static coport_func_ptr _corecv_codecap = NULL;
 static coport_func_ptr _cosend_codecap_copipe = NULL;
 static coport_func_ptr _corecv_codecap_copipe = NULL;
 static coport_ready_func_ptr _copipe_ready_codecap = NULL;
+static coport_func_ptr _copipe_post_codecap = NULL;
+static coport_func_ptr _copipe_complete_codecap = NULL;
 
 static coport_func_ptr _cosend_codecap_cochannel = NULL;
 static coport_func_ptr _corecv_codecap_cochannel  = NULL;
@@ -66,6 +71,8 @@ const coport_func_ptr *corecv_codecap = &_corecv_codecap;
 const coport_func_ptr *cosend_codecap_copipe = &_cosend_codecap_copipe;
 const coport_func_ptr *corecv_codecap_copipe = &_corecv_codecap_copipe;
 const coport_ready_func_ptr *copipe_ready_codecap = &_copipe_ready_codecap;
+const coport_func_ptr *copipe_post_codecap = &_copipe_post_codecap;
+const coport_func_ptr *copipe_complete_codecap = &_copipe_complete_codecap;
 
 const coport_func_ptr *cosend_codecap_cochannel = &_cosend_codecap_cochannel;
 const coport_func_ptr *corecv_codecap_cochannel = &_corecv_codecap_cochannel;
@@ -73,15 +80,63 @@ const coport_func_ptr *corecv_codecap_cochannel = &_corecv_codecap_cochannel;
 const void **return_stack_sealcap = (const void **)&_stack_sealcap;
 
 
+/*
+ * Copipe and cochannel ops run here, out of ipcd's sight, so each is counted
+ * in info->users. coclose marks the count draining and waits for it to empty
+ * before the slot can be recycled; ops that arrive after that fail.
+ */
+static inline __always_inline void
+leave_coport_op(coport_t *port)
+{
+    if (atomic_fetch_sub_explicit(&port->info->users, 1, memory_order_seq_cst) == (COPORT_USERS_DRAINING | 1))
+        _umtx_op(&port->info->users, UMTX_OP_WAKE, INT_MAX, NULL, NULL);
+}
+
+static inline __always_inline bool
+enter_coport_op(coport_t *port)
+{
+    if ((atomic_fetch_add_explicit(&port->info->users, 1, memory_order_seq_cst) & COPORT_USERS_DRAINING) == 0)
+        return (true);
+    leave_coport_op(port);
+    return (false);
+}
+
+/* On success the op has been entered, and must call leave_coport_op */
 static inline __always_inline int
 validate_coport_op_args(coport_t *port, void *buf, size_t len)
 {
-    if (cheri_getlen(buf) < len) 
-        return (ENOBUFS);
+    int error;
+
+    if (!enter_coport_op(port))
+        return (EPIPE);
+    else if (!coport_handle_current(port))
+        error = EPIPE; /* closed, and its slot recycled by ipcd */
+    else if (cheri_getlen(buf) < len) 
+        error = ENOBUFS;
     else if (len == 0)
-        return (EINVAL);
+        error = EINVAL;
     else 
         return (0);
+    leave_coport_op(port);
+    return (error);
+}
+
+/* Counted here rather than in each op so that every return path is covered */
+static inline __always_inline void
+count_coport_op(coport_t *port, ssize_t retval, bool send)
+{
+    if (retval >= 0 && send) {
+        COPORT_STAT_INC(port, sends);
+        COPORT_STAT_ADD(port, bytes_sent, (uint64_t)retval);
+    } else if (retval >= 0) {
+        COPORT_STAT_INC(port, recvs);
+        COPORT_STAT_ADD(port, bytes_recvd, (uint64_t)retval);
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        if (send)
+            COPORT_STAT_INC(port, send_full);
+        else
+            COPORT_STAT_INC(port, recv_empty);
+    }
 }
 
 static ssize_t
@@ -110,6 +165,8 @@ cosend_impl(coport_t *port, void *buf, size_t len)
         retval = -1;
         break;
     }
+    count_coport_op(port, retval, true);
+    leave_coport_op(port);
     /* XXX-PBB: absent a working calling convention that uses a ccall-based method, this will do */
     /* TODO-PBB: clear registers etc */
     CCALL_RETURN(retval); 
@@ -143,6 +200,8 @@ corecv_impl(coport_t *port, void *buf, size_t len)
         retval = -1;
         break;
     }
+    count_coport_op(port, retval, false);
+    leave_coport_op(port);
     CCALL_RETURN(retval);
     return (retval);  /* NOTREACHED */
 }
@@ -162,6 +221,8 @@ corecv_impl_cochannel(coport_t *port, void *buf, size_t len)
         CCALL_RETURN(retval);
     }
     retval = cochannel_recv(port, buf, len);
+    count_coport_op(port, retval, false);
+    leave_coport_op(port);
     CCALL_RETURN(retval);
     return (retval);  /* NOTREACHED */
 }
@@ -179,6 +240,8 @@ corecv_impl_copipe(coport_t *port, void *buf, size_t len)
         CCALL_RETURN(retval);
     }
     retval = copipe_recv(port, buf, len);
+    count_coport_op(port, retval, false);
+    leave_coport_op(port);
     CCALL_RETURN(retval);
     return (retval);  /* NOTREACHED */
 }
@@ -198,6 +261,8 @@ cosend_impl_copipe(coport_t *port, void *buf, size_t len)
         CCALL_RETURN(retval);
     }
     retval = copipe_send(port, buf, len);
+    count_coport_op(port, retval, true);
+    leave_coport_op(port);
     CCALL_RETURN(retval);
     return (retval);  /* NOTREACHED */
 }
@@ -207,11 +272,65 @@ copipe_ready_impl(coport_t *port)
 {
     bool retval;
     GET_IDC(port);
-    retval = atomic_load_explicit(&port->info->status, memory_order_acquire) == COPORT_READY;
+    retval = coport_handle_current(port) && 
+        atomic_load_explicit(&port->info->status, memory_order_acquire) == COPORT_READY;
     CCALL_RETURN(retval);
     return (retval); /* NOTREACHED */
 }
 
+static ssize_t
+copipe_post_impl(coport_t *port, void *buf, size_t len)
+{
+    ssize_t retval;
+    GET_IDC(port);
+
+    retval = validate_coport_op_args(port, buf, len);
+    if (retval != 0) {
+        errno = retval;
+        retval = -1;
+        CCALL_RETURN(retval);
+    }
+    if ((port->flags & COPORT_RECVQ) == 0) {
+        leave_coport_op(port);
+        errno = EOPNOTSUPP;
+        retval = -1;
+        CCALL_RETURN(retval);
+    }
+    retval = copipe_recvq_post(port, buf, len);
+    leave_coport_op(port);
+    CCALL_RETURN(retval);
+    return (retval);  /* NOTREACHED */
+}
+
+/* buf points to where the filled buffer should be returned */
+static ssize_t
+copipe_complete_impl(coport_t *port, void *buf, size_t len)
+{
+    ssize_t retval;
+    GET_IDC(port);
+
+    if (!enter_coport_op(port)) {
+        errno = EPIPE;
+        retval = -1;
+        CCALL_RETURN(retval);
+    } else if (!coport_handle_current(port)) {
+        leave_coport_op(port);
+        errno = EPIPE;
+        retval = -1;
+        CCALL_RETURN(retval);
+    } else if (cheri_getlen(buf) < sizeof(void *) || (port->flags & COPORT_RECVQ) == 0) {
+        leave_coport_op(port);
+        errno = (cheri_getlen(buf) < sizeof(void *)) ? EINVAL : EOPNOTSUPP;
+        retval = -1;
+        CCALL_RETURN(retval);
+    }
+    retval = copipe_recvq_complete(port, (void **)buf);
+    count_coport_op(port, retval, false);
+    leave_coport_op(port);
+    CCALL_RETURN(retval);
+    return (retval);  /* NOTREACHED */
+}
+
 static ssize_t
 cosend_impl_cochannel(coport_t *port, void *buf, size_t len)
 {
@@ -225,6 +344,8 @@ cosend_impl_cochannel(coport_t *port, void *buf, size_t len)
         CCALL_RETURN(retval);
     }
     retval = cochannel_send(port, buf, len);
+    count_coport_op(port, retval, true);
+    leave_coport_op(port);
     CCALL_RETURN(retval);
     return (retval);  /* NOTREACHED */
 }
@@ -243,6 +364,12 @@ coport_cinvoke_trampoline_landing(coport_t *port, void *buf, size_t len, coport_
     case COPORT_OP_POLL:
         return (ssize_t)copipe_ready_impl(port);
         break;
+    case COPORT_OP_POST:
+        return copipe_post_impl(port, buf, len);
+        break;
+    case COPORT_OP_COMPLETE:
+        return copipe_complete_impl(port, buf, len);
+        break;
     default:
         errno = ENOSYS;
         return (-1);
@@ -275,6 +402,8 @@ setup_cinvoke_targets(void *copipe_sealcap, void *cochannel_sealcap)
     _corecv_codecap_cochannel =  cheri_seal(GET_CODECAP(corecv_impl_cochannel), cochannel_sealcap);
 
     _copipe_ready_codecap = cheri_seal(GET_CODECAP(copipe_ready_impl), copipe_sealcap);
+    _copipe_post_codecap = cheri_seal(GET_CODECAP(copipe_post_impl), copipe_sealcap);
+    _copipe_complete_codecap = cheri_seal(GET_CODECAP(copipe_complete_impl), copipe_sealcap);
 
 
     assert(cheri_getperm(_cosend_codecap) & CHERI_PERM_INVOKE);
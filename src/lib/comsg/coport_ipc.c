@@ -91,6 +91,18 @@ open_coport(coport_type_t type)
     return (port);
 }
 
+coport_t *
+open_coport2(coport_type_t type, coport_flags_t flags, size_t capacity)
+{
+    coport_t *port;
+
+    port = coopen2(type, flags, capacity);
+    if (port == NULL)
+        return (NULL);
+    port = process_coport_handle(port, type);
+    return (port);
+}
+
 ssize_t
 cosend(const coport_t *port, const void *buf, size_t len)
 {
@@ -114,6 +126,7 @@ cosend(const coport_t *port, const void *buf, size_t len)
             retval = cosend_cinvoke_copipe(port, buf, len);
         break;
     case COCARRIER:
+    case COBROADCAST:
         /* len is an optional hint here, so we're not so worried */
         retval = cocarrier_send(port, buf, len);
         break;
@@ -149,6 +162,7 @@ corecv(const coport_t *port, void ** const buf, size_t len)
             retval = corecv_cinvoke_copipe(port, *buf, len);
         break;
     case COCARRIER:
+    case COBROADCAST:
         /* len is an optional hint here, so we're not so worried */
         retval = cocarrier_recv(port, buf, len);
         break;
@@ -160,6 +174,204 @@ corecv(const coport_t *port, void ** const buf, size_t len)
     return (retval);
 }
 
+/*
+ * As corecv, but also returns a handle that coport_msg_free_handle can use to
+ * free the message without ipcd searching the cocarrier for it.
+ */
+ssize_t
+corecv_handle(const coport_t *port, void ** const buf, size_t len, comsg_handle_t *handle)
+{
+    switch(coport_gettype(port)) {
+    case COCARRIER:
+        return (cocarrier_recv_handle(port, buf, len, handle));
+    case COCHANNEL:
+    case COPIPE:
+    case COBROADCAST:
+        errno = EOPNOTSUPP;
+        return (-1);
+    default:
+        errno = EINVAL;
+        return (-1);
+    }
+}
+
+/*
+ * As cosend, but waits up to timeout ms (forever if negative) for room on a 
+ * full COCARRIER. Senders on COPORT_CREDIT cocarriers sleep in ipcd until a
+ * receiver returns a credit. Fails with ETIMEDOUT if none frees up.
+ */
+ssize_t
+cosend_timed(const coport_t *port, const void *buf, size_t len, int timeout)
+{
+    switch(coport_gettype(port)) {
+    case COCARRIER:
+        return (cocarrier_send_timed(port, buf, len, timeout));
+    case COCHANNEL:
+    case COPIPE:
+    case COBROADCAST:
+        errno = EOPNOTSUPP;
+        return (-1);
+    default:
+        errno = EINVAL;
+        return (-1);
+    }
+}
+
+/*
+ * As corecv_handle, but waits up to timeout ms (forever if negative) for a 
+ * message to arrive on an empty COCARRIER. Fails with ETIMEDOUT if none does.
+ * handle may be NULL.
+ */
+ssize_t
+corecv_timed(const coport_t *port, void ** const buf, size_t len, int timeout, comsg_handle_t *handle)
+{
+    switch(coport_gettype(port)) {
+    case COCARRIER:
+        return (cocarrier_recv_timed(port, buf, len, timeout, handle));
+    case COCHANNEL:
+    case COPIPE:
+    case COBROADCAST:
+        errno = EOPNOTSUPP;
+        return (-1);
+    default:
+        errno = EINVAL;
+        return (-1);
+    }
+}
+
+struct _cocarrier_consumer {
+    const coport_t *port;
+    const struct _cocarrier_userq *userq; /* read-only */
+    _Atomic size_t *cons;
+};
+
+/*
+ * For COCARRIERs opened with COPORT_USERDEQ. The consumer reads ipcd's 
+ * published ring directly; ipcd is only called when the ring is empty and the
+ * caller is willing to wait.
+ */
+cocarrier_consumer_t *
+cocarrier_consumer(const coport_t *port)
+{
+    cocarrier_consumer_t *consumer;
+    struct _cocarrier_userq *userq;
+    _Atomic size_t *cons;
+
+    if (coport_gettype(port) != COCARRIER) {
+        errno = EINVAL;
+        return (NULL);
+    }
+    userq = cocarrier_userq(port, &cons);
+    if (userq == NULL)
+        return (NULL);
+    consumer = malloc(sizeof(cocarrier_consumer_t));
+    if (consumer == NULL)
+        return (NULL);
+    consumer->port = port;
+    consumer->userq = userq;
+    consumer->cons = cons;
+    return (consumer);
+}
+
+/*
+ * Received messages are freed with coport_msg_free, as for corecv. Messages 
+ * with attachments must be received with corecv_oob, so fail with EBADMSG.
+ */
+ssize_t
+cocarrier_consume(cocarrier_consumer_t *consumer, void ** const buf, int timeout)
+{
+    const struct _cocarrier_userq *userq;
+    struct cocarrier_userq_slot slot;
+    size_t prod, cons;
+
+    userq = consumer->userq;
+    cons = atomic_load_explicit(consumer->cons, memory_order_relaxed);
+    do {
+        prod = atomic_load_explicit(&userq->prod, memory_order_acquire);
+        if (prod == cons) {
+            if (timeout == 0) {
+                errno = EAGAIN;
+                return (-1);
+            }
+            return (corecv_timed(consumer->port, buf, 0, timeout, NULL));
+        }
+        /* ipcd cannot reuse the slot until cons moves past it */
+        slot = userq->slots[cons & (userq->depth - 1)];
+        if (slot.nattachments != 0) {
+            errno = EBADMSG;
+            return (-1);
+        }
+    } while (!atomic_compare_exchange_weak_explicit(consumer->cons, &cons, cons + 1, memory_order_acq_rel, memory_order_relaxed));
+
+    *buf = slot.buf;
+    return ((ssize_t)cheri_getlen(slot.buf));
+}
+
+void
+cocarrier_consumer_free(cocarrier_consumer_t *consumer)
+{
+    free(consumer);
+}
+
+/*
+ * For COPIPEs opened with COPORT_RECVQ. copipe_post queues a receive buffer
+ * without waiting for a sender; copipe_complete waits for the oldest posted 
+ * buffer to be filled and returns it with the message length.
+ */
+int
+copipe_post(const coport_t *port, void *buf, size_t len)
+{
+    if (coport_gettype(port) != COPIPE) {
+        errno = EINVAL;
+        return (-1);
+    } else if (len == 0) {
+        errno = EINVAL;
+        return (-1);
+    }
+    return ((int)post_cinvoke_copipe(port, buf, len));
+}
+
+ssize_t
+copipe_complete(const coport_t *port, void **buf)
+{
+    if (coport_gettype(port) != COPIPE) {
+        errno = EINVAL;
+        return (-1);
+    }
+    return (complete_cinvoke_copipe(port, buf));
+}
+
+/*
+ * Subscribers to a COBROADCAST coport see every message sent after they 
+ * subscribe. The returned handle is passed to corecv; messages received through
+ * it stay valid until every other subscriber has received them and the slot is
+ * reused, and are not freed with coport_msg_free.
+ */
+coport_t *
+cobroadcast_subscribe(const coport_t *port)
+{
+    coport_t *subscriber;
+
+    if (coport_gettype(port) != COBROADCAST) {
+        errno = EINVAL;
+        return (NULL);
+    }
+    subscriber = cosubscribe((coport_t *)port);
+    if (subscriber == NULL)
+        return (NULL);
+    return (process_coport_handle(subscriber, COBROADCAST));
+}
+
+int
+cobroadcast_unsubscribe(coport_t *subscriber)
+{
+    if (coport_gettype(subscriber) != COBROADCAST) {
+        errno = EINVAL;
+        return (-1);
+    }
+    return (counsubscribe(subscriber));
+}
+
 void
 make_pollcoport(pollcoport_t *pcpt, coport_t *port, coport_eventmask_t events)
 {
@@ -184,6 +396,7 @@ cosend_oob(const coport_t *port, const void *buf, size_t len, comsg_attachment_t
     switch(type) {
     case COCHANNEL:
     case COPIPE:
+    case COBROADCAST:
         errno = EOPNOTSUPP;
         retval = -1;
         break;
@@ -214,6 +427,7 @@ corecv_oob(const coport_t *port, void ** const buf, size_t len, comsg_attachment
         break;
     case COCHANNEL:
     case COPIPE:
+    case COBROADCAST:
         errno = EOPNOTSUPP;
         retval = -1;
         break;
@@ -223,4 +437,102 @@ corecv_oob(const coport_t *port, void ** const buf, size_t len, comsg_attachment
         break;
     }
     return (retval);
-}
\ No newline at end of file
+}
+
+/*
+ * Send up to n messages, COCARRIER_MAX_BATCH per cocall. Returns the number
+ * sent, which is less than n if the coport filled up.
+ */
+ssize_t
+cosendv(const coport_t *port, const struct iovec *iov, size_t n)
+{
+    size_t batch, total;
+    int sent;
+
+    if (n == 0) {
+        errno = EINVAL;
+        return (-1);
+    }
+    switch(coport_gettype(port)) {
+    case COCARRIER:
+        break;
+    case COCHANNEL:
+    case COPIPE:
+    case COBROADCAST:
+        errno = EOPNOTSUPP;
+        return (-1);
+    default:
+        errno = EINVAL;
+        return (-1);
+    }
+    for (total = 0; total < n; total += sent) {
+        batch = MIN(n - total, COCARRIER_MAX_BATCH);
+        sent = cocarrier_sendv(port, &iov[total], batch);
+        if (sent == -1)
+            return (total == 0 ? -1 : (ssize_t)total);
+        else if ((size_t)sent < batch)
+            return ((ssize_t)(total + sent));
+    }
+    return ((ssize_t)total);
+}
+
+/*
+ * Send one COCARRIER message made of iovcnt fragments (at most 
+ * COCARRIER_MAX_BATCH), e.g. a header and its payload. ipcd gathers them 
+ * straight into its copy of the message. Returns the message length.
+ */
+ssize_t
+cosend_iov(const coport_t *port, const struct iovec *iov, size_t iovcnt)
+{
+    switch(coport_gettype(port)) {
+    case COCARRIER:
+        return (cocarrier_send_iov(port, iov, iovcnt));
+    case COCHANNEL:
+    case COPIPE:
+    case COBROADCAST:
+        errno = EOPNOTSUPP;
+        return (-1);
+    default:
+        errno = EINVAL;
+        return (-1);
+    }
+}
+
+/*
+ * Receive up to n messages into bufs. Each received buffer is bounded to the
+ * message length and must be released with coport_msg_free, or in constant 
+ * time with coport_msg_free_handle on the matching entry of handles (which
+ * may be NULL).
+ */
+ssize_t
+corecvv(const coport_t *port, void **bufs, comsg_handle_t *handles, size_t n)
+{
+    size_t batch, total;
+    int recvd;
+
+    if (n == 0) {
+        errno = EINVAL;
+        return (-1);
+    }
+    switch(coport_gettype(port)) {
+    case COCARRIER:
+        break;
+    case COCHANNEL:
+    case COPIPE:
+    case COBROADCAST:
+        errno = EOPNOTSUPP;
+        return (-1);
+    default:
+        errno = EINVAL;
+        return (-1);
+    }
+    for (total = 0; total < n; total += recvd) {
+        batch = MIN(n - total, COCARRIER_MAX_BATCH);
+        recvd = cocarrier_recvv(port, &bufs[total], (handles == NULL) ? NULL : &handles[total], batch);
+        if (recvd == -1)
+            return (total == 0 ? -1 : (ssize_t)total);
+        else if ((size_t)recvd < batch)
+            return ((ssize_t)(total + recvd));
+    }
+    return ((ssize_t)total);
+}
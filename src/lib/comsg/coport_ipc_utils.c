@@ -30,6 +30,7 @@
  */
 
 #include "coport_ipc_utils.h"
+#include "cochannel_ring.h"
 #include "coport_cinvoke.h"
 
 #include <comsg/coport.h>
@@ -39,6 +40,8 @@
 #include <assert.h>
 #include <cheri/cheric.h>
 #include <err.h>
+#include <limits.h>
+#include <sched.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -49,15 +52,22 @@
 #include <sys/sched.h>
 #include <sys/sysctl.h>
 #include <sys/time.h>
+#include <sys/types.h>
+#include <sys/umtx.h>
 #include <unistd.h>
 
 static bool multicore = 0;
-static double est_mem_bw = 0.0;
+static size_t spin_limit = 0;
+
+/* Roughly the cost of parking and being woken */
+#define COPORT_SPIN_NS (10000.0)
+#define COPORT_SPIN_CALIBRATION_ITERS (100000)
 
 static nsobject_t *cosend_obj = NULL;
 static nsobject_t *corecv_obj = NULL;
 
 static struct object_type copipe_otype, cochannel_otype, cocarrier_otype;
+static struct object_type cobroadcast_otype, cosubscriber_otype;
 static struct object_type *allocated_otypes[] = {&copipe_otype, &cochannel_otype};
 #define IPCD_OTYPE_RANGE_START (32)
 #define IPCD_OTYPE_RANGE_END (63)
@@ -89,6 +99,8 @@ coport_gettype(const coport_t *port)
         return (COCHANNEL);
     else if (port_otype == copipe_otype.otype)
         return (COPIPE);
+    else if (port_otype == cobroadcast_otype.otype || port_otype == cosubscriber_otype.otype)
+        return (COBROADCAST);
     else if (cocarrier_otype.otype == 0) {
         if (port_otype >= IPCD_OTYPE_RANGE_START && port_otype <= IPCD_OTYPE_RANGE_END) {
             cocarrier_otype.otype = port_otype;
@@ -131,6 +143,21 @@ process_coport_handle(coport_t *port, coport_type_t type)
             warn("process_coport_handle: cocarrier otype has changed!!");
         cocarrier_preload();
         break;
+    case COBROADCAST:
+        /* 
+         * Broadcast ports and their subscribers have distinct otypes; we learn
+         * the first from coopen or cobroadcast_subscribe, then the second.
+         */
+        if (cheri_gettype(port) == cobroadcast_otype.otype || cheri_gettype(port) == cosubscriber_otype.otype)
+            break;
+        else if (cobroadcast_otype.otype == 0)
+            cobroadcast_otype.otype = cheri_gettype(port);
+        else if (cosubscriber_otype.otype == 0)
+            cosubscriber_otype.otype = cheri_gettype(port);
+        else
+            warn("process_coport_handle: cobroadcast otype has changed!!");
+        cocarrier_preload();
+        break;
     default:
         err(ENOSYS, "coopen: ipcd returned unknown coport type");
         break; /* NOTREACHED */
@@ -139,77 +166,354 @@ process_coport_handle(coport_t *port, coport_type_t type)
 }
 
 /*
- * Calculates a wait time based on a rough estimate of the memcpy bandwidth
+ * Waiting for a coport status spins for about COPORT_SPIN_NS, which is 
+ * calibrated into an iteration count at startup, and then parks the thread on
+ * the status word with umtx. Releasers only make the wake syscall if someone 
+ * has parked, so idle ports cost nothing and uncontended handoffs stay in 
+ * userspace.
  */
-static struct timespec
-calculate_wait_time(size_t message_len)
+static coport_status_t
+try_acquire_coport_status(_Atomic(coport_status_t) *status_ptr, coport_status_t expected, coport_status_t desired, bool *done)
 {
-    struct timespec result;
-
-    if (est_mem_bw == 0.0) {
-        result.tv_sec = 0;
-        result.tv_nsec = 0;
-        return result;
-    }
-    double length = (double)(message_len);
-    double time = length / est_mem_bw;
-    time = time / 50;
-    if (time > 0.5)
-        time = 0.5;
-    
-    result.tv_sec = time;
-    result.tv_nsec = (time - (long)(time)) * nanoseconds;
-    //printf("Estimated memory bandwidth: %.2FB/s; Wait time calculated:%.2Fs\n", est_mem_bw, time);
-    
-    return (result);
+    coport_status_t status_val;
+
+    status_val = expected;
+    *done = true;
+    if (atomic_compare_exchange_strong_explicit(status_ptr, &status_val, desired, memory_order_acq_rel, memory_order_relaxed))
+        return (status_val);
+    switch (status_val) {
+    case COPORT_CLOSING:
+    case COPORT_CLOSED:
+        return (status_val);
+    default:
+        *done = false;
+        return (status_val);
+    }
+}
+
+/*
+ * Handles are checked against the slot generation on entry, but ipcd may 
+ * recycle the slot while we wait for its status. If the status we took belongs
+ * to a later coport, the caller hands it back and reports the port closed.
+ */
+static bool
+acquired_stale_status(const coport_t *port, coport_status_t expected, coport_status_t status_val)
+{
+    return (status_val == expected && !coport_handle_current(port));
 }
 
 coport_status_t 
 acquire_coport_status(const coport_t *port, coport_status_t expected, coport_status_t desired, size_t len)
 {
+    UNUSED(len);
     coport_status_t status_val;
     _Atomic(coport_status_t) *status_ptr;
-    int i;
+    bool done;
+    size_t i;
     
-    i = 0;
     status_ptr = &port->info->status;
-    status_val = expected;
-    for(;;i++) {
-        if (atomic_compare_exchange_strong_explicit(status_ptr, &status_val, desired, memory_order_acq_rel, memory_order_relaxed)) {
-            return (status_val);
-        } else {
-            switch (status_val) {
-            case COPORT_CLOSING:
-            case COPORT_CLOSED:
-                return (status_val);
-                break; /* NOTREACHED */
-            default:
-                status_val = expected;
-                break;
-            }
-            // If single-core, we need to yield the CPU
-            // If no progress is happening, we should yield
-            // If we've been yielding for a long time, we should try a short sleep
-            if (!multicore || (i % 10) == 0 && (i / 10) != 0) {
-                if (len > 0 && ((i % 1000) == 0) && est_mem_bw != 0.0) {
-                    struct timespec wait = calculate_wait_time(len);
-                    clock_nanosleep(CLOCK_MONOTONIC_PRECISE, 0, &wait, NULL);
-                } else {
-                    sched_yield();
-                }
-            }
+    for (i = 0; i <= spin_limit; i++) {
+        status_val = try_acquire_coport_status(status_ptr, expected, desired, &done);
+        if (done)
+            break;
+        COPORT_STAT_INC(port, cas_retries);
+        while (i < spin_limit && atomic_load_explicit(status_ptr, memory_order_relaxed) != expected)
+            i++;
+    }
+    if (done) {
+        if (acquired_stale_status(port, expected, status_val)) {
+            release_coport_status(port, expected);
+            return (COPORT_CLOSED);
         }
+        return (status_val);
     }
+
+    /* 
+     * Announce ourselves before the final check; a releaser that stores after 
+     * it will see waiters != 0 and wake us, and if it stored before, umtx will
+     * not sleep because the status no longer holds the value we saw.
+     */
+    atomic_fetch_add_explicit(&port->info->waiters, 1, memory_order_seq_cst);
+    for (;;) {
+        status_val = try_acquire_coport_status(status_ptr, expected, desired, &done);
+        if (done)
+            break;
+        _umtx_op(status_ptr, UMTX_OP_WAIT_UINT, (u_int)status_val, NULL, NULL);
+    }
+    atomic_fetch_sub_explicit(&port->info->waiters, 1, memory_order_relaxed);
+    if (acquired_stale_status(port, expected, status_val)) {
+        release_coport_status(port, expected);
+        return (COPORT_CLOSED);
+    }
+    return (status_val);
 }
 
 void
 release_coport_status(const coport_t *port, coport_status_t desired)
 {
-    atomic_store_explicit(&port->info->status, desired, memory_order_release);
+    atomic_store_explicit(&port->info->status, desired, memory_order_seq_cst);
+    /* Waiters want different statuses, so wake all of them */
+    if (atomic_load_explicit(&port->info->waiters, memory_order_seq_cst) != 0)
+        _umtx_op(&port->info->status, UMTX_OP_WAKE, INT_MAX, NULL, NULL);
 }
 
-#define acquire_copipe_status(p, e, d, l) acquire_coport_status(p, e, d, l)
-#define release_copipe_status(p, d) release_coport_status(p, d)
+static bool
+coport_closed(const coport_t *port)
+{
+    coport_status_t status;
+
+    status = atomic_load_explicit(&port->info->status, memory_order_acquire);
+    return (status == COPORT_CLOSING || status == COPORT_CLOSED);
+}
+
+/*
+ * As acquire_coport_status, but for the free-running indices of a 
+ * COPORT_RECVQ copipe: spin, then park until *index is no longer seen. 
+ * Returns false if the port closed, or its slot was recycled, instead.
+ */
+static bool
+wait_for_index(const coport_t *port, _Atomic size_t *index, size_t seen)
+{
+    size_t i;
+
+    for (i = 0; i < spin_limit; i++) {
+        if (atomic_load_explicit(index, memory_order_acquire) != seen)
+            return (true);
+    }
+    atomic_fetch_add_explicit(&port->info->waiters, 1, memory_order_seq_cst);
+    while (atomic_load_explicit(index, memory_order_seq_cst) == seen) {
+        if (coport_closed(port) || !coport_handle_current(port))
+            break;
+        _umtx_op(index, UMTX_OP_WAIT, seen, NULL, NULL);
+    }
+    atomic_fetch_sub_explicit(&port->info->waiters, 1, memory_order_relaxed);
+    if (!coport_handle_current(port))
+        return (false);
+    return (atomic_load_explicit(index, memory_order_acquire) != seen);
+}
+
+static void
+publish_index(const coport_t *port, _Atomic size_t *index, size_t value)
+{
+    atomic_store_explicit(index, value, memory_order_seq_cst);
+    if (atomic_load_explicit(&port->info->waiters, memory_order_seq_cst) != 0)
+        _umtx_op(index, UMTX_OP_WAKE, INT_MAX, NULL, NULL);
+}
+
+static inline struct copipe_recv_slot *
+get_recv_slot(const coport_t *port, size_t index)
+{
+    struct copipe_recv_slot *slots;
+    size_t depth;
+
+    slots = port->buffer->buf;
+    depth = cheri_getlen(slots) / sizeof(struct copipe_recv_slot);
+    return (&slots[index & (depth - 1)]);
+}
+
+/* 
+ * Posts a receive buffer to a COPORT_RECVQ copipe. Only one thread may post 
+ * and collect on a port at a time.
+ */
+int
+copipe_recvq_post(const coport_t *port, void *buf, size_t len)
+{
+    struct copipe_recv_slot *slot;
+    size_t posted, depth;
+
+    if (coport_closed(port)) {
+        errno = EPIPE;
+        return (-1);
+    }
+    depth = cheri_getlen(port->buffer->buf) / sizeof(struct copipe_recv_slot);
+    posted = atomic_load_explicit(&port->cd->recvq.posted, memory_order_relaxed);
+    if (posted - atomic_load_explicit(&port->cd->recvq.reaped, memory_order_relaxed) == depth) {
+        errno = EAGAIN;
+        return (-1);
+    }
+    if (cheri_getlen(buf) > len)
+        buf = cheri_setbounds(buf, len);
+    slot = get_recv_slot(port, posted);
+    slot->buf = cheri_andperm(buf, COPIPE_RECVBUF_PERMS);
+    slot->len = 0;
+    publish_index(port, &port->cd->recvq.posted, posted + 1);
+
+    return (0);
+}
+
+/* 
+ * Waits for the oldest posted buffer to be filled, returning it in *buf along
+ * with the length of the message written to it.
+ */
+ssize_t
+copipe_recvq_complete(const coport_t *port, void **buf)
+{
+    struct copipe_recv_slot *slot;
+    size_t reaped;
+    ssize_t len;
+
+    reaped = atomic_load_explicit(&port->cd->recvq.reaped, memory_order_relaxed);
+    if (reaped == atomic_load_explicit(&port->cd->recvq.posted, memory_order_relaxed)) {
+        errno = ENOBUFS;
+        return (-1);
+    }
+    if (atomic_load_explicit(&port->cd->recvq.fill_tail, memory_order_acquire) == reaped && 
+        !wait_for_index(port, &port->cd->recvq.fill_tail, reaped)) {
+        errno = EPIPE;
+        return (-1);
+    }
+    slot = get_recv_slot(port, reaped);
+    *buf = slot->buf;
+    len = slot->len;
+    slot->buf = NULL;
+    atomic_store_explicit(&port->cd->recvq.reaped, reaped + 1, memory_order_release);
+    if (len < 0) {
+        errno = EMSGSIZE;
+        return (-1);
+    }
+    return (len);
+}
+
+/* 
+ * Senders claim posted buffers in turn and copy straight into them; nothing 
+ * waits for the receiver unless it has no buffers posted.
+ */
+static ssize_t
+copipe_recvq_send(const coport_t *port, const void *buf, size_t len)
+{
+    struct copipe_recv_slot *slot;
+    size_t head;
+    void *out_buffer;
+    ssize_t retval;
+
+    head = atomic_load_explicit(&port->cd->recvq.fill_head, memory_order_relaxed);
+    for (;;) {
+        if (head == atomic_load_explicit(&port->cd->recvq.posted, memory_order_acquire)) {
+            if (!wait_for_index(port, &port->cd->recvq.posted, head)) {
+                errno = EPIPE;
+                return (-1);
+            }
+            head = atomic_load_explicit(&port->cd->recvq.fill_head, memory_order_relaxed);
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(&port->cd->recvq.fill_head, &head, head + 1, memory_order_acquire, memory_order_relaxed))
+            break;
+    }
+
+    slot = get_recv_slot(port, head);
+    out_buffer = slot->buf;
+    if (cheri_getlen(out_buffer) < len) {
+        slot->len = -1;
+        errno = EMSGSIZE;
+        retval = -1;
+    } else {
+        memcpy(out_buffer, cheri_andperm(buf, COPORT_INBUF_PERMS), len);
+        slot->len = (ssize_t)len;
+        retval = (ssize_t)len;
+    }
+
+    /* Complete in claim order so the receiver sees slots filled contiguously */
+    while (atomic_load_explicit(&port->cd->recvq.fill_tail, memory_order_relaxed) != head)
+        sched_yield();
+    publish_index(port, &port->cd->recvq.fill_tail, head + 1);
+
+    return (retval);
+}
+
+/*
+ * COPIPE wait policies, chosen at coopen. COPORT_WAIT_SPIN never sleeps, 
+ * COPORT_WAIT_BLOCK sleeps on the port's condvar straight away, and 
+ * COPORT_WAIT_HYBRID spins for spin_limit checks first. Copipes with neither
+ * flag use acquire_coport_status like other coports.
+ */
+static void
+lock_copipe_sync(const coport_t *port)
+{
+    int error;
+
+    error = pthread_mutex_lock(&port->cd->sync.lock);
+    if (error == EOWNERDEAD) /* status is only changed atomically, so is intact */
+        pthread_mutex_consistent(&port->cd->sync.lock);
+    else if (error != 0)
+        err(EX_SOFTWARE, "%s: pthread_mutex_lock failed", __func__);
+}
+
+static void
+release_copipe_status(const coport_t *port, coport_status_t desired)
+{
+    if ((port->flags & COPORT_WAIT_BLOCK) == 0) {
+        release_coport_status(port, desired);
+        return;
+    }
+    atomic_store_explicit(&port->info->status, desired, memory_order_seq_cst);
+    if (atomic_load_explicit(&port->info->waiters, memory_order_seq_cst) != 0) {
+        lock_copipe_sync(port);
+        pthread_cond_broadcast(&port->cd->sync.wakeup);
+        pthread_mutex_unlock(&port->cd->sync.lock);
+    }
+}
+
+static coport_status_t
+acquire_copipe_status(const coport_t *port, coport_status_t expected, coport_status_t desired)
+{
+    coport_status_t status_val;
+    _Atomic(coport_status_t) *status_ptr;
+    size_t i, limit;
+    bool done;
+
+    switch (port->flags & COPORT_WAIT_HYBRID) {
+    case COPORT_WAIT_SPIN:
+        limit = SIZE_MAX;
+        break;
+    case COPORT_WAIT_BLOCK:
+        limit = 0;
+        break;
+    case COPORT_WAIT_HYBRID:
+        limit = spin_limit;
+        break;
+    default:
+        return (acquire_coport_status(port, expected, desired, 0));
+    }
+
+    status_ptr = &port->info->status;
+    for (i = 0; i <= limit; i++) {
+        status_val = try_acquire_coport_status(status_ptr, expected, desired, &done);
+        if (done)
+            break;
+        COPORT_STAT_INC(port, cas_retries);
+        if (!multicore)
+            sched_yield(); /* whoever releases it needs this cpu */
+        else {
+            while (i < limit && atomic_load_explicit(status_ptr, memory_order_relaxed) != expected)
+                i++;
+        }
+    }
+    if (done) {
+        if (acquired_stale_status(port, expected, status_val)) {
+            release_copipe_status(port, expected);
+            return (COPORT_CLOSED);
+        }
+        return (status_val);
+    }
+
+    /* As acquire_coport_status; releasers broadcast under the lock if waiters != 0 */
+    atomic_fetch_add_explicit(&port->info->waiters, 1, memory_order_seq_cst);
+    lock_copipe_sync(port);
+    for (;;) {
+        status_val = try_acquire_coport_status(status_ptr, expected, desired, &done);
+        if (done)
+            break;
+        if (pthread_cond_wait(&port->cd->sync.wakeup, &port->cd->sync.lock) == EOWNERDEAD)
+            pthread_mutex_consistent(&port->cd->sync.lock);
+    }
+    pthread_mutex_unlock(&port->cd->sync.lock);
+    atomic_fetch_sub_explicit(&port->info->waiters, 1, memory_order_relaxed);
+    if (acquired_stale_status(port, expected, status_val)) {
+        release_copipe_status(port, expected);
+        return (COPORT_CLOSED);
+    }
+    return (status_val);
+}
 
 static bool
 check_coport_status(const coport_t *port, coport_status_t desired)
@@ -223,7 +527,10 @@ copipe_send(const coport_t *port, const void *buf, size_t len)
     void *out_buffer;
     coport_status_t status;
 
-    status = acquire_coport_status(port, COPORT_READY, COPORT_BUSY, 0);
+    if ((port->flags & COPORT_RECVQ) != 0)
+        return (copipe_recvq_send(port, buf, len));
+
+    status = acquire_copipe_status(port, COPORT_READY, COPORT_BUSY);
     if ((status == COPORT_CLOSING || status == COPORT_CLOSED)) {
         errno = EPIPE;
         return (-1);
@@ -231,35 +538,40 @@ copipe_send(const coport_t *port, const void *buf, size_t len)
     buf = cheri_andperm(buf, COPORT_INBUF_PERMS);
     out_buffer = port->buffer->buf;
     if(cheri_gettag(out_buffer) == 0) {
-        release_coport_status(port, COPORT_DONE);
+        release_copipe_status(port, COPORT_DONE);
         errno = EPROT;
         return (-1);
     }
     if (cheri_getlen(out_buffer) < len) {
-        release_coport_status(port, COPORT_READY);
+        release_copipe_status(port, COPORT_READY);
         errno = EMSGSIZE;
         return (-1);
     }
     memcpy(out_buffer, buf, len);
     port->info->length = len;
 
-    release_coport_status(port, COPORT_DONE);
+    release_copipe_status(port, COPORT_DONE);
     return ((ssize_t) len);
 }
 
 ssize_t
 cochannel_send(const coport_t *port, const void *buf, size_t len)
 {
-    size_t port_size, port_start, old_end, new_end, new_len;
+    size_t port_size, port_start, old_end, new_end, new_len, port_buf_len;
     ssize_t copied_bytes;
     char *port_buffer, *msg_buffer;
     coport_eventmask_t event;
     coport_status_t status;
 
+    if ((port->flags & COPORT_RING) != 0)
+        return (cochannel_ring_send(port, buf, len));
+
     port_size = port->info->length;
     new_len = len + port_size;
+    port_buffer = port->buffer->buf;
+    port_buf_len = cheri_getlen(port_buffer);
     
-    if(new_len > COPORT_BUF_LEN) {
+    if(new_len > port_buf_len) {
         errno = EWOULDBLOCK;
         return (-1);
     }
@@ -279,14 +591,13 @@ cochannel_send(const coport_t *port, const void *buf, size_t len)
         errno = EAGAIN;
         return (-1);
     }
-    port_buffer = port->buffer->buf;
     msg_buffer = (char *)cheri_andperm(buf, COPORT_INBUF_PERMS);
     
-    new_end = (old_end + len) % COPORT_BUF_LEN;
-    if (old_end + len > COPORT_BUF_LEN) {
-        memcpy(&port_buffer[old_end], msg_buffer, COPORT_BUF_LEN - old_end);
-        memcpy(port_buffer, &msg_buffer[COPORT_BUF_LEN - old_end], new_end);
-        copied_bytes = COPORT_BUF_LEN - (ssize_t) old_end;
+    new_end = (old_end + len) % port_buf_len;
+    if (old_end + len > port_buf_len) {
+        memcpy(&port_buffer[old_end], msg_buffer, port_buf_len - old_end);
+        memcpy(port_buffer, &msg_buffer[port_buf_len - old_end], new_end);
+        copied_bytes = port_buf_len - (ssize_t) old_end;
         copied_bytes += (ssize_t) new_end;
     } else {
         memcpy(&port_buffer[old_end], msg_buffer, len);
@@ -294,9 +605,10 @@ cochannel_send(const coport_t *port, const void *buf, size_t len)
     }
     port->info->end = new_end;
     port->info->length = new_len;
+    coport_stat_level(port->info, new_len);
     
     event |= COPOLL_IN;
-    if (new_len == COPORT_BUF_LEN) 
+    if (new_len == port_buf_len) 
         event &= ~COPOLL_OUT;
     port->info->event = event;
 
@@ -314,6 +626,9 @@ cochannel_recv(const coport_t *port, void *buf, size_t len)
     coport_eventmask_t event;
     coport_status_t status;
 
+    if ((port->flags & COPORT_RING) != 0)
+        return (cochannel_ring_recv(port, buf, len));
+
     port_size = port->info->length;
     if (cheri_getlen(buf) < len) {
         errno = EMSGSIZE;
@@ -338,7 +653,7 @@ cochannel_recv(const coport_t *port, void *buf, size_t len)
     port_buffer = port->buffer->buf;
     port_buf_len = __builtin_cheri_length_get(port_buffer);
     old_start = port->info->start;
-    new_start = (old_start + len) % COPORT_BUF_LEN;
+    new_start = (old_start + len) % port_buf_len;
     
     if (old_start + len > port_buf_len) {
         len_to_end = port_buf_len - old_start;
@@ -364,6 +679,19 @@ copipe_recv(const coport_t *port, void *buf, size_t len)
 {
     coport_status_t status;
     ssize_t received_len;
+    void *filled;
+
+    if ((port->flags & COPORT_RECVQ) != 0) {
+        /* Plain corecv posts buf and waits for it, so needs an idle queue */
+        if (atomic_load_explicit(&port->cd->recvq.posted, memory_order_relaxed) != 
+            atomic_load_explicit(&port->cd->recvq.reaped, memory_order_relaxed)) {
+            errno = EBUSY;
+            return (-1);
+        }
+        if (copipe_recvq_post(port, buf, len) != 0)
+            return (-1);
+        return (copipe_recvq_complete(port, &filled));
+    }
 
     if (cheri_getlen(buf) > len)
         buf = cheri_setbounds(buf, len);
@@ -374,7 +702,7 @@ copipe_recv(const coport_t *port, void *buf, size_t len)
 
     buf = cheri_andperm(buf, COPIPE_RECVBUF_PERMS);
 
-    status = acquire_coport_status(port, COPORT_OPEN, COPORT_BUSY, len);
+    status = acquire_copipe_status(port, COPORT_OPEN, COPORT_BUSY);
     if ((status == COPORT_CLOSING || status == COPORT_CLOSED)) {
         errno = EPIPE;
         return (-1);
@@ -382,13 +710,13 @@ copipe_recv(const coport_t *port, void *buf, size_t len)
 
     port->buffer->buf = buf;
 
-    release_coport_status(port, COPORT_READY);
+    release_copipe_status(port, COPORT_READY);
     // we expect to block here
 #if defined(ENABLE_INTERNAL_COMSG_BENCHMARK) && defined(__riscv)
     statcounters_sample(&pre_sample);
     clock_gettime(CLOCK_MONOTONIC_PRECISE, &pre_sample_clk);
 #endif
-    status = acquire_coport_status(port, COPORT_DONE, COPORT_BUSY, len);
+    status = acquire_copipe_status(port, COPORT_DONE, COPORT_BUSY);
     if ((status == COPORT_CLOSING || status == COPORT_CLOSED)) {
         errno = EPIPE;
         return (-1);
@@ -402,7 +730,7 @@ copipe_recv(const coport_t *port, void *buf, size_t len)
     port->buffer->buf = NULL;
     port->info->length = 0;
 
-    release_coport_status(port, COPORT_OPEN);
+    release_copipe_status(port, COPORT_OPEN);
 
     return (received_len);
 }
@@ -443,30 +771,41 @@ clock_diff(struct timespec *result, struct timespec *end, struct timespec *start
 	}
 }
 
+/* Work out how many status checks fit in COPORT_SPIN_NS on this machine */
 static void
-estimate_memory_bandwidth(void)
+calibrate_spin_limit(void)
 {
-    char a[16 * 1024 * 1024];
-    char b[16 * 1024 * 1024];
-
+    _Atomic(coport_status_t) dummy;
     struct timespec start, end, duration;
-    size_t length;
-    double time;
+    double ns_per_check;
+    size_t i;
 
-    length = __builtin_cheri_length_get(a);
+    if (!multicore) {
+        /* Nobody can release the status while we spin */
+        spin_limit = 0;
+        return;
+    }
+    dummy = COPORT_OPEN;
     clock_gettime(CLOCK_MONOTONIC_PRECISE, &start);
-    memcpy(a, b, length);
+    for (i = 0; i < COPORT_SPIN_CALIBRATION_ITERS; i++) {
+        if (atomic_load_explicit(&dummy, memory_order_relaxed) == COPORT_CLOSED)
+            break;
+    }
     clock_gettime(CLOCK_MONOTONIC_PRECISE, &end);
 
     clock_diff(&duration, &end, &start);
-    time = (double)(duration.tv_sec) + ((double)(duration.tv_nsec) / nanoseconds);
-    est_mem_bw = (double)(length) / time;
+    ns_per_check = ((double)(duration.tv_sec) * nanoseconds + (double)(duration.tv_nsec)) / COPORT_SPIN_CALIBRATION_ITERS;
+    if (ns_per_check <= 0.0)
+        ns_per_check = 1.0;
+    spin_limit = (size_t)(COPORT_SPIN_NS / ns_per_check);
+    if (spin_limit == 0)
+        spin_limit = 1;
 }
 
+/* Parking is always enabled now; kept for existing callers */
 void
 enable_copipe_sleep(void)
 {
-    estimate_memory_bandwidth();
 }
 
 __attribute__ ((constructor)) static void
@@ -492,6 +831,8 @@ coport_ipc_utils_init(void)
     copipe_otype.usc = __builtin_cheri_tag_clear(copipe_otype.usc);
     cochannel_otype.usc = __builtin_cheri_tag_clear(cochannel_otype.usc);
     cocarrier_otype.otype = 0;
+    cobroadcast_otype.otype = 0;
+    cosubscriber_otype.otype = 0;
     setup_cinvoke_targets(copipe_otype.sc, cochannel_otype.sc);
 
     len = sizeof(cores); 
@@ -499,5 +840,6 @@ coport_ipc_utils_init(void)
     mib[1] = HW_NCPU;
     sysctl(mib, 2, &cores, &len, NULL, 0);
     multicore = cores > 1;
+    calibrate_spin_limit();
 
 }
@@ -42,6 +42,8 @@ ssize_t copipe_send(const coport_t *port, const void *buf, size_t len);
 ssize_t cochannel_send(const coport_t *port, const void *buf, size_t len);
 ssize_t copipe_recv(const coport_t *port, void *buf, size_t len);
 ssize_t cochannel_recv(const coport_t *port, void *buf, size_t len);
+int copipe_recvq_post(const coport_t *port, void *buf, size_t len);
+ssize_t copipe_recvq_complete(const coport_t *port, void **buf);
 coport_t *process_coport_handle(coport_t *port, coport_type_t type);
 
 #endif
\ No newline at end of file
@@ -552,12 +552,20 @@ cocarrier_send(const coport_t *port, const void *buf, size_t len)
 
 coport_t *
 coopen(coport_type_t type)
+{
+	return (coopen2(type, 0, 0));
+}
+
+coport_t *
+coopen2(coport_type_t type, coport_flags_t flags, size_t capacity)
 {
 	coopen_args_t cocall_args;
 	int error;
 
 	memset(&cocall_args, '\0', sizeof(cocall_args));
 	cocall_args.coport_type = type;
+	cocall_args.coport_flags = flags;
+	cocall_args.coport_capacity = capacity;
     
     error = ukern_call(COCALL_COOPEN, &cocall_args);
 	if (error == -1)
@@ -571,8 +579,126 @@ coopen(coport_type_t type)
 	return (cocall_args.port);
 }
 
+coport_t *
+cosubscribe(coport_t *port)
+{
+	coopen_args_t cocall_args;
+	int error;
+
+	memset(&cocall_args, '\0', sizeof(cocall_args));
+	cocall_args.port = port;
+
+	error = ukern_call(COCALL_COSUBSCRIBE, &cocall_args);
+	if (error == -1)
+		err(EX_UNAVAILABLE, "%s: cocall failed", __func__);
+	if (cocall_args.status == -1) {
+		errno = cocall_args.error;
+		return (NULL);
+	}
+
+	return (cocall_args.port);
+}
+
+int
+counsubscribe(coport_t *subscriber)
+{
+	coopen_args_t cocall_args;
+	int error;
+
+	memset(&cocall_args, '\0', sizeof(cocall_args));
+	cocall_args.port = subscriber;
+
+	error = ukern_call(COCALL_COUNSUBSCRIBE, &cocall_args);
+	if (error == -1)
+		err(EX_UNAVAILABLE, "%s: cocall failed", __func__);
+	if (cocall_args.status == -1)
+		errno = cocall_args.error;
+
+	return (cocall_args.status);
+}
+
+/* Sets *cons to the only part of the queue the caller may write */
+struct _cocarrier_userq *
+cocarrier_userq(const coport_t *port, _Atomic size_t **cons)
+{
+	coopen_args_t cocall_args;
+	int error;
+
+	memset(&cocall_args, '\0', sizeof(cocall_args));
+	cocall_args.port = (coport_t *)port;
+
+	error = ukern_call(COCALL_COCARRIER_USERQ, &cocall_args);
+	if (error == -1)
+		err(EX_UNAVAILABLE, "%s: cocall failed", __func__);
+	if (cocall_args.status == -1) {
+		errno = cocall_args.error;
+		return (NULL);
+	}
+
+	*cons = cocall_args.userq_cons;
+	return (cocall_args.userq);
+}
+
+/*
+ * Fills stats with a snapshot of the coport's counters. Works for every coport
+ * type, as the counters live in the coport itself.
+ */
+int
+costat(const coport_t *port, coport_stats_t *stats)
+{
+	costat_args_t cocall_args;
+	int error;
+
+	memset(&cocall_args, '\0', sizeof(cocall_args));
+	cocall_args.stat_port = (coport_t *)port;
+
+	error = ukern_call(COCALL_COSTAT, &cocall_args);
+	if (error == -1)
+		err(EX_UNAVAILABLE, "%s: cocall failed", __func__);
+	if (cocall_args.status == -1) {
+		errno = cocall_args.error;
+		return (-1);
+	}
+	*stats = cocall_args.stats;
+
+	return (0);
+}
+
+/*
+ * Moves up to max_msgs messages from the head of src to the tail of dst inside
+ * ipcd, without copying their contents. Both must be COCARRIERs. Returns the
+ * number of messages moved; EAGAIN if src is empty or dst is full.
+ */
+ssize_t
+cosplice(const coport_t *src, const coport_t *dst, size_t max_msgs)
+{
+	cosplice_args_t cocall_args;
+	int error;
+
+	memset(&cocall_args, '\0', sizeof(cocall_args));
+	cocall_args.splice_src = (coport_t *)src;
+	cocall_args.splice_dst = (coport_t *)dst;
+	cocall_args.splice_max = max_msgs;
+
+	error = ukern_call(COCALL_COSPLICE, &cocall_args);
+	if (error == -1)
+		err(EX_UNAVAILABLE, "%s: cocall failed", __func__);
+	if (cocall_args.status == -1) {
+		errno = cocall_args.error;
+		return (-1);
+	}
+
+	return (cocall_args.status);
+}
+
 int
 cocarrier_recv(const coport_t *port, void ** const buf, size_t len)
+{
+	return (cocarrier_recv_handle(port, buf, len, NULL));
+}
+
+int
+cocarrier_recv_handle(const coport_t *port, void ** const buf, size_t len, comsg_handle_t *handle)
 {
 	/* Currently only for cocarriers, likely to change soon */
 	corecv_args_t cocall_args;
@@ -597,7 +723,169 @@ cocarrier_recv(const coport_t *port, void ** const buf, size_t len)
         err(EX_SOFTWARE, "%s: out-of-band data present; use cocarrier_recv_oob instead", __func__);
     } else if (cocall_args.length != 0)
         *buf = cocall_args.message;
+    if (handle != NULL)
+        *handle = cocall_args.msg_handle;
+
+	return (cocall_args.status);
+}
+
+/*
+ * As cocarrier_recv_handle, but if the cocarrier is empty, wait up to timeout 
+ * ms for a message (forever if timeout is negative). The wait and the dequeue
+ * happen in the same slow cocall.
+ */
+int
+cocarrier_recv_timed(const coport_t *port, void ** const buf, size_t len, int timeout, comsg_handle_t *handle)
+{
+	corecv_args_t cocall_args;
+	int error;
+
+	memset(&cocall_args, '\0', sizeof(cocall_args));
+	cocall_args.cocarrier = (coport_t *)port;
+	cocall_args.length = len;
+	cocall_args.recv_timeout = timeout;
+
+	error = ukern_call(COCALL_CORECV, &cocall_args);
+	if (error == -1)
+		err(EX_UNAVAILABLE, "%s: cocall failed", __func__);
+	if (cocall_args.status == -1 && cocall_args.error == EAGAIN && timeout != 0) {
+		error = ukern_call(COCALL_SLORECV, &cocall_args);
+		if (error == -1)
+			err(EX_UNAVAILABLE, "%s: cocall failed (slorecv)", __func__);
+	}
+
+	if (cocall_args.status == -1) {
+		errno = cocall_args.error;
+		return (-1);
+	} else if (cocall_args.oob_data.len != 0) {
+		errno = EBADMSG;
+		err(EX_SOFTWARE, "%s: out-of-band data present; use cocarrier_recv_oob instead", __func__);
+	} else if (cocall_args.length != 0)
+		*buf = cocall_args.message;
+	if (handle != NULL)
+		*handle = cocall_args.msg_handle;
+
+	return (cocall_args.status);
+}
+
+int
+cocarrier_send_timed(const coport_t *port, const void *buf, size_t len, int timeout)
+{
+	cosend_args_t cocall_args;
+	int error;
+
+	memset(&cocall_args, '\0', sizeof(cocall_args));
+	cocall_args.cocarrier = (coport_t *)port;
+	buf = cheri_setbounds(buf, len);
+	cocall_args.message = (void *)cheri_andperm(buf, COCARRIER_MSG_PERMS);
+	cocall_args.length = len;
+	cocall_args.send_timeout = timeout;
+
+	error = ukern_call(COCALL_COSEND, &cocall_args);
+	if (error == -1)
+		err(EX_UNAVAILABLE, "%s: cocall failed", __func__);
+	if (cocall_args.status == -1 && cocall_args.error == EAGAIN && timeout != 0) {
+		error = ukern_call(COCALL_SLOSEND, &cocall_args);
+		if (error == -1)
+			err(EX_UNAVAILABLE, "%s: cocall failed (slosend)", __func__);
+	}
 
+	if (cocall_args.status == -1) {
+		errno = cocall_args.error;
+		return (-1);
+	}
+	return (cocall_args.status);
+}
+
+/*
+ * Sends req on req_port and waits, inside ipcd, up to timeout ms (forever if
+ * negative) for the matching reply on reply_port, which should belong to the 
+ * caller alone. On success *reply_buf holds the reply, to be freed as for 
+ * cocarrier_recv_handle; handle may be NULL.
+ */
+int
+cotransact(const coport_t *req_port, const coport_t *reply_port, const void *req, 
+    size_t len, void ** const reply_buf, int timeout, comsg_handle_t *handle)
+{
+	cosend_args_t cocall_args;
+	int error;
+
+	memset(&cocall_args, '\0', sizeof(cocall_args));
+	cocall_args.cocarrier = (coport_t *)req_port;
+	cocall_args.reply_port = (coport_t *)reply_port;
+	req = cheri_setbounds(req, len);
+	cocall_args.message = (void *)cheri_andperm(req, COCARRIER_MSG_PERMS);
+	cocall_args.length = len;
+	cocall_args.send_timeout = timeout;
+
+	error = ukern_call(COCALL_COTRANSACT, &cocall_args);
+	if (error == -1)
+		err(EX_UNAVAILABLE, "%s: cocall failed", __func__);
+	if (cocall_args.status == -1) {
+		errno = cocall_args.error;
+		return (-1);
+	} else if (cocall_args.length != 0)
+		*reply_buf = cocall_args.message;
+	if (handle != NULL)
+		*handle = cocall_args.msg_handle;
+
+	return (cocall_args.status);
+}
+
+/*
+ * Server side of cotransact. As cocarrier_recv, but also returns the request's
+ * correlation ID (0 if it was sent with plain cocarrier_send).
+ */
+int
+cocarrier_recv_request(const coport_t *port, void ** const buf, size_t len, uint64_t *corr_id)
+{
+	corecv_args_t cocall_args;
+	int error;
+
+	memset(&cocall_args, '\0', sizeof(cocall_args));
+	cocall_args.cocarrier = (coport_t *)port;
+	cocall_args.length = len;
+
+	error = ukern_call(COCALL_CORECV, &cocall_args);
+	if (error == -1)
+		err(EX_UNAVAILABLE, "%s: cocall failed", __func__);
+	if (cocall_args.status == -1) {
+		errno = cocall_args.error;
+		return (-1);
+	} else if (cocall_args.oob_data.len != 0) {
+		errno = EBADMSG;
+		err(EX_SOFTWARE, "%s: out-of-band data present; use cocarrier_recv_oob instead", __func__);
+	} else if (cocall_args.length != 0)
+		*buf = cocall_args.message;
+	*corr_id = cocall_args.corr_id;
+
+	return (cocall_args.status);
+}
+
+/* 
+ * Sends the reply to the cotransact request that carried corr_id. port must be
+ * the reply port of that cotransact, which must still be waiting.
+ */
+int
+cocarrier_send_reply(const coport_t *port, const void *buf, size_t len, uint64_t corr_id)
+{
+	cosend_args_t cocall_args;
+	int error;
+
+	memset(&cocall_args, '\0', sizeof(cocall_args));
+	cocall_args.cocarrier = (coport_t *)port;
+	buf = cheri_setbounds(buf, len);
+	cocall_args.message = (void *)cheri_andperm(buf, COCARRIER_MSG_PERMS);
+	cocall_args.length = len;
+	cocall_args.corr_id = corr_id;
+
+	error = ukern_call(COCALL_COREPLY, &cocall_args);
+	if (error == -1)
+		err(EX_UNAVAILABLE, "%s: cocall failed", __func__);
+	if (cocall_args.status == -1) {
+		errno = cocall_args.error;
+		return (-1);
+	}
 	return (cocall_args.status);
 }
 
@@ -635,6 +923,98 @@ do_copoll:
 	return (cocall_args.status);
 }
 
+copoll_set_t *
+copoll_create(void)
+{
+	copoll_set_args_t cocall_args;
+	int error;
+
+	memset(&cocall_args, '\0', sizeof(cocall_args));
+	error = ukern_call(COCALL_COPOLL_CREATE, &cocall_args);
+	if (error == -1)
+		err(EX_UNAVAILABLE, "%s: cocall failed", __func__);
+	if (cocall_args.status == -1) {
+		errno = cocall_args.error;
+		return (NULL);
+	}
+
+	return (cocall_args.copoll_set);
+}
+
+int
+copoll_ctl(copoll_set_t *set, copoll_ctl_op_t op, coport_t *coport, coport_eventmask_t events)
+{
+	copoll_set_args_t cocall_args;
+	int error;
+
+	memset(&cocall_args, '\0', sizeof(cocall_args));
+	cocall_args.copoll_set = set;
+	cocall_args.copoll_op = op;
+	cocall_args.copoll_port = coport;
+	cocall_args.copoll_events = events;
+	error = ukern_call(COCALL_COPOLL_CTL, &cocall_args);
+	if (error == -1)
+		err(EX_UNAVAILABLE, "%s: cocall failed", __func__);
+	if (cocall_args.status == -1) {
+		errno = cocall_args.error;
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Unlike copoll, the interest set lives in ipcd, so only ready coports are 
+ * written back to ready.
+ */
+int
+copoll_wait(copoll_set_t *set, pollcoport_t *ready, int nready, int timeout)
+{
+	copoll_set_args_t cocall_args;
+	int error;
+
+	memset(&cocall_args, '\0', sizeof(cocall_args));
+	cocall_args.copoll_set = set;
+	cocall_args.ready = ready;
+	cocall_args.nready = nready;
+	cocall_args.copoll_timeout = timeout;
+	error = ukern_call(COCALL_COPOLL_WAIT, &cocall_args);
+	if (error == -1)
+		err(EX_UNAVAILABLE, "%s: cocall failed", __func__);
+	if (cocall_args.status == -1) {
+		if (cocall_args.error == EWOULDBLOCK && timeout != 0) {
+			error = ukern_call(COCALL_SLOPOLL_WAIT, &cocall_args);
+			if (error == -1)
+				err(EX_UNAVAILABLE, "%s: cocall failed (slopoll_wait)", __func__);
+		}
+		if (cocall_args.status == -1) {
+			errno = cocall_args.error;
+			return (-1);
+		}
+	}
+
+	return (cocall_args.status);
+}
+
+int
+copoll_destroy(copoll_set_t *set)
+{
+	copoll_set_args_t cocall_args;
+	int error;
+
+	memset(&cocall_args, '\0', sizeof(cocall_args));
+	cocall_args.copoll_set = set;
+	error = ukern_call(COCALL_COPOLL_DESTROY, &cocall_args);
+	if (error == -1)
+		err(EX_UNAVAILABLE, "%s: cocall failed", __func__);
+	if (cocall_args.status == -1) {
+		errno = cocall_args.error;
+		return (-1);
+	}
+
+	return (0);
+}
+
 int 
 coclose(coport_t *coport)
 {
@@ -884,12 +1264,116 @@ codiscover2(coservice_t *s)
 	
 }
 
+/*
+ * Copies n iovecs into bounded_iov, each bounded to its fragment and made 
+ * read-only, so they cannot be modified during the cocall. n may be at most
+ * COCARRIER_MAX_BATCH, the size of bounded_iov.
+ */
+static int
+bound_cocarrier_iov(struct iovec *bounded_iov, const struct iovec *iov, size_t n)
+{
+	void *buf;
+
+	if (n == 0 || n > COCARRIER_MAX_BATCH) {
+		errno = EINVAL;
+		return (-1);
+	}
+	for (size_t i = 0; i < n; i++) {
+		buf = cheri_setbounds(iov[i].iov_base, iov[i].iov_len);
+		bounded_iov[i].iov_base = cheri_andperm(buf, COCARRIER_MSG_PERMS);
+		bounded_iov[i].iov_len = iov[i].iov_len;
+	}
+	return (0);
+}
+
+int
+cocarrier_sendv(const coport_t *port, const struct iovec *iov, size_t n)
+{
+	cosendv_args_t cocall_args;
+	struct iovec bounded_iov[COCARRIER_MAX_BATCH];
+	int error;
+
+	if (bound_cocarrier_iov(bounded_iov, iov, n) != 0)
+		return (-1);
+	memset(&cocall_args, '\0', sizeof(cocall_args));
+	cocall_args.cocarrier = (coport_t *)port;
+	cocall_args.iov = bounded_iov;
+	cocall_args.nmessages = n;
+
+	error = ukern_call(COCALL_COSENDV, &cocall_args);
+	if (error == -1)
+		err(EX_UNAVAILABLE, "%s: cocall failed", __func__);
+	if (cocall_args.status == -1)
+		errno = cocall_args.error;
+
+	return (cocall_args.status);
+}
+
+/*
+ * Sends one message gathered from n fragments. ipcd copies each fragment 
+ * straight into the message, so the sender need not assemble it first.
+ */
+int
+cocarrier_send_iov(const coport_t *port, const struct iovec *iov, size_t n)
+{
+	cosend_args_t cocall_args;
+	struct iovec bounded_iov[COCARRIER_MAX_BATCH];
+	int error;
+
+	if (bound_cocarrier_iov(bounded_iov, iov, n) != 0)
+		return (-1);
+	memset(&cocall_args, '\0', sizeof(cocall_args));
+	cocall_args.cocarrier = (coport_t *)port;
+	cocall_args.message = NULL;
+	cocall_args.iov = bounded_iov;
+	cocall_args.nmessages = n;
+
+	error = ukern_call(COCALL_COSEND, &cocall_args);
+	if (error == -1)
+		err(EX_UNAVAILABLE, "%s: cocall failed", __func__);
+	if (cocall_args.status == -1) {
+		errno = cocall_args.error;
+		return (-1);
+	}
+	return (cocall_args.status);
+}
+
+int
+cocarrier_recvv(const coport_t *port, void **bufs, comsg_handle_t *handles, size_t n)
+{
+	corecvv_args_t cocall_args;
+	int error;
+
+	if (n == 0 || n > COCARRIER_MAX_BATCH) {
+		errno = EINVAL;
+		return (-1);
+	}
+	memset(&cocall_args, '\0', sizeof(cocall_args));
+	cocall_args.cocarrier = (coport_t *)port;
+	cocall_args.messages = cheri_setbounds(bufs, n * sizeof(void *));
+	cocall_args.nmessages = n;
+	if (handles != NULL)
+		cocall_args.msg_handles = cheri_setbounds(handles, n * sizeof(comsg_handle_t));
+
+	error = ukern_call(COCALL_CORECVV, &cocall_args);
+	if (error == -1)
+		err(EX_UNAVAILABLE, "%s: cocall failed", __func__);
+	if (cocall_args.status == -1)
+		errno = cocall_args.error;
+
+	return (cocall_args.status);
+}
+
 int
 coport_msg_free(coport_t *port, void *ptr)
 {
 	cosend_args_t cocall_args;
 	int error;
 	
+	/* COPORT_INLINE messages live in their queue slot, so there is nothing to free */
+	if ((cheri_getperm(ptr) & COCARRIER_PERM_INLINE) != 0)
+		return (0);
+
 	memset(&cocall_args, '\0', sizeof(cocall_args));
 	cocall_args.message = ptr;
 	cocall_args.cocarrier = port;
@@ -905,6 +1389,86 @@ coport_msg_free(coport_t *port, void *ptr)
 	return (cocall_args.status);
 }
 
+/*
+ * Allocates a buffer of at least len bytes from ipcd's zero-copy pool for a 
+ * cocarrier. If the buffer is sent there with cocarrier_send_zc, ipcd enqueues
+ * it without copying and the sender can no longer write to it. handle names
+ * the buffer; release it unsent with coport_msg_free_handle.
+ */
+void *
+coport_msg_alloc(coport_t *port, size_t len, comsg_handle_t *handle)
+{
+	cosend_args_t cocall_args;
+	int error;
+
+	memset(&cocall_args, '\0', sizeof(cocall_args));
+	cocall_args.cocarrier = port;
+	cocall_args.length = len;
+
+	error = ukern_call(COCALL_COPORT_MSG_ALLOC, &cocall_args);
+	if (error == -1)
+		err(EX_UNAVAILABLE, "%s: cocall failed", __func__);
+	if (cocall_args.status == -1) {
+		errno = cocall_args.error;
+		return (NULL);
+	}
+	*handle = cocall_args.msg_handle;
+	return (cocall_args.message);
+}
+
+/* Sends a buffer from coport_msg_alloc, without copying it */
+int
+cocarrier_send_zc(const coport_t *port, const void *buf, size_t len, const comsg_handle_t *handle)
+{
+	cosend_args_t cocall_args;
+	int error;
+
+	memset(&cocall_args, '\0', sizeof(cocall_args));
+	cocall_args.cocarrier = (coport_t *)port;
+	cocall_args.message = (void *)buf;
+	cocall_args.length = len;
+	cocall_args.msg_handle = *handle;
+
+	error = ukern_call(COCALL_COSEND, &cocall_args);
+	if (error == -1)
+		err(EX_UNAVAILABLE, "%s: cocall failed", __func__);
+	if (cocall_args.status == -1) {
+		errno = cocall_args.error;
+		return (-1);
+	}
+	return (cocall_args.status);
+}
+
+/*
+ * Frees a message using the handle returned when it was received. Unlike
+ * coport_msg_free, ipcd goes straight to the message's slot. COPORT_INLINE
+ * messages get a handle with no slot and are not freed. Also releases an 
+ * unsent buffer from coport_msg_alloc, given the handle it came with.
+ */
+int
+coport_msg_free_handle(coport_t *port, const comsg_handle_t *handle)
+{
+	cosend_args_t cocall_args;
+	int error;
+
+	if (handle == NULL) {
+		errno = EINVAL;
+		return (-1);
+	} else if (handle->slot == NULL)
+		return (0);
+	memset(&cocall_args, '\0', sizeof(cocall_args));
+	cocall_args.cocarrier = port;
+	cocall_args.msg_handle = *handle;
+
+	error = ukern_call(COCALL_COPORT_MSG_FREE, &cocall_args);
+	if (error == -1)
+		err(EX_UNAVAILABLE, "%s: cocall failed", __func__);
+	if (cocall_args.status == -1)
+		errno = cocall_args.error;
+
+	return (cocall_args.status);
+}
+
 void begin_cocall(void)
 {
 	return;
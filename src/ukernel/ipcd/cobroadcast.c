@@ -0,0 +1,512 @@
+/*
+ * Copyright (c) 2020 Peter S. Blandford-Baker
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology) under DARPA contract HR0011-18-C-0016 ("ECATS"), as part of the
+ * DARPA SSITH research programme.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include "cobroadcast.h"
+#include "copoll_utils.h"
+#include "ipcd.h"
+#include "ipcd_cap.h"
+
+#include <ccmalloc.h>
+#include <comsg/comsg_args.h>
+#include <comsg/coport.h>
+#include <comsg/utils.h>
+
+#include <cheri/cheric.h>
+#include <malloc_np.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/errno.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+
+extern void begin_cocall(void);
+extern void end_cocall(void);
+
+/*
+ * COBROADCAST coports hold one ring of ipcd-owned messages. Each subscriber 
+ * has its own cursor into the ring, so a message is copied in once and every 
+ * subscriber gets a read-only capability to the same copy. A slot is reused 
+ * once every subscriber has received it; as with COCARRIER slots, a received
+ * message stays valid until then.
+ *
+ * Subscribers keep their capabilities after the slot moves on, so each slot's
+ * buffer is overwritten in place rather than freed, and one that is too small
+ * for a message is kept as a spare for the port's other slots. Buffers come 
+ * from malloc rather than the slab, so that once the port is reclaimed they 
+ * can be freed where the allocator revokes capabilities to freed memory (see
+ * release_cobroadcast_buffers).
+ *
+ * The coport status is the lock for sends, the subscriber list and the event
+ * mask. Receivers only touch their own cursor, unless they may have freed up
+ * the ring. Fails if the port has closed, or its slot has been recycled.
+ */
+static bool
+lock_cobroadcast(coport_t *port, coport_status_t *prev)
+{
+	coport_status_t status;
+
+	if (!cheri_gettag(port))
+		return (false); /* a reclaimed port's handle, since revoked */
+	status = COPORT_OPEN;
+	while(!atomic_compare_exchange_weak_explicit(&port->info->status, &status, COPORT_BUSY, memory_order_acq_rel, memory_order_relaxed)) {
+		switch (status) {
+		case COPORT_CLOSED:
+			return (false);
+		case COPORT_CLOSING:
+			break;
+		default:
+			COPORT_STAT_INC(port, cas_retries);
+			status = COPORT_OPEN;
+			break;
+		}
+	}
+	if (!coport_handle_current(port)) {
+		/* the slot was recycled while we waited; the status is another coport's */
+		atomic_store_explicit(&port->info->status, status, memory_order_release);
+		return (false);
+	}
+	*prev = status;
+	return (true);
+}
+
+static void
+unlock_cobroadcast(coport_t *port, coport_status_t prev)
+{
+	atomic_store_explicit(&port->info->status, prev, memory_order_release);
+}
+
+/* As unlock_cobroadcast, but first tells pollers about events raised */
+static void
+unlock_cobroadcast_notify(coport_t *port, coport_status_t prev, coport_eventmask_t raised)
+{
+	if (raised == NOEVENT || prev != COPORT_OPEN) {
+		unlock_cobroadcast(port, prev);
+		return;
+	}
+	atomic_thread_fence(memory_order_seq_cst);
+	atomic_store_explicit(&port->info->status, COPORT_DONE, memory_order_release);
+	copoll_notify(port, raised);
+}
+
+static bool
+enter_cosubscriber(struct _cosubscriber *sub)
+{
+	uint users;
+
+	users = atomic_load_explicit(&sub->users, memory_order_relaxed);
+	do {
+		if (users == 0)
+			return (false);
+	} while (!atomic_compare_exchange_weak_explicit(&sub->users, &users, users + 1, memory_order_acquire, memory_order_relaxed));
+	return (true);
+}
+
+static void
+leave_cosubscriber(struct _cosubscriber *sub)
+{
+	if (atomic_fetch_sub_explicit(&sub->users, 1, memory_order_acq_rel) != 1)
+		return;
+	else if (!malloc_is_revoking())
+		return;
+	free(sub);
+}
+
+/* Called with the port locked */
+static size_t
+oldest_cursor(coport_t *port, size_t head)
+{
+	struct _cosubscriber *sub;
+	size_t cursor, oldest;
+
+	oldest = head;
+	LIST_FOREACH(sub, &port->cd->bcast.subscribers, entries) {
+		cursor = atomic_load_explicit(&sub->cursor, memory_order_acquire);
+		if (head - cursor > head - oldest)
+			oldest = cursor;
+	}
+	return (oldest);
+}
+
+/*
+ * COPOLL_IN is set while any subscriber has messages to receive, and 
+ * COPOLL_OUT while the slowest has room for more. Called with the port locked;
+ * returns the events that were not already set.
+ */
+static coport_eventmask_t
+update_cobroadcast_events(coport_t *port)
+{
+	coport_eventmask_t event, prev_event;
+	size_t head, backlog;
+
+	head = atomic_load_explicit(&port->cd->bcast.head, memory_order_relaxed);
+	backlog = head - oldest_cursor(port, head);
+	prev_event = port->info->event;
+	event = prev_event & ~(COPOLL_IN | COPOLL_OUT);
+	if (backlog != 0)
+		event |= COPOLL_IN;
+	if (backlog < COBROADCAST_DEPTH(port) && (event & COPOLL_CLOSED) == 0)
+		event = (event | COPOLL_OUT) & ~COPOLL_WERR;
+	port->info->event = event;
+	return (event & ~prev_event);
+}
+
+/*
+ * Makes sure the slot's buffer holds at least len bytes, taking a spare of the
+ * port's or a new slab object if it does not. Called with the port locked.
+ */
+static bool
+fit_cobroadcast_slot(coport_t *port, struct cobroadcast_slot *slot, size_t len)
+{
+	struct _cobroadcast_spare *spare, *prev_spare;
+	void *alloc;
+
+	if (slot->alloc != NULL && cheri_getlen(slot->alloc) >= len)
+		return (true);
+
+	prev_spare = NULL;
+	SLIST_FOREACH(spare, &port->cd->bcast.spares, entries) {
+		if (cheri_getlen(spare->alloc) >= len)
+			break;
+		prev_spare = spare;
+	}
+	if (spare != NULL) {
+		alloc = spare->alloc;
+		if (slot->alloc != NULL)
+			spare->alloc = slot->alloc; /* swap */
+		else {
+			if (prev_spare == NULL)
+				SLIST_REMOVE_HEAD(&port->cd->bcast.spares, entries);
+			else
+				SLIST_REMOVE_AFTER(prev_spare, entries);
+			free(spare);
+		}
+		slot->alloc = alloc;
+		return (true);
+	}
+
+	spare = NULL;
+	if (slot->alloc != NULL) {
+		spare = malloc(sizeof(struct _cobroadcast_spare));
+		if (spare == NULL)
+			return (false);
+	}
+	alloc = malloc(len);
+	if (alloc == NULL) {
+		free(spare);
+		return (false);
+	}
+	if (spare != NULL) {
+		spare->alloc = slot->alloc;
+		SLIST_INSERT_HEAD(&port->cd->bcast.spares, spare, entries);
+	}
+	slot->alloc = alloc;
+	return (true);
+}
+
+int 
+validate_cosubscribe_args(coopen_args_t *cocall_args)
+{
+	return (valid_cobroadcast(cocall_args->port));
+}
+
+void 
+cobroadcast_subscribe(coopen_args_t *cocall_args, void *token)
+{
+	UNUSED(token);
+	struct _cosubscriber *sub;
+	coport_status_t prev;
+	coport_t *port;
+
+	begin_cocall();
+	port = unseal_coport(cocall_args->port);
+	sub = malloc(sizeof(struct _cosubscriber));
+	if (sub == NULL) {
+		end_cocall();
+		COCALL_ERR(cocall_args, ENOMEM);
+	}
+	if (!lock_cobroadcast(port, &prev)) {
+		free(sub);
+		end_cocall();
+		COCALL_ERR(cocall_args, EPIPE);
+	} else if (prev == COPORT_CLOSING) {
+		unlock_cobroadcast(port, prev);
+		free(sub);
+		end_cocall();
+		COCALL_ERR(cocall_args, EPIPE);
+	}
+	/* New subscribers only see messages sent after they join */
+	sub->port = port;
+	sub->cursor = atomic_load_explicit(&port->cd->bcast.head, memory_order_relaxed);
+	sub->subscribed = true;
+	sub->users = 1;
+	sub->listed = true;
+	LIST_INSERT_HEAD(&port->cd->bcast.subscribers, sub, entries);
+	unlock_cobroadcast(port, prev);
+	end_cocall();
+
+	cocall_args->port = seal_cosubscriber(sub);
+	COCALL_RETURN(cocall_args, 0);
+}
+
+int 
+validate_counsubscribe_args(coopen_args_t *cocall_args)
+{
+	return (valid_cosubscriber(cocall_args->port));
+}
+
+void 
+cobroadcast_unsubscribe(coopen_args_t *cocall_args, void *token)
+{
+	UNUSED(token);
+	struct _cosubscriber *sub;
+	coport_eventmask_t raised;
+	coport_status_t prev;
+
+	begin_cocall();
+	sub = unseal_cosubscriber(cocall_args->port);
+	if (!enter_cosubscriber(sub)) {
+		end_cocall();
+		COCALL_ERR(cocall_args, EINVAL);
+	} else if (!atomic_exchange_explicit(&sub->subscribed, false, memory_order_acq_rel)) {
+		leave_cosubscriber(sub);
+		end_cocall();
+		COCALL_ERR(cocall_args, EINVAL);
+	}
+	/* coport_close takes subscribers off the list itself */
+	if (lock_cobroadcast(sub->port, &prev)) {
+		raised = NOEVENT;
+		if (sub->listed) {
+			LIST_REMOVE(sub, entries);
+			sub->listed = false;
+			/* we may have been the slowest subscriber */
+			raised = update_cobroadcast_events(sub->port);
+		}
+		unlock_cobroadcast_notify(sub->port, prev, raised);
+	}
+	leave_cosubscriber(sub);
+	leave_cosubscriber(sub); /* the subscription's own */
+	end_cocall();
+	COCALL_RETURN(cocall_args, 0);
+}
+
+/* 
+ * Called by coport_close with the port locked. Subscribers stay allocated 
+ * until they unsubscribe, but no longer hold the port back from being 
+ * reclaimed; their receives then fail with EPIPE.
+ */
+void
+detach_cobroadcast_subscribers(coport_t *port)
+{
+	struct _cosubscriber *sub;
+
+	while ((sub = LIST_FIRST(&port->cd->bcast.subscribers)) != NULL) {
+		LIST_REMOVE(sub, entries);
+		sub->listed = false;
+	}
+}
+
+/*
+ * Called as a closed port is reclaimed. Former subscribers may still hold
+ * capabilities to its messages, so the buffers are only freed if the 
+ * allocator revokes those capabilities; otherwise they are dropped, rather 
+ * than overwritten by whichever port takes the slot next.
+ */
+void
+release_cobroadcast_buffers(coport_t *port)
+{
+	struct cobroadcast_slot *slots;
+	struct _cobroadcast_spare *spare;
+	bool revoking;
+
+	revoking = malloc_is_revoking();
+	slots = port->buffer->buf;
+	for (size_t i = 0; i < COBROADCAST_DEPTH(port); i++) {
+		if (revoking)
+			free(slots[i].alloc);
+		slots[i].alloc = NULL;
+		slots[i].buf = NULL;
+	}
+	while ((spare = SLIST_FIRST(&port->cd->bcast.spares)) != NULL) {
+		SLIST_REMOVE_HEAD(&port->cd->bcast.spares, entries);
+		if (revoking)
+			free(spare->alloc);
+		free(spare);
+	}
+}
+
+void 
+cobroadcast_send(cosend_args_t *cocall_args, void *token)
+{
+	UNUSED(token);
+	struct cobroadcast_slot *slots, *slot;
+	coport_eventmask_t raised;
+	coport_status_t prev;
+	coport_t *port;
+	size_t head, depth, msg_len, backlog;
+	void *msg_in, *msg_buf;
+
+	if (cocall_args->oob_data.len != 0)
+		COCALL_ERR(cocall_args, EOPNOTSUPP);
+
+	begin_cocall();
+	msg_in = cheri_andperm(cocall_args->message, COPORT_INBUF_PERMS);
+	msg_len = MIN(cocall_args->length, cheri_getlen(msg_in));
+
+	port = unseal_coport(cocall_args->cocarrier);
+	if (!lock_cobroadcast(port, &prev)) {
+		end_cocall();
+		COCALL_ERR(cocall_args, EPIPE);
+	} else if (prev == COPORT_CLOSING) {
+		unlock_cobroadcast(port, prev);
+		end_cocall();
+		COCALL_ERR(cocall_args, EPIPE);
+	}
+	/* With nobody subscribed, the message is delivered to nobody */
+	if (LIST_EMPTY(&port->cd->bcast.subscribers)) {
+		unlock_cobroadcast(port, prev);
+		end_cocall();
+		COCALL_RETURN(cocall_args, msg_len);
+	}
+
+	slots = port->buffer->buf;
+	depth = COBROADCAST_DEPTH(port);
+	head = atomic_load_explicit(&port->cd->bcast.head, memory_order_relaxed);
+	backlog = head - oldest_cursor(port, head);
+	if (backlog >= depth) {
+		/* The slowest subscriber holds us back */
+		COPORT_STAT_INC(port, send_full);
+		port->info->event = (port->info->event | COPOLL_WERR) & ~COPOLL_OUT;
+		unlock_cobroadcast(port, prev);
+		end_cocall();
+		COCALL_ERR(cocall_args, EAGAIN);
+	}
+
+	slot = &slots[head & (depth - 1)];
+	if (!fit_cobroadcast_slot(port, slot, msg_len)) {
+		unlock_cobroadcast(port, prev);
+		end_cocall();
+		COCALL_ERR(cocall_args, ENOMEM);
+	}
+	msg_buf = ccslab_bound(slot->alloc, msg_len);
+	memcpy(cheri_andperm(msg_buf, COPORT_OUTBUF_PERMS), msg_in, msg_len);
+	slot->buf = msg_buf;
+	atomic_store_explicit(&port->cd->bcast.head, head + 1, memory_order_release);
+	/* as for cocarriers, every send is news to COPOLL_IN listeners */
+	raised = update_cobroadcast_events(port) | COPOLL_IN;
+	unlock_cobroadcast_notify(port, prev, raised);
+	COPORT_STAT_INC(port, sends);
+	COPORT_STAT_ADD(port, bytes_sent, msg_len);
+	coport_stat_level(port->info, backlog + 1);
+	end_cocall();
+
+	COCALL_RETURN(cocall_args, msg_len);
+}
+
+/* 
+ * A receiver that may have been the slowest, or the last to catch up, updates
+ * the port's events so that blocked senders and pollers hear about it.
+ */
+static void
+cobroadcast_recvd(coport_t *port)
+{
+	coport_eventmask_t raised;
+	coport_status_t prev;
+
+	if (!lock_cobroadcast(port, &prev))
+		return;
+	raised = update_cobroadcast_events(port);
+	unlock_cobroadcast_notify(port, prev, raised);
+}
+
+void 
+cobroadcast_recv(corecv_args_t *cocall_args, void *token)
+{
+	UNUSED(token);
+	struct cobroadcast_slot *slots;
+	struct _cosubscriber *sub;
+	coport_status_t status;
+	coport_t *port;
+	size_t cursor, head, depth;
+	void *msg;
+
+	sub = unseal_cosubscriber(cocall_args->cocarrier);
+	if (!enter_cosubscriber(sub))
+		COCALL_ERR(cocall_args, EINVAL);
+	else if (!atomic_load_explicit(&sub->subscribed, memory_order_acquire)) {
+		leave_cosubscriber(sub);
+		COCALL_ERR(cocall_args, EINVAL);
+	}
+	port = sub->port;
+	if (!coport_handle_current(port)) {
+		/* the port was closed and its slot recycled */
+		leave_cosubscriber(sub);
+		COCALL_ERR(cocall_args, EPIPE);
+	}
+	slots = port->buffer->buf;
+	depth = COBROADCAST_DEPTH(port);
+
+	/* 
+	 * Our cursor pins the slot, so it cannot be reused under us unless another
+	 * thread sharing this subscription moves the cursor on, in which case the
+	 * CAS fails and we go round again.
+	 */
+	cursor = atomic_load_explicit(&sub->cursor, memory_order_acquire);
+	do {
+		head = atomic_load_explicit(&port->cd->bcast.head, memory_order_acquire);
+		if (cursor == head) {
+			status = atomic_load_explicit(&port->info->status, memory_order_acquire);
+			leave_cosubscriber(sub);
+			if (status == COPORT_CLOSING || status == COPORT_CLOSED)
+				COCALL_ERR(cocall_args, EPIPE);
+			COPORT_STAT_INC(port, recv_empty);
+			COCALL_ERR(cocall_args, EAGAIN);
+		}
+		msg = slots[cursor & (depth - 1)].buf;
+	} while (!atomic_compare_exchange_weak_explicit(&sub->cursor, &cursor, cursor + 1, memory_order_acq_rel, memory_order_acquire));
+	if (!coport_handle_current(port)) {
+		/* reclaimed as we read; the buffer may already be gone */
+		leave_cosubscriber(sub);
+		COCALL_ERR(cocall_args, EPIPE);
+	}
+
+	if (cursor + 1 == head || (atomic_load_explicit(&port->info->event, memory_order_relaxed) & COPOLL_OUT) == 0)
+		cobroadcast_recvd(port);
+	leave_cosubscriber(sub);
+
+	COPORT_STAT_INC(port, recvs);
+	COPORT_STAT_ADD(port, bytes_recvd, cheri_getlen(msg));
+	cocall_args->message = cheri_andperm(msg, COCARRIER_MSG_PERMS);
+	cocall_args->length = cheri_getlen(msg);
+	cocall_args->oob_data.attachments = NULL;
+	cocall_args->oob_data.len = 0;
+	COCALL_RETURN(cocall_args, cocall_args->length);
+}
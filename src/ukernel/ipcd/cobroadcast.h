@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2020 Peter S. Blandford-Baker
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology) under DARPA contract HR0011-18-C-0016 ("ECATS"), as part of the
+ * DARPA SSITH research programme.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef _COBROADCAST_H
+#define _COBROADCAST_H
+
+#include <comsg/comsg_args.h>
+#include <comsg/coport.h>
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/queue.h>
+
+/* 
+ * A subscriber's read cursor into a COBROADCAST ring. Ops count themselves in
+ * users while they run, and the subscription holds one more until it ends.
+ * Whoever drops the last frees the subscriber, but only if the allocator 
+ * revokes capabilities to freed memory; otherwise it stays allocated, so that
+ * stale handles to it keep failing with EINVAL.
+ */
+struct _cosubscriber {
+	coport_t *port; /* unsealed; stale once the port is reclaimed */
+	_Atomic size_t cursor; /* sequence number of the next message to receive */
+	_Atomic bool subscribed;
+	_Atomic uint users;
+	bool listed; /* on the port's subscriber list; under the port lock */
+	LIST_ENTRY(_cosubscriber) entries;
+};
+
+struct _cobroadcast_spare {
+	void *alloc;
+	SLIST_ENTRY(_cobroadcast_spare) entries;
+};
+
+int validate_cosubscribe_args(coopen_args_t *cocall_args);
+void cobroadcast_subscribe(coopen_args_t *cocall_args, void *token);
+int validate_counsubscribe_args(coopen_args_t *cocall_args);
+void cobroadcast_unsubscribe(coopen_args_t *cocall_args, void *token);
+
+void cobroadcast_send(cosend_args_t *cocall_args, void *token);
+void cobroadcast_recv(corecv_args_t *cocall_args, void *token);
+void detach_cobroadcast_subscribers(coport_t *port);
+void release_cobroadcast_buffers(coport_t *port);
+
+#endif //!defined(_COBROADCAST_H)
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2020 Peter S. Blandford-Baker
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology) under DARPA contract HR0011-18-C-0016 ("ECATS"), as part of the
+ * DARPA SSITH research programme.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include "cocarrier_credit.h"
+
+#include <comsg/coport.h>
+
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/umtx.h>
+#include <time.h>
+
+/*
+ * COPORT_CREDIT cocarriers. Each credit is a free slot. Senders take one 
+ * before they copy a message in, and receivers return them as they dequeue,
+ * so a sender that holds a credit always finds room. Senders with none sleep
+ * in ipcd on the credit word and are woken one per returned credit.
+ */
+void
+init_cocarrier_credits(coport_t *cocarrier, size_t depth)
+{
+	/* credit_waiters carries over; senders from the last open may still be leaving */
+	atomic_store_explicit(&cocarrier->cd->credits, (uint32_t)depth, memory_order_relaxed);
+}
+
+/* Takes up to wanted credits; returns how many were taken */
+size_t
+take_cocarrier_credits(coport_t *cocarrier, size_t wanted, bool *closed)
+{
+	uint32_t credits, taken;
+
+	credits = atomic_load_explicit(&cocarrier->cd->credits, memory_order_acquire);
+	do {
+		*closed = ((credits & COCARRIER_CREDITS_CLOSED) != 0);
+		if (*closed || credits == 0)
+			return (0);
+		taken = (credits < wanted) ? credits : (uint32_t)wanted;
+	} while (!atomic_compare_exchange_weak_explicit(&cocarrier->cd->credits, &credits, credits - taken, memory_order_acq_rel, memory_order_acquire));
+	return (taken);
+}
+
+void
+return_cocarrier_credits(coport_t *cocarrier, size_t n)
+{
+	if (n == 0 || (cocarrier->flags & COPORT_CREDIT) == 0)
+		return;
+	atomic_fetch_add_explicit(&cocarrier->cd->credits, (uint32_t)n, memory_order_seq_cst);
+	if (atomic_load_explicit(&cocarrier->cd->credit_waiters, memory_order_seq_cst) != 0)
+		_umtx_op(&cocarrier->cd->credits, UMTX_OP_WAKE, (n > INT_MAX) ? INT_MAX : (int)n, NULL, NULL);
+}
+
+void
+close_cocarrier_credits(coport_t *cocarrier)
+{
+	atomic_fetch_or_explicit(&cocarrier->cd->credits, COCARRIER_CREDITS_CLOSED, memory_order_seq_cst);
+	if (atomic_load_explicit(&cocarrier->cd->credit_waiters, memory_order_seq_cst) != 0)
+		_umtx_op(&cocarrier->cd->credits, UMTX_OP_WAKE, INT_MAX, NULL, NULL);
+}
+
+/* 
+ * Sleeps until credits may be available, the cocarrier closes, or timeout ms
+ * pass (forever if negative). Callers retry, so spurious wake-ups are fine.
+ */
+void
+wait_cocarrier_credits(coport_t *cocarrier, long timeout)
+{
+	struct timespec ts;
+
+	/* a returner that adds after this sees us; one that added before changed the word */
+	atomic_fetch_add_explicit(&cocarrier->cd->credit_waiters, 1, memory_order_seq_cst);
+	if (timeout < 0)
+		_umtx_op(&cocarrier->cd->credits, UMTX_OP_WAIT_UINT, 0, NULL, NULL);
+	else {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+		_umtx_op(&cocarrier->cd->credits, UMTX_OP_WAIT_UINT, 0, (void *)(uintptr_t)sizeof(ts), &ts);
+	}
+	atomic_fetch_sub_explicit(&cocarrier->cd->credit_waiters, 1, memory_order_relaxed);
+}
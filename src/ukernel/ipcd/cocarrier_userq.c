@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2020 Peter S. Blandford-Baker
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology) under DARPA contract HR0011-18-C-0016 ("ECATS"), as part of the
+ * DARPA SSITH research programme.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include "cocarrier_userq.h"
+#include "ipcd.h"
+#include "ipcd_cap.h"
+
+#include <comsg/comsg_args.h>
+#include <comsg/coport.h>
+#include <comsg/utils.h>
+
+#include <cheri/cheric.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/errno.h>
+
+/*
+ * COPORT_USERDEQ cocarriers publish each message twice: to the usual slot 
+ * array, which only ipcd can see, and to a ring that receivers map read-only
+ * through cocarrier_userq_attach. Receivers also get a capability to cons
+ * alone, so it is the only shared state they can write and everything here 
+ * treats it as untrusted: a cons that has run ahead of prod or fallen more 
+ * than a ring behind reads as a full ring. ipcd never reads back the shared
+ * depth or slots, only its own copies.
+ */
+size_t
+cocarrier_userq_len(coport_t *cocarrier)
+{
+	size_t prod, cons, depth;
+
+	depth = COCARRIER_DEPTH(cocarrier);
+	prod = cocarrier->cd->userq_prod;
+	cons = atomic_load_explicit(&cocarrier->cd->userq->cons, memory_order_acquire);
+	if (prod - cons > depth)
+		return (depth);
+	return (prod - cons);
+}
+
+void
+cocarrier_userq_publish(coport_t *cocarrier, struct cocarrier_message *msg)
+{
+	struct cocarrier_userq_slot *slot;
+	size_t prod;
+
+	prod = cocarrier->cd->userq_prod;
+	slot = &cocarrier->cd->userq_slots[prod & (COCARRIER_DEPTH(cocarrier) - 1)];
+	slot->buf = cheri_andperm(msg->buf, COCARRIER_MSG_PERMS);
+	slot->nattachments = msg->nattachments;
+	cocarrier->cd->userq_prod = prod + 1;
+	atomic_store_explicit(&cocarrier->cd->userq->prod, prod + 1, memory_order_release);
+}
+
+/* 
+ * Claim the oldest message for a receiver calling into ipcd. Userspace 
+ * receivers may claim concurrently, hence the CAS. Fails if the ring is empty,
+ * or if the oldest message has attachments and attachments_ok is false.
+ */
+bool
+cocarrier_userq_claim(coport_t *cocarrier, size_t *index, bool attachments_ok)
+{
+	struct cocarrier_message **cocarrier_buf;
+	size_t prod, cons, depth;
+
+	cocarrier_buf = cocarrier->buffer->buf;
+	depth = COCARRIER_DEPTH(cocarrier);
+	prod = cocarrier->cd->userq_prod;
+	cons = atomic_load_explicit(&cocarrier->cd->userq->cons, memory_order_acquire);
+	do {
+		if (cons == prod || prod - cons > depth)
+			return (false);
+		*index = cons & (depth - 1);
+		if (!attachments_ok && cocarrier_buf[*index]->attachments != NULL)
+			return (false);
+	} while (!atomic_compare_exchange_weak_explicit(&cocarrier->cd->userq->cons, &cons, cons + 1, memory_order_acq_rel, memory_order_acquire));
+	return (true);
+}
+
+/* Whether the message in slot index has been taken by some receiver */
+bool
+cocarrier_userq_consumed(coport_t *cocarrier, size_t index)
+{
+	size_t prod, cons, depth, live;
+
+	depth = COCARRIER_DEPTH(cocarrier);
+	prod = cocarrier->cd->userq_prod;
+	cons = atomic_load_explicit(&cocarrier->cd->userq->cons, memory_order_acquire);
+	live = prod - cons;
+	if (live > depth)
+		return (false);
+	return (((index - cons) & (depth - 1)) >= live);
+}
+
+/* 
+ * Userspace receivers cannot update the event mask, so for COPORT_USERDEQ 
+ * cocarriers COPOLL_IN and COPOLL_OUT are recomputed from the ring.
+ */
+coport_eventmask_t
+cocarrier_events(coport_t *cocarrier)
+{
+	coport_eventmask_t event;
+	size_t len;
+
+	event = atomic_load_explicit(&cocarrier->info->event, memory_order_acquire);
+	if (cocarrier->type != COCARRIER || cocarrier->cd->userq == NULL)
+		return (event); /* COBROADCAST ports are polled too */
+	len = cocarrier_userq_len(cocarrier);
+	event &= ~(COPOLL_IN | COPOLL_OUT);
+	if (len != 0)
+		event |= COPOLL_IN;
+	if (len < COCARRIER_DEPTH(cocarrier) && (event & COPOLL_CLOSED) == 0)
+		event |= COPOLL_OUT;
+	return (event);
+}
+
+int 
+validate_cocarrier_userq_args(coopen_args_t *cocall_args)
+{
+	return (valid_cocarrier(cocall_args->port));
+}
+
+void
+cocarrier_userq_attach(coopen_args_t *cocall_args, void *token)
+{
+	UNUSED(token);
+	coport_t *cocarrier;
+	_Atomic size_t *cons;
+
+	cocarrier = unseal_coport(cocall_args->port);
+	if (cocarrier->cd->userq == NULL)
+		COCALL_ERR(cocall_args, EOPNOTSUPP);
+	cons = cheri_setboundsexact(&cocarrier->cd->userq->cons, sizeof(cocarrier->cd->userq->cons));
+	cocall_args->userq = cheri_andperm(cocarrier->cd->userq, COCARRIER_USERQ_PERMS);
+	cocall_args->userq_cons = cheri_andperm(cons, COCARRIER_USERQ_CONS_PERMS);
+	COCALL_RETURN(cocall_args, 0);
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2020 Peter S. Blandford-Baker
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology) under DARPA contract HR0011-18-C-0016 ("ECATS"), as part of the
+ * DARPA SSITH research programme.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef _COCARRIER_USERQ_H
+#define _COCARRIER_USERQ_H
+
+#include "ipcd.h"
+
+#include <comsg/comsg_args.h>
+#include <comsg/coport.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* All but cocarrier_userq_len and cocarrier_events need the coport locked */
+size_t cocarrier_userq_len(coport_t *cocarrier);
+void cocarrier_userq_publish(coport_t *cocarrier, struct cocarrier_message *msg);
+bool cocarrier_userq_claim(coport_t *cocarrier, size_t *index, bool attachments_ok);
+bool cocarrier_userq_consumed(coport_t *cocarrier, size_t index);
+coport_eventmask_t cocarrier_events(coport_t *cocarrier);
+
+int validate_cocarrier_userq_args(coopen_args_t *cocall_args);
+void cocarrier_userq_attach(coopen_args_t *cocall_args, void *token);
+
+#endif //!defined(_COCARRIER_USERQ_H)
@@ -29,14 +29,170 @@
  * SUCH DAMAGE.
  */
 #include "coclose.h"
+#include "cobroadcast.h"
+#include "cocarrier_credit.h"
+#include "copoll_utils.h"
+#include "ipcd.h"
 #include "ipcd_cap.h"
 #include "coport_table.h"
+#include "sppool.h"
 
 #include <comsg/comsg_args.h>
 #include <comsg/coport.h>
 #include <comsg/utils.h>
 
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <sys/errno.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/umtx.h>
+#include <time.h>
+
+/* 
+ * Received messages that have not been freed still belong to their receivers,
+ * who may be reading them. COPORT_INLINE messages have nothing to release.
+ */
+static bool
+cocarrier_msgs_outstanding(coport_t *coport)
+{
+	struct cocarrier_message **cocarrier_buf;
+	struct cocarrier_message *msg;
+
+	cocarrier_buf = coport->buffer->buf;
+	for (size_t i = 0; i < COCARRIER_DEPTH(coport); i++) {
+		msg = cocarrier_buf[i];
+		if (COCARRIER_MSG_INLINE(msg))
+			continue;
+		else if (!atomic_load_explicit(&msg->recvd, memory_order_acquire))
+			continue;
+		else if (!atomic_load_explicit(&msg->freed, memory_order_acquire))
+			return (true);
+	}
+	return (false);
+}
+
+/*
+ * A closed coport's slot can be recycled once nothing in ipcd can still reach
+ * its state. COPORT_USERDEQ consumers hold pointers into it that ipcd cannot
+ * take back, so those coports are never recycled. COBROADCAST subscribers 
+ * were detached by coport_close, and check the port's generation.
+ * COPIPE and COCHANNEL ops run in libcomsg; coport_close has already waited
+ * for them (see drain_coport_users). A cocarrier waits until its received
+ * messages are freed; free_comsg then reclaims it.
+ */
+static bool
+coport_reclaimable(coport_t *coport)
+{
+	switch (coport->type) {
+	case COPIPE:
+	case COCHANNEL:
+		return (true);
+	case COCARRIER:
+		if (coport->cd->userq != NULL)
+			return (false);
+		else if (coport->info->length != 0)
+			return (false);
+		else if (!LIST_EMPTY(&coport->cd->listeners))
+			return (false);
+		else if (atomic_load_explicit(&coport->cd->pending.queued, memory_order_acquire))
+			return (false);
+		else if (cocarrier_msgs_outstanding(coport))
+			return (false);
+		return (true);
+	case COBROADCAST:
+		if (!LIST_EMPTY(&coport->cd->bcast.listeners))
+			return (false);
+		else if (atomic_load_explicit(&coport->cd->bcast.pending.queued, memory_order_acquire))
+			return (false);
+		return (true);
+	default:
+		return (false);
+	}
+}
+
+/* 
+ * info, cd, the block holding the ring and buffer, the message structs and any
+ * COPORT_INLINE slots stay with the slot (see get_coport_block, 
+ * get_coport_msgs and get_coport_inline), so receivers' capabilities into them
+ * never point at another allocation.
+ */
+static void
+teardown_coport(coport_t *coport)
+{
+	/* a plain copipe's buffer belongs to its receiver */
+	if (coport->type == COCHANNEL && sppool_owns(coport->buffer->buf))
+		sppool_free(coport->buffer->buf);
+	else if (coport->type == COBROADCAST)
+		release_cobroadcast_buffers(coport);
+}
+
+/* 
+ * Called on closing coports by whoever may have made them reclaimable. Bumping
+ * the generation makes every outstanding handle fail valid_coport (and the 
+ * libcomsg copipe/cochannel ops) before the slot goes back on the free list.
+ */
+void
+reclaim_coport(coport_t *coport)
+{
+	coport_status_t status;
+
+	status = COPORT_CLOSING;
+	while(!atomic_compare_exchange_weak_explicit(&coport->info->status, &status, COPORT_BUSY, memory_order_acq_rel, memory_order_relaxed)) {
+		switch (status) {
+		case COPORT_OPEN:
+		case COPORT_CLOSED:
+			return;
+		default:
+			status = COPORT_CLOSING;
+			break;
+		}
+	}
+	if (!coport_reclaimable(coport)) {
+		atomic_store_explicit(&coport->info->status, COPORT_CLOSING, memory_order_release);
+		return;
+	}
+	atomic_fetch_add_explicit(&coport->info->gen, 1, memory_order_seq_cst);
+	teardown_coport(coport);
+	atomic_store_explicit(&coport->info->status, COPORT_CLOSED, memory_order_release);
+	free_coport(coport);
+}
+
+/* 
+ * Waits for libcomsg ops on a closing copipe or cochannel to finish. They 
+ * count themselves in info->users, and fail to start once DRAINING is set.
+ * A peer could hold users up forever, so give up after COPORT_DRAIN_MS; the
+ * port then stays closing and its slot is never reused.
+ */
+#define COPORT_DRAIN_MS (100)
+
+static bool
+drain_coport_users(coport_t *coport)
+{
+	struct timespec deadline, curtime;
+	uint32_t users;
+
+	users = atomic_fetch_or_explicit(&coport->info->users, COPORT_USERS_DRAINING, memory_order_seq_cst);
+	users |= COPORT_USERS_DRAINING;
+	if (users == COPORT_USERS_DRAINING)
+		return (true);
+
+	deadline.tv_sec = 0;
+	deadline.tv_nsec = COPORT_DRAIN_MS * 1000000;
+	clock_gettime(CLOCK_MONOTONIC, &curtime);
+	timespecadd(&deadline, &curtime, &deadline);
+	while (users != COPORT_USERS_DRAINING) {
+		clock_gettime(CLOCK_MONOTONIC, &curtime);
+		if (!timespeccmp(&curtime, &deadline, <))
+			return (false);
+		timespecsub(&deadline, &curtime, &curtime);
+		_umtx_op(&coport->info->users, UMTX_OP_WAIT_UINT, users, (void *)(uintptr_t)sizeof(curtime), &curtime);
+		users = atomic_load_explicit(&coport->info->users, memory_order_seq_cst);
+	}
+	return (true);
+}
 
 int 
 validate_coclose_args(coclose_args_t *cocall_args)
@@ -54,6 +210,7 @@ coport_close(coclose_args_t *cocall_args, void *token)
 	coport_t *coport;
 	coport_status_t status;
 	coport_eventmask_t events;
+	coport_flags_t flags;
 
 	/* TODO-PBB: check permissions */
 	coport = unseal_coport(cocall_args->port);
@@ -74,12 +231,40 @@ coport_close(coclose_args_t *cocall_args, void *token)
 			break;
 		}
 	}
+	if (!coport_handle_current(coport)) {
+		/* the slot was recycled while we waited; the status is another coport's */
+		atomic_store_explicit(&coport->info->status, COPORT_OPEN, memory_order_release);
+		COCALL_ERR(cocall_args, EPIPE);
+	}
 	events = coport->info->event;
 	events &= ~(COPOLL_OUT);
 	events |= COPOLL_CLOSED;
 	coport->info->event = events;
 
-	atomic_store_explicit(&coport->info->status, COPORT_CLOSING, memory_order_release);
+	flags = coport->flags; /* the slot may be reused once reclaimed */
+	if (coport->type == COCARRIER || coport->type == COBROADCAST)
+		detach_coport_listeners(coport);
+	if (coport->type == COBROADCAST)
+		detach_cobroadcast_subscribers(coport);
+	if ((flags & COPORT_CREDIT) != 0)
+		close_cocarrier_credits(coport);
+	atomic_store_explicit(&coport->info->status, COPORT_CLOSING, memory_order_seq_cst);
+	/* Parked copipe/cochannel users must see the port is closing */
+	if (atomic_load_explicit(&coport->info->waiters, memory_order_seq_cst) != 0) {
+		_umtx_op(&coport->info->status, UMTX_OP_WAKE, INT_MAX, NULL, NULL);
+		if ((flags & COPORT_WAIT_BLOCK) != 0) {
+			pthread_mutex_lock(&coport->cd->sync.lock);
+			pthread_cond_broadcast(&coport->cd->sync.wakeup);
+			pthread_mutex_unlock(&coport->cd->sync.lock);
+		}
+		if ((flags & COPORT_RECVQ) != 0) {
+			_umtx_op(&coport->cd->recvq.posted, UMTX_OP_WAKE, INT_MAX, NULL, NULL);
+			_umtx_op(&coport->cd->recvq.fill_tail, UMTX_OP_WAKE, INT_MAX, NULL, NULL);
+		}
+	}
+	if ((coport->type == COPIPE || coport->type == COCHANNEL) && !drain_coport_users(coport))
+		COCALL_RETURN(cocall_args, 0);
+	reclaim_coport(coport);
 
 	COCALL_RETURN(cocall_args, 0);
 }
@@ -32,8 +32,10 @@
 #define _COCLOSE_H
 
 #include <comsg/comsg_args.h>
+#include <comsg/coport.h>
 
 int validate_coclose_args(coclose_args_t *cocall_args);
 void coport_close(coclose_args_t *cocall_args, void *token);
+void reclaim_coport(coport_t *coport);
 
 #endif //!defined(_COCLOSE_H)
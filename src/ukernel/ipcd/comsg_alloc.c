@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2020 Peter S. Blandford-Baker
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology) under DARPA contract HR0011-18-C-0016 ("ECATS"), as part of the
+ * DARPA SSITH research programme.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include "comsg_alloc.h"
+#include "ipcd.h"
+#include "ipcd_cap.h"
+#include "zcpool.h"
+
+#include <comsg/comsg_args.h>
+#include <comsg/coport.h>
+#include <comsg/utils.h>
+
+#include <cheri/cheric.h>
+#include <sys/errno.h>
+
+extern void begin_cocall(void);
+extern void end_cocall(void);
+
+int 
+validate_comsg_alloc_args(cosend_args_t *cocall_args)
+{
+	if (!valid_cocarrier(cocall_args->cocarrier))
+		return (0);
+	else if (cocall_args->length == 0 || cocall_args->length > COCARRIER_MAX_MSG_LEN)
+		return (0);
+	return (1);
+}
+
+/*
+ * Allocates a buffer from the zero-copy pool for a cocarrier. Sending it there
+ * with the returned handle transfers it to ipcd without copying; it is then 
+ * released by the receiver with coport_msg_free. Unsent buffers are released
+ * with the handle.
+ */
+void 
+alloc_comsg(cosend_args_t *cocall_args, void *token) 
+{
+	UNUSED(token);
+	coport_t *cocarrier;
+	uint64_t gen;
+	void *buf;
+
+	begin_cocall();
+	cocarrier = unseal_coport(cocall_args->cocarrier);
+	buf = zcpool_alloc(cocall_args->length, cheri_getaddress(cocarrier), &gen);
+	end_cocall();
+	if (buf == NULL)
+		COCALL_ERR(cocall_args, errno);
+
+	cocall_args->message = cheri_andperm(buf, COCARRIER_ZC_PERMS);
+	cocall_args->length = cheri_getlen(buf);
+	cocall_args->msg_handle.slot = seal_zcpool_token(buf);
+	cocall_args->msg_handle.gen = gen;
+	COCALL_RETURN(cocall_args, 0);
+}
@@ -29,10 +29,15 @@
  * SUCH DAMAGE.
  */
 #include "comsg_free.h"
+#include "coclose.h"
 #include "ipcd.h"
 #include "ipcd_cap.h"
 #include "coport_table.h"
+#include "cocarrier_userq.h"
+#include "sppool.h"
+#include "zcpool.h"
 
+#include <ccmalloc.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <comsg/comsg_args.h>
@@ -50,11 +55,84 @@ validate_comsg_free_args(cosend_args_t *cocall_args)
 	coport_t *port = cocall_args->cocarrier;
 	if (!valid_coport(port))
 		return (0);
+	else if (cocall_args->msg_handle.slot != NULL)
+		return (valid_cocarrier_msg(cocall_args->msg_handle.slot) || 
+		    valid_zcpool_token(cocall_args->msg_handle.slot));
 	else if (!__builtin_cheri_tag_get(cocall_args->message))
 		return (0);
 	return (1);
 }
 
+void
+free_cocarrier_msg_alloc(void *alloc)
+{
+	if (alloc == NULL)
+		return; /* COPORT_INLINE messages live in their slot */
+	else if (zcpool_owns(alloc))
+		zcpool_free(alloc);
+	else if (sppool_owns(alloc))
+		sppool_free(alloc);
+	else
+		ccslab_free(alloc);
+}
+
+/* 
+ * The message structs of a cocarrier are laid out in one array, so a slot 
+ * belongs to it only if it sits at the right offset and the queue points to it.
+ */
+static bool
+cocarrier_owns_msg(coport_t *cocarrier, struct cocarrier_message *msg)
+{
+	struct cocarrier_message **cocarrier_buf;
+	vaddr_t base, addr;
+	size_t index;
+
+	cocarrier_buf = cocarrier->buffer->buf;
+	base = cheri_getaddress(cocarrier_buf[0]);
+	addr = cheri_getaddress(msg);
+	if (addr < base || ((addr - base) % sizeof(struct cocarrier_message)) != 0)
+		return (false);
+	index = (addr - base) / sizeof(struct cocarrier_message);
+	if (index >= COCARRIER_DEPTH(cocarrier))
+		return (false);
+	return (cheri_getaddress(cocarrier_buf[index]) == addr);
+}
+
+/* 
+ * Frees the message named by a handle from corecv. The slot generation must 
+ * still match, otherwise the slot has been reused and the handle is stale.
+ * Once freed is set the slot belongs to the next sender, which may already be
+ * refilling it, so the slot itself is left alone.
+ */
+static int
+free_comsg_handle(coport_t *cocarrier, comsg_handle_t *handle)
+{
+	struct cocarrier_message *msg;
+	void *alloc;
+	bool freed;
+
+	msg = unseal_cocarrier_msg(handle->slot);
+	if (!cocarrier_owns_msg(cocarrier, msg))
+		return (EINVAL);
+	else if (atomic_load_explicit(&msg->gen, memory_order_acquire) != handle->gen)
+		return (EINVAL);
+	else if (!atomic_load_explicit(&msg->recvd, memory_order_acquire))
+		return (EINVAL);
+
+	freed = false;
+	if (!atomic_compare_exchange_strong(&msg->freed, &freed, true))
+		return (EINVAL);
+	alloc = msg->alloc;
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&msg->gen, memory_order_relaxed) != handle->gen) {
+		/* slot was refilled after our first check; the message is not ours */
+		atomic_store_explicit(&msg->freed, false, memory_order_release);
+		return (EINVAL);
+	}
+	free_cocarrier_msg_alloc(alloc);
+	return (0);
+}
+
 void
 free_comsg(cosend_args_t *cocall_args, void *token) 
 {
@@ -63,17 +141,44 @@ free_comsg(cosend_args_t *cocall_args, void *token)
 	void *msg_buf;
 	struct cocarrier_message **cocarrier_buf;
 	bool freed;
+	int error;
 
 	begin_cocall();
 	/* TODO-PBB: check permissions */
-	coport = unseal_coport(cocall_args->cocarrier);
+	if (valid_zcpool_token(cocall_args->msg_handle.slot)) {
+		/* A zero-copy buffer that was never sent goes straight back to the pool */
+		coport = unseal_coport(cocall_args->cocarrier);
+		error = zcpool_release_unsent(unseal_zcpool_token(cocall_args->msg_handle.slot), 
+		    cocall_args->msg_handle.gen, cheri_getaddress(coport));
+		end_cocall();
+		if (error != 0)
+			COCALL_ERR(cocall_args, error);
+		COCALL_RETURN(cocall_args, 0);
+	} else if (cocall_args->msg_handle.slot != NULL) {
+		if (coport_gettype(cocall_args->cocarrier) != COCARRIER) {
+			end_cocall();
+			COCALL_ERR(cocall_args, EINVAL);
+		}
+		coport = unseal_coport(cocall_args->cocarrier);
+		error = free_comsg_handle(coport, &cocall_args->msg_handle);
+		end_cocall();
+		if (error != 0)
+			COCALL_ERR(cocall_args, error);
+		/* a closing cocarrier may have been waiting on this message */
+		reclaim_coport(coport);
+		COCALL_RETURN(cocall_args, 0);
+	}
+
+	/* No handle, so search the cocarrier for the buffer */
 	msg_buf = cocall_args->message;
+	coport = unseal_coport(cocall_args->cocarrier);
 	cocarrier_buf = coport->buffer->buf;
-	for (size_t i = 0; i < COCARRIER_SIZE; i++) {
+	for (size_t i = 0; i < COCARRIER_DEPTH(coport); i++) {
 		struct cocarrier_message *msg = cocarrier_buf[i];
 		if (!cheri_gettag(msg))
 			continue;
-		else if (!atomic_load(&msg->recvd))
+		else if (!atomic_load(&msg->recvd) && 
+		    (coport->cd->userq == NULL || !cocarrier_userq_consumed(coport, i)))
 			continue;
 		else if ((freed = atomic_load(&msg->freed)))
 			continue;
@@ -81,9 +186,9 @@ free_comsg(cosend_args_t *cocall_args, void *token)
 		if ((buf == msg_buf) && (__builtin_cheri_length_get(buf) == __builtin_cheri_length_get(msg_buf))) {
 			// freed = false
 			if(atomic_compare_exchange_strong(&msg->freed, &freed, true)) {
-				free(buf);
-				msg->buf = NULL; /* no longer needed */
+				free_cocarrier_msg_alloc(msg->alloc);
 				end_cocall();
+				reclaim_coport(coport);
 				COCALL_RETURN(cocall_args, 0);
 			} else
 				break;
@@ -35,5 +35,6 @@
 
 int validate_comsg_free_args(cosend_args_t *);
 void free_comsg(cosend_args_t *, void *);
+void free_cocarrier_msg_alloc(void *);
 
 #endif //!defined(_COMSG_FREE_H)
@@ -29,26 +29,33 @@
  * SUCH DAMAGE.
  */
 #include "coopen.h"
+#include "cocarrier_credit.h"
 #include "coport_table.h"
+#include "sppool.h"
 
 #include "ipcd.h"
 #include "ipcd_cap.h"
 
 #include <assert.h>
+#include <err.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <comsg/comsg_args.h>
 #include <comsg/coport.h>
 #include <comsg/utils.h>
 #include <stdlib.h>
 #include <cheri/cheric.h>
 #include <cheri/cherireg.h>
+#include <string.h>
+#include <strings.h>
 #include <sys/errno.h>
+#include <sys/param.h>
 #include <sys/queue.h>
+#include <sysexits.h>
 
 extern void begin_cocall(void);
 extern void end_cocall(void);
 
-#ifdef COPIPE_PTHREAD
-
 static pthread_mutexattr_t copipe_mtx_attr;
 static pthread_condattr_t copipe_cnd_attr;
 
@@ -65,90 +72,487 @@ init_copipe_sync_attributes(void)
 	pthread_condattr_setpshared(&copipe_cnd_attr, PTHREAD_PROCESS_SHARED);
 	pthread_condattr_setclock(&copipe_cnd_attr, CLOCK_MONOTONIC);
 }
-#endif
 
 int validate_coopen_args(coopen_args_t *cocall_args)
 {
-	if (cocall_args->coport_type != COPIPE && cocall_args->coport_type != COCARRIER && cocall_args->coport_type != COCHANNEL)
+	coport_flags_t flags = cocall_args->coport_flags;
+
+	if (cocall_args->coport_type != COPIPE && cocall_args->coport_type != COCARRIER && 
+	    cocall_args->coport_type != COCHANNEL && cocall_args->coport_type != COBROADCAST)
+		return (0);
+	else if ((flags & ~COPORT_VALID_FLAGS) != 0)
+		return (0);
+	else if ((flags & COPORT_RING) != 0 && cocall_args->coport_type != COCHANNEL)
+		return (0);
+	else if ((flags & COPORT_MPMC) != 0 && (flags & COPORT_RING) == 0)
+		return (0);
+	else if ((flags & COPORT_RECVQ) != 0 && cocall_args->coport_type != COPIPE)
+		return (0);
+	else if ((flags & COPORT_USERDEQ) != 0 && cocall_args->coport_type != COCARRIER)
 		return (0);
-	else
-		return (1);
+	else if ((flags & COPORT_CREDIT) != 0 && 
+	    (cocall_args->coport_type != COCARRIER || (flags & COPORT_USERDEQ) != 0))
+		return (0);
+	else if ((flags & COPORT_INLINE) != 0 && 
+	    (cocall_args->coport_type != COCARRIER || (flags & COPORT_USERDEQ) != 0))
+		return (0);
+	else if ((flags & COPORT_SUPERPAGE) != 0 && 
+	    cocall_args->coport_type != COCARRIER && cocall_args->coport_type != COCHANNEL)
+		return (0);
+	else if ((flags & COPORT_WAIT_HYBRID) != 0 && 
+	    (cocall_args->coport_type != COPIPE || (flags & COPORT_RECVQ) != 0))
+		return (0);
+	
+	switch (cocall_args->coport_type) {
+	case COCHANNEL:
+		return (cocall_args->coport_capacity <= COPORT_MAX_BUF_LEN);
+	case COCARRIER:
+	case COBROADCAST:
+		return (cocall_args->coport_capacity <= COCARRIER_MAX_SIZE);
+	case COPIPE:
+		if ((flags & COPORT_RECVQ) != 0)
+			return (cocall_args->coport_capacity <= COPIPE_RECVQ_MAX_DEPTH);
+		return (cocall_args->coport_capacity == 0);
+	default:
+		return (cocall_args->coport_capacity == 0);
+	}
 }
 
-static void
-init_coport(coport_t *port, coport_type_t type) 
+/*
+ * COCHANNEL capacity is in bytes, COCARRIER and COBROADCAST capacity is a number of messages,
+ * and COPORT_RECVQ COPIPE capacity is a number of posted buffers. Zero selects
+ * the default. Capacities are rounded up to a power of two.
+ */
+static size_t
+get_coport_capacity(coport_type_t type, coport_flags_t flags, size_t requested)
+{
+	size_t capacity;
+
+	switch (type) {
+	case COPIPE:
+		if ((flags & COPORT_RECVQ) == 0)
+			return (0);
+		if (requested == 0)
+			return (COPIPE_RECVQ_DEPTH);
+		capacity = requested;
+		break;
+	case COCHANNEL:
+		if (requested == 0)
+			return (COPORT_BUF_LEN);
+		capacity = MAX(requested, COPORT_MIN_BUF_LEN);
+		break;
+	case COCARRIER:
+	case COBROADCAST:
+		if (requested == 0)
+			return (COCARRIER_SIZE);
+		capacity = MAX(requested, COCARRIER_MIN_SIZE);
+		break;
+	default:
+		return (0);
+	}
+	return (1UL << flsl(capacity - 1));
+}
+
+static void *
+alloc_coport_buffer(size_t len)
+{
+	void *buf;
+
+	/* naturally aligned so that bounds are exact and length gives capacity */
+	buf = aligned_alloc(len, len);
+	if (buf == NULL)
+		return (NULL);
+	return (cheri_setboundsexact(buf, len));
+}
+
+/* COPORT_SUPERPAGE cochannel rings come from the pool if it has room */
+static void *
+alloc_superpage_ring(size_t len)
+{
+	void *buf;
+
+	buf = sppool_alloc(len);
+	if (buf == NULL)
+		return (NULL);
+	return (cheri_setboundsexact(buf, len));
+}
+
+static int
+init_cocarrier_userq(coport_t *port, size_t capacity)
+{
+	struct _cocarrier_userq *userq;
+	size_t slots_len;
+
+	userq = aligned_alloc(CACHE_LINE_SIZE, roundup2(sizeof(struct _cocarrier_userq), CACHE_LINE_SIZE));
+	if (userq == NULL)
+		return (ENOMEM);
+	slots_len = capacity * sizeof(struct cocarrier_userq_slot);
+	port->cd->userq_slots = alloc_coport_buffer(slots_len);
+	if (port->cd->userq_slots == NULL) {
+		free(userq);
+		return (ENOMEM);
+	}
+	memset(port->cd->userq_slots, '\0', slots_len);
+	port->cd->userq_prod = 0;
+
+	userq->prod = 0;
+	userq->cons = 0;
+	userq->depth = capacity;
+	userq->slots = cheri_andperm(port->cd->userq_slots, DEFAULT_BUFFER_PERMS);
+	port->cd->userq = userq;
+	return (0);
+}
+
+/* Bytes of ring (message slots, or data for COCHANNEL) a coport needs */
+static size_t
+get_coport_ring_len(coport_type_t type, coport_flags_t flags, size_t capacity)
 {
-	size_t buf_perms;
+	switch (type) {
+	case COPIPE:
+		if ((flags & COPORT_RECVQ) == 0)
+			return (0);
+		return (capacity * sizeof(struct copipe_recv_slot));
+	case COCARRIER:
+		return (capacity * CHERICAP_SIZE);
+	case COCHANNEL:
+		return (capacity);
+	case COBROADCAST:
+		return (capacity * sizeof(struct cobroadcast_slot));
+	default:
+		return (0);
+	}
+}
+
+/* 
+ * A coport's ring and its coport_buf_t share one block, which stays with the
+ * table entry (see get_coport_block). The ring comes first so that it is 
+ * naturally aligned and its bounds are exact. A cocarrier's message structs 
+ * are kept apart (see get_coport_msgs), as message handles point into them.
+ */
+#define COPORT_BLOCK_BUF_LEN (roundup2(sizeof(coport_buf_t), CACHE_LINE_SIZE))
+
+static int
+init_cocarrier_msgs(coport_t *port, size_t capacity)
+{
+	struct cocarrier_message *msgs, *msg;
+	void **cocarrier_buf;
+
+	msgs = get_coport_msgs(port, capacity);
+	if (msgs == NULL)
+		return (ENOMEM);
+	cocarrier_buf = port->buffer->buf;
+	for (size_t i = 0; i < capacity; i++) {
+		msg = cheri_setboundsexact(&msgs[i], sizeof(struct cocarrier_message));
+		/* gen carries over so stale message handles stay stale */
+		msg->buf = NULL;
+		msg->alloc = NULL;
+		msg->attachments = NULL;
+		msg->nattachments = 0;
+		atomic_store_explicit(&msg->freed, false, memory_order_relaxed);
+		atomic_store_explicit(&msg->recvd, false, memory_order_relaxed);
+		atomic_store_explicit(&msg->sent, false, memory_order_relaxed);
+		cocarrier_buf[i] = msg;
+	}
+	return (0);
+}
+
+/* info and cd live together and stay with the table entry once allocated */
+struct coport_meta {
+	coport_info_t info;
+	coport_typedep_t cd;
+};
+
+/* Returns 0, or ENOMEM with anything allocated for this open released */
+static int
+init_coport(coport_t *port, coport_type_t type, coport_flags_t flags, size_t capacity) 
+{
+	struct coport_meta *meta;
+	size_t buf_perms, ring_len, block_len;
+	char *block;
+	void *ring;
+
 	port->type = type;
+	port->flags = flags;
 	
-	port->info = malloc(sizeof(coport_info_t));
-	port->info = cheri_andperm(port->info, COPORT_INFO_PERMS);
+	/* A recycled slot keeps its info and cd; info->gen must carry over */
+	if (port->info == NULL) {
+		meta = aligned_alloc(CACHE_LINE_SIZE, roundup2(sizeof(struct coport_meta), CACHE_LINE_SIZE));
+		if (meta == NULL)
+			return (ENOMEM);
+		memset(meta, '\0', sizeof(struct coport_meta));
+		port->info = cheri_setboundsexact(&meta->info, sizeof(coport_info_t));
+		port->info = cheri_andperm(port->info, COPORT_INFO_PERMS);
+		port->cd = cheri_setboundsexact(&meta->cd, sizeof(coport_typedep_t));
+	}
 	port->info->start = 0;
 	port->info->end = 0;
 	port->info->status = COPORT_OPEN;
+	/* 
+	 * waiters and users are left alone, as stragglers from the last open may
+	 * still decrement them; the slot's handles are stale, so they do no more.
+	 */
+	atomic_fetch_and_explicit(&port->info->users, ~COPORT_USERS_DRAINING, memory_order_relaxed);
+	memset(&port->info->stats, 0, sizeof(port->info->stats));
+
+	ring = NULL;
+	if (type == COCHANNEL && (flags & COPORT_SUPERPAGE) != 0)
+		ring = alloc_superpage_ring(capacity);
+	ring_len = (ring != NULL) ? 0 : get_coport_ring_len(type, flags, capacity);
+	block_len = ring_len + COPORT_BLOCK_BUF_LEN;
+	block = get_coport_block(port, MAX(ring_len, CACHE_LINE_SIZE), block_len);
+	if (block == NULL) {
+		if (ring != NULL)
+			sppool_free(ring);
+		return (ENOMEM);
+	}
+	if (ring_len != 0)
+		ring = cheri_setboundsexact(block, ring_len);
+	port->buffer = cheri_setboundsexact(block + ring_len, sizeof(coport_buf_t));
+	port->buffer->buf = ring;
 
-	port->buffer = malloc(sizeof(coport_buf_t));
-	port->cd = malloc(sizeof(coport_typedep_t));
 	buf_perms = COCHANNEL_BUF_PERMS;
 	switch (port->type)
 	{
 		case COPIPE:
 			port->info->length = CHERICAP_SIZE;
 			port->info->event = NOEVENT;
-			port->buffer->buf = NULL;
+			if ((flags & COPORT_RECVQ) != 0) {
+				memset(port->buffer->buf, '\0', ring_len);
+				port->buffer->buf = cheri_andperm(port->buffer->buf, COPIPE_BUFFER_PERMS);
+				port->cd->recvq.posted = 0;
+				port->cd->recvq.reaped = 0;
+				port->cd->recvq.fill_head = 0;
+				port->cd->recvq.fill_tail = 0;
+			}
 			port->buffer = cheri_andperm(port->buffer, COPIPE_BUFFER_PERMS);
-#ifdef COPIPE_PTHREAD
-			pthread_mutex_init(&port->cd->pipe_lock, &copipe_mtx_attr);
-			pthread_cond_init(&port->cd->pipe_wakeup, &copipe_cnd_attr);
-			port->cd->waiting = false;
-#endif
+			if ((flags & COPORT_WAIT_BLOCK) != 0 && !port->cd->sync.initialised) {
+				pthread_mutex_init(&port->cd->sync.lock, &copipe_mtx_attr);
+				pthread_cond_init(&port->cd->sync.wakeup, &copipe_cnd_attr);
+				port->cd->sync.initialised = true;
+			}
 			break;
 		case COCARRIER:
 			LIST_INIT(&port->cd->listeners);
 			port->cd->levent = NOEVENT;
+			port->cd->pending.next = NULL;
+			port->cd->pending.queued = false;
+			port->cd->pending.coport = port;
+			port->cd->pending.notifier = -1;
+			port->cd->userq = NULL;
+			port->cd->userq_slots = NULL;
+			port->cd->inline_slots = NULL;
+			if (init_cocarrier_msgs(port, capacity) != 0)
+				return (ENOMEM);
+			if ((flags & COPORT_INLINE) != 0) {
+				port->cd->inline_slots = get_coport_inline(port, capacity * COCARRIER_INLINE_LEN);
+				if (port->cd->inline_slots == NULL)
+					return (ENOMEM);
+			}
+			if ((flags & COPORT_USERDEQ) != 0 && init_cocarrier_userq(port, capacity) != 0)
+				return (ENOMEM);
+			if ((flags & COPORT_CREDIT) != 0)
+				init_cocarrier_credits(port, capacity);
 			buf_perms = COCARRIER_BUF_PERMS;
 		case COCHANNEL: 
 			port->info->length = 0;
 			port->info->event = COPOLL_INIT_EVENTS;
-			port->buffer->buf = malloc(COPORT_BUF_LEN);
 			port->buffer->buf = cheri_andperm(port->buffer->buf, buf_perms);
 			port->buffer = cheri_andperm(port->buffer, DEFAULT_BUFFER_PERMS);
+			if ((flags & COPORT_RING) != 0) {
+				port->cd->ring.prod_head = 0;
+				port->cd->ring.prod_tail = 0;
+				port->cd->ring.cons_head = 0;
+				port->cd->ring.cons_tail = 0;
+			}
+			break;
+		case COBROADCAST:
+			LIST_INIT(&port->cd->bcast.listeners);
+			port->cd->bcast.levent = NOEVENT;
+			port->cd->bcast.pending.next = NULL;
+			port->cd->bcast.pending.queued = false;
+			port->cd->bcast.pending.coport = port;
+			port->cd->bcast.pending.notifier = -1;
+			LIST_INIT(&port->cd->bcast.subscribers);
+			SLIST_INIT(&port->cd->bcast.spares);
+			port->cd->bcast.head = 0;
+			port->info->length = 0;
+			port->info->event = COPOLL_INIT_EVENTS;
+			memset(port->buffer->buf, '\0', ring_len);
+			port->buffer->buf = cheri_andperm(port->buffer->buf, COCARRIER_BUF_PERMS);
+			port->buffer = cheri_andperm(port->buffer, DEFAULT_BUFFER_PERMS);
 			break;
 		default:
 			//should not be reached
 			break;
 	}
-	//pre-allocate cocarrier structs
-	if (port->type == COCARRIER) {
-		void **cocarrier_msg_buf = (void **)port->buffer->buf;
-		for (size_t i = 0; i < COCARRIER_SIZE; i++) {
-			cocarrier_msg_buf[i] = calloc(1, sizeof(struct cocarrier_message));
-		}
-	}
 
 	atomic_thread_fence(memory_order_release);
 	/* To synchronise with acquires in send/recv operations */
+	return (0);
+}
+
+/* For slots init_coport, or making their handle, failed on; no handle was issued */
+static void
+abandon_coport(coport_t *port)
+{
+	if (port->info != NULL)
+		atomic_store_explicit(&port->info->status, COPORT_CLOSED, memory_order_release);
+	free_coport(port);
+}
+
+/*
+ * Default coports (no flags, default capacity) are opened ahead of time by a
+ * background thread, so that coopen only has to take one from a pool. Pools 
+ * are topped up once they fall below half full.
+ */
+#define COPORT_POOL_LEN (16)
+
+struct coport_pool {
+	pthread_mutex_t lock;
+	size_t nports;
+	coport_t *ports[COPORT_POOL_LEN];
+};
+
+static const coport_type_t pooled_types[N_COPORT_TABLES] = {COPIPE, COCARRIER, COCHANNEL, COBROADCAST};
+static struct coport_pool coport_pools[N_COPORT_TABLES];
+static size_t coport_pool_len;
+static pthread_mutex_t refill_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t refill_wakeup = PTHREAD_COND_INITIALIZER;
+static bool refill_wanted = false;
+static pthread_t refill_thread;
+
+static struct coport_pool *
+get_coport_pool(coport_type_t type)
+{
+	/* coport types are numbered from 1 in the order of pooled_types */
+	return (&coport_pools[type - COPIPE]);
+}
+
+static void
+fill_coport_pool(struct coport_pool *pool, coport_type_t type)
+{
+	coport_t *port;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		if (pool->nports >= coport_pool_len) {
+			pthread_mutex_unlock(&pool->lock);
+			return;
+		}
+		pthread_mutex_unlock(&pool->lock);
+
+		port = allocate_coport(type);
+		if (port == NULL)
+			return;
+		if (init_coport(port, type, 0, get_coport_capacity(type, 0, 0)) != 0) {
+			abandon_coport(port);
+			return;
+		}
+
+		/* only this thread adds to the pool, so there is still room */
+		pthread_mutex_lock(&pool->lock);
+		pool->ports[pool->nports++] = port;
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+static void *
+refill_coport_pools(void *args)
+{
+	UNUSED(args);
+
+	for (;;) {
+		pthread_mutex_lock(&refill_lock);
+		while (!refill_wanted)
+			pthread_cond_wait(&refill_wakeup, &refill_lock);
+		refill_wanted = false;
+		pthread_mutex_unlock(&refill_lock);
+
+		for (size_t i = 0; i < N_COPORT_TABLES; i++)
+			fill_coport_pool(&coport_pools[i], pooled_types[i]);
+	}
+	return (NULL);
+}
+
+static coport_t *
+take_pooled_coport(coport_type_t type)
+{
+	struct coport_pool *pool;
+	coport_t *port;
+	bool low;
+
+	pool = get_coport_pool(type);
+	pthread_mutex_lock(&pool->lock);
+	port = NULL;
+	if (pool->nports != 0)
+		port = pool->ports[--pool->nports];
+	low = (pool->nports < (coport_pool_len / 2));
+	pthread_mutex_unlock(&pool->lock);
+
+	if (low) {
+		pthread_mutex_lock(&refill_lock);
+		refill_wanted = true;
+		pthread_cond_signal(&refill_wakeup);
+		pthread_mutex_unlock(&refill_lock);
+	}
+	return (port);
+}
+
+/* Must be called after setup_coport_tables */
+void
+setup_coport_pools(void)
+{
+	/* leave most of a small table for coports with flags */
+	coport_pool_len = MIN(COPORT_POOL_LEN, get_coport_table_len() / 8);
+	for (size_t i = 0; i < N_COPORT_TABLES; i++) {
+		pthread_mutex_init(&coport_pools[i].lock, NULL);
+		coport_pools[i].nports = 0;
+		fill_coport_pool(&coport_pools[i], pooled_types[i]);
+	}
+	if (pthread_create(&refill_thread, NULL, refill_coport_pools, NULL) != 0)
+		err(EX_OSERR, "%s: pthread_create failed", __func__);
 }
 
 void coport_open(coopen_args_t *cocall_args, void *token)
 {
 	UNUSED(token);
-	coport_t *port_handle;
+	coport_t *port_handle, *port;
+	coport_type_t type;
+	coport_flags_t flags;
+	size_t capacity;
 
 	begin_cocall();
-	if(!can_allocate_coport(cocall_args->coport_type)) {
-		end_cocall();
-		COCALL_ERR(cocall_args, ENOMEM);
-	}
-	port_handle = allocate_coport(cocall_args->coport_type);
+	type = cocall_args->coport_type;
+	flags = cocall_args->coport_flags;
+	capacity = get_coport_capacity(type, flags, cocall_args->coport_capacity);
+	port_handle = NULL;
+	if (flags == 0 && capacity == get_coport_capacity(type, 0, 0))
+		port_handle = take_pooled_coport(type);
+
 	if (port_handle == NULL) {
+		if(!can_allocate_coport(type)) {
+			end_cocall();
+			COCALL_ERR(cocall_args, ENOMEM);
+		}
+		port_handle = allocate_coport(type);
+		if (port_handle == NULL) {
+			end_cocall();
+			COCALL_ERR(cocall_args, ENOMEM);
+		}
+		if (init_coport(port_handle, type, flags, capacity) != 0) {
+			abandon_coport(port_handle);
+			end_cocall();
+			COCALL_ERR(cocall_args, ENOMEM);
+		}
+	}
+
+	port = coport_handle(port_handle);
+	if (port == NULL) {
+		abandon_coport(port_handle);
 		end_cocall();
 		COCALL_ERR(cocall_args, ENOMEM);
 	}
-
-	init_coport(port_handle, cocall_args->coport_type);
-
-	port_handle = cheri_andperm(port_handle, COPORT_PERMS);
+	port_handle = cheri_andperm(port, COPORT_PERMS);
 	port_handle = seal_coport(port_handle);
 	cocall_args->port = port_handle;
 
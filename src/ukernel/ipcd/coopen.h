@@ -35,5 +35,6 @@
 
 int validate_coopen_args(coclose_args_t *cocall_args);
 void coport_open(coclose_args_t *cocall_args, void *token);
+void setup_coport_pools(void);
 
 #endif //!defined(_COOPEN_H)
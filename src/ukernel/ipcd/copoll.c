@@ -30,8 +30,10 @@
  */
 #include "copoll.h"
 
+#include "cocarrier_userq.h"
 #include "ipcd_cap.h"
 #include "copoll_utils.h"
+#include "copoll_deliver.h"
 
 #include <comsg/comsg_args.h>
 #include <comsg/coport.h>
@@ -39,6 +41,7 @@
 
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -46,6 +49,8 @@
 #include <string.h>
 #include <sys/errno.h>
 #include <sys/queue.h>
+#include <sys/time.h>
+#include <time.h>
 
 extern void begin_cocall(void);
 extern void end_cocall(void);
@@ -55,7 +60,8 @@ validate_copoll_args(copoll_args_t *cocall_args)
 {
 	size_t i;
 	for (i = 0; i < cocall_args->ncoports; i++) {
-		if (!valid_cocarrier(cocall_args->coports[i].coport))
+		if (!valid_cocarrier(cocall_args->coports[i].coport) && 
+		    !valid_cobroadcast(cocall_args->coports[i].coport))
 			return (0);
 	}
 	return (1);
@@ -71,7 +77,7 @@ inspect_events(pollcoport_t *coports, size_t ncoports)
 	matched_events = 0;
 	for (i = 0; i < ncoports; i++) {
 		coports[i].coport = unseal_coport(coports[i].coport);
-		coports[i].revents = (coports[i].events & coports[i].coport->info->event);
+		coports[i].revents = (coports[i].events & cocarrier_events(coports[i].coport));
 		if (coports[i].revents != NOEVENT)
 			matched_events++;
 	}
@@ -92,7 +98,7 @@ populate_revents(pollcoport_t *user, pollcoport_t *ukern, uint ncoports)
  * 2. We need 1 microkernel thread per user thread to service cocalls, and have to economise somewhere
  */
 static coport_listener_t **
-init_listeners(pollcoport_t *coports, uint ncoports, pthread_cond_t *cond)
+init_listeners(pollcoport_t *coports, uint ncoports, copoll_waiter_t *waiter)
 {
 	coport_listener_t **listen_entries;
 	uint i;
@@ -100,64 +106,75 @@ init_listeners(pollcoport_t *coports, uint ncoports, pthread_cond_t *cond)
 	listen_entries = calloc(ncoports, CHERICAP_SIZE);
 	for (i = 0; i < ncoports; i++) {
 		listen_entries[i] = malloc(sizeof(coport_listener_t));
-		listen_entries[i]->wakeup = cond;
+		listen_entries[i]->wakeup = waiter;
 		listen_entries[i]->revent = NOEVENT;
 		listen_entries[i]->events = coports[i].events;
+		listen_entries[i]->set = NULL;
 		atomic_store_explicit(&listen_entries[i]->removed, false, memory_order_release);
 	}
 	return (listen_entries);
 }
 
+/* 
+ * One round of listening. Returns 0 if we were woken, or skipped the wait, but
+ * another copoller or receiver consumed the events before we looked again.
+ */
 static int 
-wait_for_events(pollcoport_t *coports, uint ncoports, long timeout)
+wait_for_events_once(pollcoport_t *coports, uint ncoports, long timeout)
 {
 	coport_t *coport;
 	coport_listener_t **listen_entries;
-	pthread_cond_t *wake;
-	pthread_condattr_t wake_attr;
-	coport_status_t status;
-	int matched;
+	coport_eventmask_t revent;
+	copoll_waiter_t waiter;
+	bool ready;
+	int matched, notifier;
 	uint i;
 
-	wake = calloc(1, sizeof(pthread_cond_t));
-	pthread_condattr_init(&wake_attr);
-	pthread_condattr_setclock(&wake_attr, CLOCK_MONOTONIC);
-	pthread_cond_init(wake, &wake_attr);
+	copoll_waiter_init(&waiter);
+	listen_entries = init_listeners(coports, ncoports, &waiter);
 
-	listen_entries = init_listeners(coports, ncoports, wake);
+	/* Have events on these coports delivered by a notifier near us */
+	notifier = get_copoll_notifier_for_cpu(sched_getcpu());
 
-	acquire_copoll_mutex();
+	ready = false;
 	for (i = 0; i < ncoports; i++) {
 		coport = unseal_coport(coports[i].coport);
-		status = COPORT_OPEN;
-		//TODO-PBB: An area where better waiting could possibly be used
-		while(!atomic_compare_exchange_weak_explicit(&coport->info->status, &status, COPORT_BUSY, memory_order_acq_rel, memory_order_relaxed))
-			status = COPORT_OPEN;
-		LIST_INSERT_HEAD(&coports[i].coport->cd->listeners, listen_entries[i], entries);
+		if (notifier >= 0)
+			atomic_store_explicit(&coport->cd->pending.notifier, notifier, memory_order_relaxed);
+		if (!lock_coport_listeners(coport)) {
+			listen_entries[i]->revent = COPOLL_CLOSED;
+			atomic_store_explicit(&listen_entries[i]->removed, true, memory_order_relaxed);
+			ready = true;
+			continue;
+		}
+		LIST_INSERT_HEAD(&coport->cd->listeners, listen_entries[i], entries);
 		coport->cd->levent |= listen_entries[i]->events;
-		atomic_store_explicit(&coport->info->status, COPORT_OPEN, memory_order_release);
+		/* The event may have happened since we inspected it */
+		if ((cocarrier_events(coport) & listen_entries[i]->events) != NOEVENT)
+			ready = true;
+		unlock_coport_listeners(coport);
 	}
 
-	copoll_wait(wake, timeout);
+	if (!ready)
+		copoll_wait(&waiter, timeout);
 
+	/* 
+	 * Listeners removed by a notifier have their revent set. Taking the coport
+	 * lock before checking ensures the notifier is done with our waiter.
+	 */
 	for (i = 0; i < ncoports; i++) {
-		if (atomic_load_explicit(&listen_entries[i]->removed, memory_order_acquire)) {
-			assert(listen_entries[i]->revent != NOEVENT); /* if this fails, we have some concurrency mistakes*/
-			continue;
-		}
 		coport = unseal_coport(coports[i].coport);
-		status = COPORT_OPEN;
-		//TODO-PBB: An area where better waiting could possibly be used
-		while(!atomic_compare_exchange_weak_explicit(&coport->info->status, &status, COPORT_BUSY, memory_order_acq_rel, memory_order_relaxed))
-			status = COPORT_OPEN;
-		LIST_REMOVE(listen_entries[i], entries);
-		atomic_store_explicit(&coport->info->status, COPORT_OPEN, memory_order_release);
-		listen_entries[i]->removed = true;
+		if (!lock_coport_listeners(coport))
+			continue; /* closed or recycled; coport_close detached us */
+		if (!atomic_load_explicit(&listen_entries[i]->removed, memory_order_acquire)) {
+			LIST_REMOVE(listen_entries[i], entries);
+			revent = (cocarrier_events(coport) & listen_entries[i]->events);
+			listen_entries[i]->revent = revent;
+			listen_entries[i]->removed = true;
+		}
+		unlock_coport_listeners(coport);
 	}
-	pthread_cond_destroy(wake);
-	free(wake);
-	pthread_condattr_destroy(&wake_attr);
-	release_copoll_mutex();
+	copoll_waiter_destroy(&waiter);
 
 	matched = 0;
 	for (i = 0; i < ncoports; i++) {
@@ -168,11 +185,58 @@ wait_for_events(pollcoport_t *coports, uint ncoports, long timeout)
 	}
 	free(listen_entries);
 
-	assert(matched != 0 || timeout > 0);
-
 	return (matched);
 }
 
+/* 
+ * Waits for timeout ms (forever if negative) until an event is found. Returns
+ * 0 only once the timeout has passed.
+ */
+static int 
+wait_for_events(pollcoport_t *coports, uint ncoports, long timeout)
+{
+	struct timespec deadline, curtime;
+	long remaining;
+	int matched;
+
+	if (timeout > 0) {
+		deadline.tv_sec = timeout / 1000;
+		deadline.tv_nsec = (timeout % 1000) * 1000000;
+		clock_gettime(CLOCK_MONOTONIC, &curtime);
+		timespecadd(&deadline, &curtime, &deadline);
+	}
+
+	remaining = timeout;
+	for (;;) {
+		matched = wait_for_events_once(coports, ncoports, remaining);
+		if (matched != 0 || timeout <= 0)
+			return (matched);
+		clock_gettime(CLOCK_MONOTONIC, &curtime);
+		if (!timespeccmp(&curtime, &deadline, <))
+			return (0);
+		timespecsub(&deadline, &curtime, &curtime);
+		/* round up so we never wake just short of the deadline */
+		remaining = (curtime.tv_sec * 1000) + ((curtime.tv_nsec + 999999) / 1000000);
+	}
+}
+
+/* 
+ * Wait for events on a single cocarrier for up to timeout ms (forever if 
+ * negative). Returns the events that were found.
+ */
+coport_eventmask_t
+cocarrier_wait(coport_t *cocarrier, coport_eventmask_t events, long timeout)
+{
+	pollcoport_t target;
+
+	target.coport = cocarrier;
+	target.events = events;
+	target.revents = NOEVENT;
+	if (inspect_events(&target, 1) == 0)
+		wait_for_events(&target, 1, timeout);
+	return (target.revents);
+}
+
 void 
 cocarrier_poll_slow(comsg_args_t *cocall_args, void *token)
 {
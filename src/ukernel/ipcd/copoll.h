@@ -37,6 +37,7 @@ int validate_copoll_args(coclose_args_t *cocall_args);
 
 void cocarrier_poll(coclose_args_t *cocall_args, void *token);
 void cocarrier_poll_slow(coclose_args_t *cocall_args, void *token);
+coport_eventmask_t cocarrier_wait(coport_t *cocarrier, coport_eventmask_t events, long timeout);
 
 
 #endif //!defined(_COPOLL_H)
@@ -29,39 +29,98 @@
  * SUCH DAMAGE.
  */
 #include "copoll_deliver.h"
+#include "cocarrier_userq.h"
+#include "coclose.h"
+#include "copoll_set.h"
 #include "copoll_utils.h"
 #include "coport_table.h"
 
 #include <comsg/coport.h>
 
 #include <assert.h>
+#include <err.h>
 #include <pthread.h>
-
+#include <pthread_np.h>
+#include <sched.h>
 #include <stdatomic.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sysexits.h>
+#include <sys/cpuset.h>
 #include <sys/queue.h>
+#include <sys/sysctl.h>
+
+size_t n_copoll_notifiers = 0;
+static copoll_notifier_t *notifiers;
+static int ncpus = 1;
 
+/*
+ * Each notifier has an intrusive multi-producer, single-consumer queue 
+ * (Vyukov) of coports with events to deliver. A coport is queued at most once:
+ * delivery looks at the coport's current event mask, so notifications that 
+ * arrive while it is queued are coalesced into the pending delivery.
+ */
+static void
+event_queue_push(copoll_notifier_t *notifier, struct _coport_event *node)
+{
+	struct _coport_event *prev;
 
-const size_t n_copoll_notifiers = 4;
-static copoll_notifier_t notifiers[n_copoll_notifiers];
+	atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+	prev = atomic_exchange_explicit(&notifier->head, node, memory_order_acq_rel);
+	atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+/* 
+ * Returns NULL if the queue is empty, or if a producer is midway through a 
+ * push, in which case its wakeup will follow.
+ */
+static struct _coport_event *
+event_queue_pop(copoll_notifier_t *notifier)
+{
+	struct _coport_event *tail, *next, *head;
+
+	tail = notifier->tail;
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	if (tail == &notifier->stub) {
+		if (next == NULL)
+			return (NULL);
+		notifier->tail = next;
+		tail = next;
+		next = atomic_load_explicit(&next->next, memory_order_acquire);
+	}
+	if (next != NULL) {
+		notifier->tail = next;
+		return (tail);
+	}
+	head = atomic_load_explicit(&notifier->head, memory_order_acquire);
+	if (tail != head)
+		return (NULL);
+	event_queue_push(notifier, &notifier->stub);
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	if (next != NULL) {
+		notifier->tail = next;
+		return (tail);
+	}
+	return (NULL);
+}
 
 static void 
 process_coport_event(coport_t *coport)
 {
 	coport_listener_t *listener, *listener_temp;
 	coport_eventmask_t coport_event, listener_mask, revents;
-	coport_status_t status;
+	coport_status_t status, prev_status;
 
 	if (!cheri_gettag(coport))
 		return;
-	else if (LIST_EMPTY(&coport->cd->listeners))
-		return; //NOTREACHED
 	
 	status = COPORT_DONE;
 	while(!atomic_compare_exchange_strong_explicit(&coport->info->status, &status, COPORT_POLLING, memory_order_acq_rel, memory_order_acquire)) {
 		switch(status) {
+		case COPORT_CLOSED:
+			return; /* recycled while the event was queued */
 		case COPORT_CLOSING:
 		case COPORT_OPEN:
 			break;
@@ -70,79 +129,255 @@ process_coport_event(coport_t *coport)
 			break;
 		}
 	}
-	if (coport->info->length == 0 && status == COPORT_CLOSING)
-		status = COPORT_CLOSED;
+	prev_status = status;
+	if (prev_status == COPORT_CLOSING)
+		status = COPORT_CLOSING;
 	else 
 		status = COPORT_OPEN;
 
-	coport_event = coport->info->event;
-	assert((coport_event & coport->cd->levent) != NOEVENT);
-
+	/* Listeners may have gone while this event was queued */
+	coport_event = cocarrier_events(coport);
 	LIST_FOREACH_SAFE(listener, &coport->cd->listeners, entries, listener_temp) {
 		listener_mask = listener->events;
 		revents = (coport_event & listener_mask);
 		if(revents == NOEVENT) 
 			continue;
+		if (listener->set != NULL) {
+			/* Persistent listeners stay put; their set gets the event */
+			copoll_set_ready(listener);
+			continue;
+		}
 		listener->revent = revents;
 		LIST_REMOVE(listener, entries); /* ensure we don't needlessly check this again */
+		copoll_wake(listener->wakeup);
 		atomic_store_explicit(&listener->removed, true, memory_order_release);
-		//TODO-PBB: replace with copoll_utils variant (?)
-		pthread_cond_signal(listener->wakeup);
 	}
-	coport->cd->levent &= ~coport_event;
-	//TODO-PBB: add provision for now-COPORT_CLOSED coports; we should free memory and wake up listeners.
+	listener_mask = NOEVENT;
+	LIST_FOREACH(listener, &coport->cd->listeners, entries)
+		listener_mask |= listener->events;
+	coport->cd->levent = listener_mask;
 	atomic_store_explicit(&coport->info->status, status, memory_order_release);
+	/* Drained closing coports are recycled once their listeners have gone */
+	if (status == COPORT_CLOSING && coport->info->length == 0)
+		reclaim_coport(coport);
+}
+
+/*
+ * Pops and delivers up to max events from victim's queue. The draining flag
+ * makes whoever holds it the queue's single consumer, whether that is the 
+ * owning notifier or a thief.
+ */
+static size_t
+drain_events(copoll_notifier_t *victim, size_t max)
+{
+	struct _coport_event *node;
+	size_t n;
+	bool draining;
+
+	draining = false;
+	if (!atomic_compare_exchange_strong_explicit(&victim->draining, &draining, true, memory_order_acquire, memory_order_relaxed))
+		return (0);
+	for (n = 0; n < max; n++) {
+		node = event_queue_pop(victim);
+		if (node == NULL)
+			break;
+		/* Clear queued first, so events raised during delivery queue it again */
+		atomic_store_explicit(&node->queued, false, memory_order_seq_cst);
+		atomic_fetch_sub_explicit(&victim->depth, 1, memory_order_relaxed);
+		process_coport_event(node->coport);
+	}
+	atomic_store_explicit(&victim->draining, false, memory_order_release);
+	return (n);
+}
+
+static size_t
+steal_events(copoll_notifier_t *thief)
+{
+	copoll_notifier_t *victim;
+	size_t i, idx, stolen;
+
+	stolen = 0;
+	idx = thief - notifiers;
+	for (i = 1; i < n_copoll_notifiers; i++) {
+		victim = &notifiers[(idx + i) % n_copoll_notifiers];
+		if (atomic_load_explicit(&victim->depth, memory_order_relaxed) < COPOLL_STEAL_THRESHOLD)
+			continue;
+		stolen += drain_events(victim, COPOLL_DRAIN_BATCH);
+	}
+	return (stolen);
 }
 
 static void *
 copoll_deliver(void *argp)
 {
 	copoll_notifier_t *notifier;
-	coport_t *coport;
-	size_t i, n_events;
-	size_t index;
+	size_t n;
 
 	notifier = argp;
-	acquire_copoll_mutex();
 	for (;;) {
-		await_copoll_events(&notifier->notifier_wakeup);
-		n_events = atomic_load_explicit(&notifier->next_event, memory_order_acquire);
-		for (i = 0; i < n_events; i++) {
-			coport = notifier->event_queue[i];
-			process_coport_event(coport);
-			notifier->event_queue[i] = NULL;
+		n = drain_events(notifier, COPOLL_DRAIN_BATCH);
+		if (n != 0) {
+			atomic_fetch_add_explicit(&notifier->ndelivered, n, memory_order_relaxed);
+			continue;
+		}
+		n = steal_events(notifier);
+		if (n != 0) {
+			atomic_fetch_add_explicit(&notifier->nstolen, n, memory_order_relaxed);
+			continue;
 		}
+		pthread_mutex_lock(&notifier->notifier_lock);
+		atomic_store_explicit(&notifier->sleeping, true, memory_order_seq_cst);
+		while (atomic_load_explicit(&notifier->depth, memory_order_seq_cst) == 0 &&
+		    !atomic_load_explicit(&notifier->kicked, memory_order_relaxed))
+			pthread_cond_wait(&notifier->notifier_wakeup, &notifier->notifier_lock);
+		atomic_store_explicit(&notifier->kicked, false, memory_order_relaxed);
+		atomic_store_explicit(&notifier->sleeping, false, memory_order_relaxed);
+		pthread_mutex_unlock(&notifier->notifier_lock);
+	}
+}
+
+/* Wake an idle notifier so it can steal from a busy one */
+static void
+kick_idle_notifier(copoll_notifier_t *busy)
+{
+	copoll_notifier_t *notifier;
+	size_t i, idx;
+
+	idx = busy - notifiers;
+	for (i = 1; i < n_copoll_notifiers; i++) {
+		notifier = &notifiers[(idx + i) % n_copoll_notifiers];
+		if (!atomic_load_explicit(&notifier->sleeping, memory_order_acquire))
+			continue;
+		pthread_mutex_lock(&notifier->notifier_lock);
+		atomic_store_explicit(&notifier->kicked, true, memory_order_relaxed);
+		pthread_cond_signal(&notifier->notifier_wakeup);
+		pthread_mutex_unlock(&notifier->notifier_lock);
+		return;
 	}
-	release_copoll_mutex();
 }
 
 void 
 put_coport_event(coport_t *coport)
 {
 	copoll_notifier_t *notifier;
-	size_t event_idx, notifier_idx;
+	struct _coport_event *node;
+	size_t depth;
+	int notifier_idx;
 
-	notifier_idx = get_coport_notifier_index(coport);
+	node = &coport->cd->pending;
+	notifier_idx = atomic_load_explicit(&node->notifier, memory_order_relaxed);
+	if (notifier_idx < 0)
+		notifier_idx = get_coport_notifier_index(coport);
 	notifier = &notifiers[notifier_idx];
-	event_idx = atomic_fetch_add_explicit(&notifier->next_event, 1, memory_order_acq_rel);
-	assert(event_idx < COPORT_EVENTQUEUE_LEN);
-	notifier->event_queue[event_idx] = coport;
-	pthread_cond_signal(&notifier->notifier_wakeup);
+
+	if (atomic_exchange_explicit(&node->queued, true, memory_order_seq_cst)) {
+		atomic_fetch_add_explicit(&notifier->ncoalesced, 1, memory_order_relaxed);
+		return;
+	}
+	/* 
+	 * Backpressure: if the notifier has fallen behind, deliver this event 
+	 * ourselves rather than growing its queue.
+	 */
+	if (atomic_load_explicit(&notifier->depth, memory_order_relaxed) >= COPOLL_NOTIFIER_BACKLOG) {
+		atomic_store_explicit(&node->queued, false, memory_order_seq_cst);
+		process_coport_event(coport);
+		atomic_fetch_add_explicit(&notifier->ninline, 1, memory_order_relaxed);
+		return;
+	}
+
+	/* depth is raised before the push so that depth == 0 implies empty */
+	depth = atomic_fetch_add_explicit(&notifier->depth, 1, memory_order_seq_cst) + 1;
+	event_queue_push(notifier, node);
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&notifier->sleeping, memory_order_seq_cst)) {
+		pthread_mutex_lock(&notifier->notifier_lock);
+		pthread_cond_signal(&notifier->notifier_wakeup);
+		pthread_mutex_unlock(&notifier->notifier_lock);
+	} else if (depth >= COPOLL_STEAL_THRESHOLD)
+		kick_idle_notifier(notifier);
+}
+
+void
+get_copoll_notifier_stats(struct copoll_notifier_stats *stats)
+{
+	copoll_notifier_t *notifier;
+
+	memset(stats, '\0', sizeof(*stats));
+	for (size_t i = 0; i < n_copoll_notifiers; i++) {
+		notifier = &notifiers[i];
+		stats->delivered += atomic_load_explicit(&notifier->ndelivered, memory_order_relaxed);
+		stats->coalesced += atomic_load_explicit(&notifier->ncoalesced, memory_order_relaxed);
+		stats->delivered_inline += atomic_load_explicit(&notifier->ninline, memory_order_relaxed);
+		stats->stolen += atomic_load_explicit(&notifier->nstolen, memory_order_relaxed);
+	}
 }
 
+void
+set_copoll_notifier_count(size_t count)
+{
+	n_copoll_notifiers = count;
+}
+
+/* Notifiers cover contiguous ranges of cpus, so nearby cpus share one */
+int
+get_copoll_notifier_for_cpu(int cpu)
+{
+	if (cpu < 0 || cpu >= ncpus)
+		return (-1);
+	return ((int)(((size_t)cpu * n_copoll_notifiers) / ncpus));
+}
+
+static int
+get_ncpus(void)
+{
+	int mib[2] = { CTL_HW, HW_NCPU };
+	int n;
+	size_t len;
+
+	len = sizeof(n);
+	if (sysctl(mib, 2, &n, &len, NULL, 0) != 0 || n < 1) {
+		warn("%s: could not get hw.ncpu, defaulting to 1", __func__);
+		return (1);
+	}
+	return (n);
+}
 
 void
 setup_copoll_notifiers(void)
 {
 	size_t i;
+	int cpu;
+	cpuset_t cpus;
+	pthread_attr_t notifier_attrs;
 	pthread_condattr_t notifier_cond_attrs;
 	copoll_notifier_t *notifier_args;
 	
-	memset(notifiers, '\0', cheri_getlen(notifiers));
+	ncpus = get_ncpus();
+	if (n_copoll_notifiers == 0)
+		n_copoll_notifiers = ncpus;
+	notifiers = aligned_alloc(CACHE_LINE_SIZE, n_copoll_notifiers * sizeof(copoll_notifier_t));
+	if (notifiers == NULL)
+		err(EX_OSERR, "%s: could not allocate %zu notifiers", __func__, n_copoll_notifiers);
+	memset(notifiers, '\0', n_copoll_notifiers * sizeof(copoll_notifier_t));
+
 	pthread_condattr_init(&notifier_cond_attrs);
 	for (i = 0; i < n_copoll_notifiers; i++) {
 		notifier_args = cheri_setboundsexact(&notifiers[i], sizeof(copoll_notifier_t));
+		pthread_mutex_init(&notifier_args->notifier_lock, NULL);
 		pthread_cond_init(&notifier_args->notifier_wakeup, &notifier_cond_attrs);
-		pthread_create(&notifiers[i].notifier_thread, NULL, copoll_deliver, notifier_args);
+		notifier_args->stub.next = NULL;
+		notifier_args->head = &notifier_args->stub;
+		notifier_args->tail = &notifier_args->stub;
+
+		/* Pin to the first cpu of the range this notifier serves */
+		cpu = (int)((i * ncpus) / n_copoll_notifiers);
+		notifier_args->cpu = cpu;
+		pthread_attr_init(&notifier_attrs);
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		if (n_copoll_notifiers <= (size_t)ncpus)
+			pthread_attr_setaffinity_np(&notifier_attrs, sizeof(cpus), &cpus);
+		pthread_create(&notifiers[i].notifier_thread, &notifier_attrs, copoll_deliver, notifier_args);
+		pthread_attr_destroy(&notifier_attrs);
 	}
 }
@@ -34,23 +34,49 @@
 
 #include <pthread.h>
 #include <stdatomic.h>
+#include <stdbool.h>
 #include <stddef.h>
 
 #include <comsg/coport.h>
 
-extern const size_t n_copoll_notifiers;
+extern size_t n_copoll_notifiers;
 
-#define COPORT_EVENTQUEUE_LEN (32)
+/* Queued events per notifier before senders start delivering events inline */
+#define COPOLL_NOTIFIER_BACKLOG (256)
+/* Queued events before idle notifiers start stealing from a busy one */
+#define COPOLL_STEAL_THRESHOLD (32)
+/* Events delivered before a notifier lets others at its queue */
+#define COPOLL_DRAIN_BATCH (16)
 
 typedef struct {
 	pthread_t notifier_thread;
+	int cpu;
+	_Alignas(CACHE_LINE_SIZE) struct _coport_event *_Atomic head; /* producers */
+	_Atomic size_t depth;
+	_Alignas(CACHE_LINE_SIZE) struct _coport_event *tail; /* consumer only */
+	struct _coport_event stub;
+	_Atomic bool draining; /* held by whoever is consuming the queue */
+	_Atomic bool sleeping;
+	_Atomic bool kicked;
+	pthread_mutex_t notifier_lock; /* only used to sleep and wake */
 	pthread_cond_t notifier_wakeup;
-	coport_t *event_queue[COPORT_EVENTQUEUE_LEN];
-	_Atomic size_t next_event;
+	_Atomic size_t ndelivered;
+	_Atomic size_t ncoalesced;
+	_Atomic size_t ninline;
+	_Atomic size_t nstolen;
 } copoll_notifier_t;
 
+struct copoll_notifier_stats {
+	size_t delivered; /* by notifier threads */
+	size_t coalesced; /* notifications merged into an already queued one */
+	size_t delivered_inline; /* by senders, due to backpressure */
+	size_t stolen; /* by notifiers from others' queues */
+};
 
 void put_coport_event(coport_t *coport);
+void set_copoll_notifier_count(size_t count);
+int get_copoll_notifier_for_cpu(int cpu);
 void setup_copoll_notifiers(void);
+void get_copoll_notifier_stats(struct copoll_notifier_stats *stats);
 
 #endif //!defined(_COPOLL_DELIVER_H)
\ No newline at end of file
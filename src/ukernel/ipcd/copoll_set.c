@@ -0,0 +1,450 @@
+/*
+ * Copyright (c) 2020 Peter S. Blandford-Baker
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology) under DARPA contract HR0011-18-C-0016 ("ECATS"), as part of the
+ * DARPA SSITH research programme.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include "copoll_set.h"
+#include "cocarrier_userq.h"
+
+#include "ipcd_cap.h"
+#include "copoll_utils.h"
+#include "coport_table.h"
+
+#include <comsg/comsg_args.h>
+#include <comsg/coport.h>
+#include <comsg/utils.h>
+
+#include <cheri/cheric.h>
+#include <malloc_np.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <sys/errno.h>
+#include <sys/queue.h>
+#include <sys/time.h>
+#include <time.h>
+
+extern void begin_cocall(void);
+extern void end_cocall(void);
+
+int 
+validate_copoll_create_args(copoll_set_args_t *cocall_args)
+{
+	UNUSED(cocall_args);
+	return (1);
+}
+
+int 
+validate_copoll_ctl_args(copoll_set_args_t *cocall_args)
+{
+	if (!valid_copoll_set(cocall_args->copoll_set))
+		return (0);
+	switch (cocall_args->copoll_op) {
+	case COPOLL_CTL_ADD:
+	case COPOLL_CTL_MOD:
+		if (!valid_cocarrier(cocall_args->copoll_port) && !valid_cobroadcast(cocall_args->copoll_port))
+			return (0);
+		return (cocall_args->copoll_events != NOEVENT);
+	case COPOLL_CTL_DEL:
+		/* the coport may have closed, and its slot been recycled, since */
+		return (cheri_gettag(cocall_args->copoll_port));
+	default:
+		return (0);
+	}
+}
+
+int 
+validate_copoll_wait_args(copoll_set_args_t *cocall_args)
+{
+	if (!valid_copoll_set(cocall_args->copoll_set))
+		return (0);
+	else if (cocall_args->nready == 0)
+		return (0);
+	else if (!cheri_gettag(cocall_args->ready))
+		return (0);
+	else if ((cheri_getperm(cocall_args->ready) & CHERI_PERM_STORE) == 0)
+		return (0);
+	else if (cheri_getlen(cocall_args->ready) < cocall_args->nready * sizeof(pollcoport_t))
+		return (0);
+	return (1);
+}
+
+int 
+validate_copoll_destroy_args(copoll_set_args_t *cocall_args)
+{
+	return (valid_copoll_set(cocall_args->copoll_set));
+}
+
+/*
+ * Ops count themselves in set->users while they run. A destroyed set is freed
+ * by whoever drops the last user, and only if the allocator revokes 
+ * capabilities to freed memory; otherwise it stays allocated, so that stale 
+ * handles to it keep failing with EBADF.
+ */
+static bool
+enter_copoll_set(struct _copoll_set *set)
+{
+	uint users;
+
+	users = atomic_load_explicit(&set->users, memory_order_relaxed);
+	do {
+		if (users == 0)
+			return (false);
+	} while (!atomic_compare_exchange_weak_explicit(&set->users, &users, users + 1, memory_order_acquire, memory_order_relaxed));
+	return (true);
+}
+
+static void
+leave_copoll_set(struct _copoll_set *set)
+{
+	if (atomic_fetch_sub_explicit(&set->users, 1, memory_order_acq_rel) != 1)
+		return;
+	else if (!malloc_is_revoking())
+		return;
+	pthread_cond_destroy(&set->ready_wakeup);
+	pthread_mutex_destroy(&set->ready_lock);
+	pthread_mutex_destroy(&set->ctl_lock);
+	free(set);
+}
+
+void 
+copoll_set_create(copoll_set_args_t *cocall_args, void *token)
+{
+	UNUSED(token);
+	struct _copoll_set *set;
+	pthread_condattr_t cond_attr;
+
+	set = malloc(sizeof(struct _copoll_set));
+	if (set == NULL)
+		COCALL_ERR(cocall_args, ENOMEM);
+
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_mutex_init(&set->ctl_lock, NULL);
+	pthread_mutex_init(&set->ready_lock, NULL);
+	pthread_cond_init(&set->ready_wakeup, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+	LIST_INIT(&set->interest);
+	TAILQ_INIT(&set->ready);
+	atomic_store_explicit(&set->users, 1, memory_order_relaxed);
+	atomic_store_explicit(&set->destroyed, false, memory_order_relaxed);
+
+	cocall_args->copoll_set = seal_copoll_set(set);
+	COCALL_RETURN(cocall_args, 0);
+}
+
+/* Called by notifiers (with the coport locked) and by copoll_ctl */
+void
+copoll_set_ready(coport_listener_t *listener)
+{
+	struct _copoll_set *set;
+
+	set = listener->set;
+	pthread_mutex_lock(&set->ready_lock);
+	if (!listener->ready) {
+		listener->ready = true;
+		TAILQ_INSERT_TAIL(&set->ready, listener, ready_entries);
+	}
+	pthread_cond_signal(&set->ready_wakeup);
+	pthread_mutex_unlock(&set->ready_lock);
+}
+
+static coport_listener_t *
+find_set_listener(struct _copoll_set *set, coport_t *coport)
+{
+	coport_listener_t *listener;
+
+	LIST_FOREACH(listener, &set->interest, set_entries) {
+		if (cheri_getaddress(listener->handle) == cheri_getaddress(coport))
+			return (listener);
+	}
+	return (NULL);
+}
+
+/* 
+ * Called with the set's ctl_lock held. listener->coport is the coport's table
+ * slot, which is never freed; if coport_close has detached the listener, the 
+ * slot may hold another coport by now, so we only unlink it if it is listed.
+ */
+static void
+remove_set_listener(struct _copoll_set *set, coport_listener_t *listener)
+{
+	coport_t *coport;
+
+	coport = listener->coport;
+	if (lock_coport_listeners(coport)) {
+		if (!atomic_load_explicit(&listener->removed, memory_order_acquire))
+			LIST_REMOVE(listener, entries);
+		unlock_coport_listeners(coport);
+	}
+	LIST_REMOVE(listener, set_entries);
+
+	pthread_mutex_lock(&set->ready_lock);
+	if (listener->ready)
+		TAILQ_REMOVE(&set->ready, listener, ready_entries);
+	pthread_mutex_unlock(&set->ready_lock);
+	free(listener);
+}
+
+void 
+copoll_set_ctl(copoll_set_args_t *cocall_args, void *token)
+{
+	UNUSED(token);
+	struct _copoll_set *set;
+	coport_listener_t *listener;
+	coport_t *coport;
+	copoll_ctl_op_t op;
+	int error;
+
+	begin_cocall();
+	set = unseal_copoll_set(cocall_args->copoll_set);
+	if (!enter_copoll_set(set)) {
+		end_cocall();
+		COCALL_ERR(cocall_args, EBADF);
+	}
+	coport = NULL;
+	if (cocall_args->copoll_op != COPOLL_CTL_DEL)
+		coport = unseal_coport(cocall_args->copoll_port);
+	error = 0;
+
+	pthread_mutex_lock(&set->ctl_lock);
+	listener = find_set_listener(set, cocall_args->copoll_port);
+	op = cocall_args->copoll_op;
+	if (atomic_load_explicit(&set->destroyed, memory_order_relaxed))
+		op = 0; /* destroyed while we waited for ctl_lock */
+	switch (op) {
+	case COPOLL_CTL_ADD:
+		if (listener != NULL) {
+			error = EEXIST;
+			break;
+		}
+		listener = malloc(sizeof(coport_listener_t));
+		if (listener == NULL) {
+			error = ENOMEM;
+			break;
+		}
+		listener->wakeup = NULL;
+		listener->revent = NOEVENT;
+		listener->events = cocall_args->copoll_events;
+		listener->set = set;
+		listener->coport = get_coport_slot(coport);
+		listener->handle = cocall_args->copoll_port;
+		listener->ready = false;
+		atomic_store_explicit(&listener->removed, false, memory_order_relaxed);
+		if (!lock_coport_listeners(coport)) {
+			free(listener);
+			listener = NULL;
+			error = EPIPE;
+			break;
+		}
+		LIST_INSERT_HEAD(&set->interest, listener, set_entries);
+		LIST_INSERT_HEAD(&coport->cd->listeners, listener, entries);
+		coport->cd->levent |= listener->events;
+		unlock_coport_listeners(coport);
+		break;
+	case COPOLL_CTL_MOD:
+		if (listener == NULL) {
+			error = ENOENT;
+			break;
+		}
+		if (!lock_coport_listeners(coport)) {
+			error = EPIPE;
+			break;
+		}
+		listener->events = cocall_args->copoll_events;
+		coport->cd->levent |= listener->events;
+		unlock_coport_listeners(coport);
+		break;
+	case COPOLL_CTL_DEL:
+		if (listener == NULL) {
+			error = ENOENT;
+			break;
+		}
+		remove_set_listener(set, listener);
+		listener = NULL;
+		break;
+	default:
+		error = EBADF;
+		break;
+	}
+	/* Events that happened before the listener was added are not lost */
+	if (listener != NULL && error == 0 && 
+	    (cocarrier_events(coport) & listener->events) != NOEVENT)
+		copoll_set_ready(listener);
+	pthread_mutex_unlock(&set->ctl_lock);
+	leave_copoll_set(set);
+	end_cocall();
+
+	if (error != 0)
+		COCALL_ERR(cocall_args, error);
+	COCALL_RETURN(cocall_args, 0);
+}
+
+/*
+ * Copies out up to nready coports from the ready list. Coports whose events 
+ * have been consumed since they were queued are dropped. Those still ready go
+ * back on the tail of the list, as with level-triggered epoll, so the next
+ * wait rechecks them and listeners further down the list get their turn.
+ */
+static int
+harvest_ready(struct _copoll_set *set, pollcoport_t *ready, uint nready)
+{
+	TAILQ_HEAD(, _coport_listener) still_ready;
+	coport_listener_t *listener;
+	coport_eventmask_t revents;
+	uint n;
+
+	TAILQ_INIT(&still_ready);
+	n = 0;
+	pthread_mutex_lock(&set->ready_lock);
+	while (n < nready && (listener = TAILQ_FIRST(&set->ready)) != NULL) {
+		TAILQ_REMOVE(&set->ready, listener, ready_entries);
+		if (atomic_load_explicit(&listener->removed, memory_order_acquire))
+			revents = COPOLL_CLOSED;
+		else
+			revents = (cocarrier_events(listener->coport) & listener->events);
+		if (revents == NOEVENT) {
+			listener->ready = false;
+			continue;
+		}
+		ready[n].coport = listener->handle;
+		ready[n].events = listener->events;
+		ready[n].revents = revents;
+		n++;
+		TAILQ_INSERT_TAIL(&still_ready, listener, ready_entries);
+	}
+	TAILQ_CONCAT(&set->ready, &still_ready, ready_entries);
+	pthread_mutex_unlock(&set->ready_lock);
+
+	return (n);
+}
+
+void 
+copoll_set_wait(copoll_set_args_t *cocall_args, void *token)
+{
+	UNUSED(token);
+	struct _copoll_set *set;
+	int matched;
+
+	begin_cocall();
+	set = unseal_copoll_set(cocall_args->copoll_set);
+	if (!enter_copoll_set(set)) {
+		end_cocall();
+		COCALL_ERR(cocall_args, EBADF);
+	}
+	matched = harvest_ready(set, cocall_args->ready, cocall_args->nready);
+	leave_copoll_set(set);
+	end_cocall();
+	if (matched == 0 && cocall_args->copoll_timeout != 0)
+		COCALL_ERR(cocall_args, EWOULDBLOCK);
+
+	COCALL_RETURN(cocall_args, matched);
+}
+
+void 
+copoll_set_wait_slow(copoll_set_args_t *cocall_args, void *token)
+{
+	UNUSED(token);
+	struct _copoll_set *set;
+	struct timespec wait_time, curtime;
+	long timeout;
+	int matched, error;
+
+	set = unseal_copoll_set(cocall_args->copoll_set);
+	if (!enter_copoll_set(set))
+		COCALL_ERR(cocall_args, EBADF);
+	timeout = cocall_args->copoll_timeout;
+	if (timeout > 0) {
+		wait_time.tv_sec = timeout / 1000;
+		wait_time.tv_nsec = (timeout % 1000) * 1000000;
+		clock_gettime(CLOCK_MONOTONIC, &curtime);
+		timespecadd(&wait_time, &curtime, &wait_time);
+	}
+
+	error = 0;
+	for (;;) {
+		matched = harvest_ready(set, cocall_args->ready, cocall_args->nready);
+		if (matched != 0 || timeout == 0 || error == ETIMEDOUT)
+			break;
+		pthread_mutex_lock(&set->ready_lock);
+		while (TAILQ_EMPTY(&set->ready) && error != ETIMEDOUT && !atomic_load(&set->destroyed)) {
+			if (timeout > 0)
+				error = pthread_cond_timedwait(&set->ready_wakeup, &set->ready_lock, &wait_time);
+			else
+				pthread_cond_wait(&set->ready_wakeup, &set->ready_lock);
+		}
+		pthread_mutex_unlock(&set->ready_lock);
+		if (atomic_load(&set->destroyed)) {
+			leave_copoll_set(set);
+			COCALL_ERR(cocall_args, EBADF);
+		}
+	}
+	leave_copoll_set(set);
+
+	COCALL_RETURN(cocall_args, matched);
+}
+
+/* 
+ * Takes the set's listeners off their coports and frees them. Waiters on the 
+ * set fail with EBADF.
+ */
+void 
+copoll_set_destroy(copoll_set_args_t *cocall_args, void *token)
+{
+	UNUSED(token);
+	struct _copoll_set *set;
+	coport_listener_t *listener;
+
+	begin_cocall();
+	set = unseal_copoll_set(cocall_args->copoll_set);
+	if (!enter_copoll_set(set)) {
+		end_cocall();
+		COCALL_ERR(cocall_args, EBADF);
+	}
+	pthread_mutex_lock(&set->ctl_lock);
+	if (atomic_load_explicit(&set->destroyed, memory_order_relaxed)) {
+		pthread_mutex_unlock(&set->ctl_lock);
+		leave_copoll_set(set);
+		end_cocall();
+		COCALL_ERR(cocall_args, EBADF);
+	}
+	while ((listener = LIST_FIRST(&set->interest)) != NULL)
+		remove_set_listener(set, listener);
+	pthread_mutex_lock(&set->ready_lock);
+	atomic_store_explicit(&set->destroyed, true, memory_order_release);
+	pthread_cond_broadcast(&set->ready_wakeup);
+	pthread_mutex_unlock(&set->ready_lock);
+	pthread_mutex_unlock(&set->ctl_lock);
+
+	leave_copoll_set(set);
+	leave_copoll_set(set); /* the reference the set held until now */
+	end_cocall();
+	COCALL_RETURN(cocall_args, 0);
+}
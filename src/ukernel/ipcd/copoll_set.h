@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2020 Peter S. Blandford-Baker
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology) under DARPA contract HR0011-18-C-0016 ("ECATS"), as part of the
+ * DARPA SSITH research programme.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef _COPOLL_SET_H
+#define _COPOLL_SET_H
+
+#include <comsg/comsg_args.h>
+#include <comsg/coport.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/queue.h>
+
+/*
+ * A persistent copoll interest set. Its listeners stay linked to their
+ * coports between waits, and notifiers push them onto the ready list, so a
+ * wait only looks at coports that have had events. coport_close detaches the
+ * listeners of a closing coport, which then report COPOLL_CLOSED until they 
+ * are deleted.
+ */
+struct _copoll_set {
+	pthread_mutex_t ctl_lock; /* serialises changes to the interest list */
+	LIST_HEAD(, _coport_listener) interest;
+	pthread_mutex_t ready_lock;
+	pthread_cond_t ready_wakeup;
+	TAILQ_HEAD(, _coport_listener) ready;
+	_Atomic uint users; /* ops in progress, plus one until destroyed */
+	_Atomic bool destroyed;
+};
+
+int validate_copoll_create_args(copoll_set_args_t *cocall_args);
+int validate_copoll_ctl_args(copoll_set_args_t *cocall_args);
+int validate_copoll_wait_args(copoll_set_args_t *cocall_args);
+int validate_copoll_destroy_args(copoll_set_args_t *cocall_args);
+
+void copoll_set_create(copoll_set_args_t *cocall_args, void *token);
+void copoll_set_ctl(copoll_set_args_t *cocall_args, void *token);
+void copoll_set_wait(copoll_set_args_t *cocall_args, void *token);
+void copoll_set_wait_slow(copoll_set_args_t *cocall_args, void *token);
+void copoll_set_destroy(copoll_set_args_t *cocall_args, void *token);
+
+void copoll_set_ready(coport_listener_t *listener);
+
+#endif //!defined(_COPOLL_SET_H)
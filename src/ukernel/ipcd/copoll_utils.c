@@ -30,6 +30,7 @@
  */
 #include "copoll_utils.h"
 #include "copoll_deliver.h"
+#include "copoll_set.h"
 #include <comsg/coport.h>
 
 #include <err.h>
@@ -41,74 +42,128 @@
 #include <sys/time.h>
 #include <unistd.h>
 
-static pthread_mutex_t global_copoll_lock;
-static pthread_cond_t global_cosend_cond;
-
-static pthread_cond_t *coport_event_conds;
-
-
-
-__attribute__((constructor)) static void 
-init_copoll_lock(void)
+void
+copoll_waiter_init(copoll_waiter_t *waiter)
 {
-	pthread_mutexattr_t global_mtx_attr;
-	pthread_condattr_t global_cond_attr;
-	
-	pthread_mutexattr_init(&global_mtx_attr);
-	pthread_condattr_init(&global_cond_attr);
-
-	pthread_mutexattr_settype(&global_mtx_attr, PTHREAD_MUTEX_ERRORCHECK);
+	pthread_condattr_t cond_attr;
+
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_mutex_init(&waiter->lock, NULL);
+	pthread_cond_init(&waiter->wakeup, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+	waiter->woken = false;
+}
 
-	pthread_mutex_init(&global_copoll_lock, &global_mtx_attr);
-	pthread_cond_init(&global_cosend_cond, &global_cond_attr);
+void
+copoll_waiter_destroy(copoll_waiter_t *waiter)
+{
+	pthread_cond_destroy(&waiter->wakeup);
+	pthread_mutex_destroy(&waiter->lock);
 }
 
 /*
- * TODO-PBB: have a single thread wait on the global condition
- * that wakes up the approriate thread rather than waking them all up.
+ * Sleep until copoll_wake is called on waiter, or until timeout milliseconds
+ * have passed if timeout is positive. A wakeup that arrives before we start
+ * waiting is not lost. Returns true if we were woken.
  */
-	
-void 
-acquire_copoll_mutex(void)
+bool
+copoll_wait(copoll_waiter_t *waiter, long timeout)
 {
-	pthread_mutex_lock(&global_copoll_lock);
+	struct timespec wait_time, curtime;
+	bool woken;
+	int error;
+
+	if (timeout > 0) {
+		wait_time.tv_sec = timeout / 1000;
+		wait_time.tv_nsec = (timeout % 1000) * 1000000;
+		clock_gettime(CLOCK_MONOTONIC, &curtime);
+		timespecadd(&wait_time, &curtime, &wait_time);
+	}
+
+	pthread_mutex_lock(&waiter->lock);
+	error = 0;
+	while (!waiter->woken && error != ETIMEDOUT) {
+		if (timeout > 0)
+			error = pthread_cond_timedwait(&waiter->wakeup, &waiter->lock, &wait_time);
+		else
+			pthread_cond_wait(&waiter->wakeup, &waiter->lock);
+	}
+	woken = waiter->woken;
+	pthread_mutex_unlock(&waiter->lock);
+
+	return (woken);
 }
 
-void 
-release_copoll_mutex(void)
+void
+copoll_wake(copoll_waiter_t *waiter)
 {
-	pthread_mutex_unlock(&global_copoll_lock);
+	pthread_mutex_lock(&waiter->lock);
+	waiter->woken = true;
+	pthread_cond_signal(&waiter->wakeup);
+	pthread_mutex_unlock(&waiter->lock);
 }
 
-void 
-copoll_wait(pthread_cond_t *wait_cond, long timeout)
+/* 
+ * The coport status doubles as the lock for its listener list. Fails if the
+ * coport is closing or closed, or if its slot was recycled while we waited for
+ * it. coport_close detaches every listener before the coport leaves 
+ * COPORT_OPEN, so a caller that fails has nothing left in the list.
+ */
+bool
+lock_coport_listeners(coport_t *coport)
 {
-	struct timespec wait_time, curtime;
-	int locked;
+	coport_status_t status;
 
-	locked = pthread_mutex_lock(&global_copoll_lock);
-	if (locked != EDEADLK) { /* we might already hold the lock, which is fine */ 
-		errno = locked;
-		err(EX_SOFTWARE, "copoll_wait: lock acquisition failed");
+	status = COPORT_OPEN;
+	//TODO-PBB: An area where better waiting could possibly be used
+	while(!atomic_compare_exchange_weak_explicit(&coport->info->status, &status, COPORT_BUSY, memory_order_acq_rel, memory_order_acquire)) {
+		switch (status) {
+		case COPORT_CLOSING:
+		case COPORT_CLOSED:
+			return (false);
+		default:
+			status = COPORT_OPEN;
+			break;
+		}
 	}
-	if (timeout > 0) {
-		wait_time.tv_sec = timeout / 1000;
-		wait_time.tv_nsec = (timeout % 1000) * 1000000;
-		clock_gettime(CLOCK_MONOTONIC, &curtime);
-		timespecadd(&wait_time, &curtime, &wait_time);
-		pthread_cond_timedwait(wait_cond, &global_copoll_lock, &wait_time);
+	if (!coport_handle_current(coport)) {
+		atomic_store_explicit(&coport->info->status, COPORT_OPEN, memory_order_release);
+		return (false);
 	}
-	else 
-		pthread_cond_wait(wait_cond, &global_copoll_lock);
-	/* If we locked from within this function, */
-	if (locked == 0)
-		pthread_mutex_unlock(&global_copoll_lock);
+	return (true);
 }
 
-void 
-await_copoll_events(pthread_cond_t *wait_cond)
+void
+unlock_coport_listeners(coport_t *coport)
+{
+	atomic_store_explicit(&coport->info->status, COPORT_OPEN, memory_order_release);
+}
+
+/* 
+ * Called by coport_close with the coport locked. A closed coport raises no 
+ * more events, so its listeners are woken with COPOLL_CLOSED, whatever they 
+ * listen for, and taken off the list. Listeners in copoll sets stay in their
+ * set, reporting COPOLL_CLOSED, until they are deleted; either way nothing 
+ * stops the coport from being reclaimed.
+ */
+void
+detach_coport_listeners(coport_t *cocarrier)
 {
-	pthread_cond_wait(wait_cond, &global_copoll_lock);
+	coport_listener_t *listener, *listener_temp;
+
+	LIST_FOREACH_SAFE(listener, &cocarrier->cd->listeners, entries, listener_temp) {
+		LIST_REMOVE(listener, entries);
+		if (listener->set != NULL) {
+			atomic_store_explicit(&listener->removed, true, memory_order_release);
+			copoll_set_ready(listener);
+			continue;
+		}
+		listener->revent = COPOLL_CLOSED;
+		copoll_wake(listener->wakeup);
+		atomic_store_explicit(&listener->removed, true, memory_order_release);
+	}
+	cocarrier->cd->levent = NOEVENT;
 }
 
 void 
@@ -117,9 +172,7 @@ copoll_notify(coport_t *cocarrier, coport_eventmask_t event)
 
 	coport_status_t status;
 	if(!LIST_EMPTY(&cocarrier->cd->listeners) && ((cocarrier->cd->levent & event) != NOEVENT)) {
-		acquire_copoll_mutex();
         put_coport_event(cocarrier);
-    	release_copoll_mutex(); 
     } else {
     	/* 
     	 * If there are no listeners for this coport, or for this event,
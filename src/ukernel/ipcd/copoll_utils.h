@@ -34,12 +34,27 @@
 #include <comsg/coport.h>
 
 #include <pthread.h>
+#include <stdbool.h>
 
-void acquire_copoll_mutex(void);
-void release_copoll_mutex(void);
-void await_copoll_events(pthread_cond_t *wait_cond);
+/* 
+ * Each copoll caller sleeps on its own waiter, so waking one caller does not
+ * involve any lock shared with unrelated coports.
+ */
+typedef struct copoll_waiter {
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	bool woken;
+} copoll_waiter_t;
+
+void copoll_waiter_init(copoll_waiter_t *waiter);
+void copoll_waiter_destroy(copoll_waiter_t *waiter);
+bool copoll_wait(copoll_waiter_t *waiter, long timeout);
+void copoll_wake(copoll_waiter_t *waiter);
+
+bool lock_coport_listeners(coport_t *coport);
+void unlock_coport_listeners(coport_t *coport);
+void detach_coport_listeners(coport_t *cocarrier);
 
-void copoll_wait(pthread_cond_t *wait_cond, long timeout);
 void copoll_notify(coport_t *cocarrier, coport_eventmask_t event);
 
 #endif
\ No newline at end of file
@@ -30,54 +30,96 @@
  */
 #include "coport_table.h"
 #include "copoll_deliver.h"
+#include "ipcd.h"
 #include <comsg/coport.h>
 
 #include <assert.h>
 #include <cheri/cheric.h>
 #include <err.h>
+#include <malloc_np.h>
 #include <stdatomic.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/errno.h>
 #include <sys/mman.h>
+#include <sys/param.h>
 #include <sys/queue.h>
+#include <sysexits.h>
 #include <unistd.h>
 
+/* 
+ * Entries of closed coports are recycled through a lock-free stack per table.
+ * The head packs a tag, bumped on every change to defeat ABA, with index + 1.
+ */
 typedef struct {
 	coport_t port;
-	_Atomic size_t ref_count;
+	_Atomic uint32_t next_free; /* index + 1 of the next free entry; 0 ends the stack */
+	void *block; /* see get_coport_block; kept when the entry is recycled */
+	size_t block_len;
+	size_t block_align;
+	struct cocarrier_message *msgs; /* see get_coport_msgs; never freed */
+	size_t nmsgs;
+	char *inline_slots; /* see get_coport_inline; never freed */
+	size_t inline_len;
+	coport_t *handle; /* see coport_handle; NULL while the entry is free */
 } coport_tbl_entry_t;
 
+#define FREE_INDEX_MASK (0xffffffffUL)
+#define FREE_TAG_SHIFT (32)
+
 static struct _coport_table {
 	_Atomic size_t next_coport;
 	_Atomic size_t ncoports;
+	_Atomic uint64_t free_head;
 	size_t first_coport;
 	coport_tbl_entry_t *coports;
-} cocarrier_table, copipe_table, cochannel_table;
+} cocarrier_table, copipe_table, cochannel_table, cobroadcast_table;
 
-/* TODO-PBB: convert to sysctl or similar configurable value */
-static const size_t max_coports = 256;
-static size_t coport_table_len = max_coports * sizeof(coport_tbl_entry_t);
+static size_t max_coports = COPORT_TABLE_DEFAULT_LEN;
+static bool free_handles;
 
-__attribute__((constructor)) static void 
-setup_table(void) 
+void
+set_coport_table_len(size_t len)
 {
-	madvise(NULL, -1, MADV_PROTECT);
+	max_coports = MIN(len, FREE_INDEX_MASK);
+}
 
-	cocarrier_table.coports = calloc(max_coports, sizeof(coport_tbl_entry_t));
-	cocarrier_table.next_coport = 0;
-	cocarrier_table.first_coport = 0;
-	cocarrier_table.ncoports = 0;
+size_t
+get_coport_table_len(void)
+{
+	return (max_coports);
+}
 
-	copipe_table.coports = calloc(max_coports, sizeof(coport_tbl_entry_t));
-	copipe_table.next_coport = 0;
-	copipe_table.first_coport = 0;
-	copipe_table.ncoports = 0;
+/* 
+ * Tables are reserved up front but only touched as coports are allocated, so
+ * they grow a page at a time.
+ */
+static void
+setup_table(struct _coport_table *table)
+{
+	size_t len;
 
-	cochannel_table.coports = calloc(max_coports, sizeof(coport_tbl_entry_t));
-	cochannel_table.next_coport = 0;
-	cochannel_table.first_coport = 0;
-	cochannel_table.ncoports = 0;
+	len = max_coports * sizeof(coport_tbl_entry_t);
+	table->coports = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+	if (table->coports == MAP_FAILED)
+		err(EX_OSERR, "%s: mmap of %lu bytes failed", __func__, len);
+	table->next_coport = 0;
+	table->first_coport = 0;
+	table->ncoports = 0;
+	table->free_head = 0;
+}
+
+void 
+setup_coport_tables(void) 
+{
+	madvise(NULL, -1, MADV_PROTECT);
+	free_handles = malloc_is_revoking();
+
+	setup_table(&cocarrier_table);
+	setup_table(&copipe_table);
+	setup_table(&cochannel_table);
+	setup_table(&cobroadcast_table);
 }
 
 static struct _coport_table *
@@ -95,6 +137,9 @@ get_coport_table(coport_type_t type)
 		case COCHANNEL:
 			table = &cochannel_table;
 			break;
+		case COBROADCAST:
+			table = &cobroadcast_table;
+			break;
 		default:
 			table = NULL;
 			break;
@@ -102,6 +147,39 @@ get_coport_table(coport_type_t type)
 	return (table);
 }
 
+static bool
+pop_free_coport(struct _coport_table *coport_table, size_t *index)
+{
+	uint64_t head, new_head;
+	uint32_t next;
+
+	head = atomic_load_explicit(&coport_table->free_head, memory_order_acquire);
+	do {
+		if ((head & FREE_INDEX_MASK) == 0)
+			return (false);
+		*index = (head & FREE_INDEX_MASK) - 1;
+		next = atomic_load_explicit(&coport_table->coports[*index].next_free, memory_order_relaxed);
+		new_head = (((head >> FREE_TAG_SHIFT) + 1) << FREE_TAG_SHIFT) | next;
+	} while (!atomic_compare_exchange_weak_explicit(&coport_table->free_head, &head, new_head, memory_order_acq_rel, memory_order_acquire));
+	return (true);
+}
+
+static void
+push_free_coport(struct _coport_table *coport_table, size_t index)
+{
+	uint64_t head, new_head;
+
+	head = atomic_load_explicit(&coport_table->free_head, memory_order_relaxed);
+	do {
+		atomic_store_explicit(&coport_table->coports[index].next_free, head & FREE_INDEX_MASK, memory_order_relaxed);
+		new_head = (((head >> FREE_TAG_SHIFT) + 1) << FREE_TAG_SHIFT) | (index + 1);
+	} while (!atomic_compare_exchange_weak_explicit(&coport_table->free_head, &head, new_head, memory_order_acq_rel, memory_order_relaxed));
+}
+
+/* 
+ * Recycled entries keep their info and cd, which init_coport reuses in place,
+ * so that late readers of a closed coport never touch freed memory.
+ */
 coport_t *
 allocate_coport(coport_type_t type)
 {
@@ -110,30 +188,192 @@ allocate_coport(coport_type_t type)
 	size_t index;
 
 	coport_table = get_coport_table(type);
-	index = atomic_fetch_add(&coport_table->next_coport, 1);
+	if (!pop_free_coport(coport_table, &index)) {
+		index = atomic_fetch_add(&coport_table->next_coport, 1);
+		if (index >= max_coports) {
+			atomic_fetch_sub(&coport_table->next_coport, 1);
+			return (NULL);
+		}
+	}
 
 	ptr = &coport_table->coports[index].port;
 	ptr = cheri_setboundsexact(ptr, sizeof(coport_t));
-	memset(ptr, 0, sizeof(coport_t));
+	ptr->type = type;
+	ptr->flags = 0;
+	ptr->buffer = NULL;
+	ptr->slot = index;
 
 	atomic_fetch_add(&coport_table->ncoports, 1);
-	atomic_store_explicit(&coport_table->coports[index].ref_count, 1, memory_order_release);
 	return (ptr);
 }
 
+/* 
+ * Called once the coport has been torn down; its handles are already stale.
+ * The handle record is only freed if the allocator revokes capabilities to 
+ * freed memory before reusing it. Otherwise it is left allocated, so that no
+ * later handle can share its address with a stale one.
+ */
+void
+free_coport(coport_t *ptr)
+{
+	struct _coport_table *coport_table;
+	coport_tbl_entry_t *entry;
+
+	coport_table = get_coport_table(ptr->type);
+	entry = &coport_table->coports[ptr->slot];
+	if (free_handles)
+		free(entry->handle);
+	entry->handle = NULL;
+	entry->port.buffer = NULL;
+	atomic_fetch_sub(&coport_table->ncoports, 1);
+	push_free_coport(coport_table, ptr->slot);
+}
+
+/*
+ * Returns the entry's block of len bytes aligned to align, allocating it if
+ * the entry has none of that layout, or NULL if that fails. Recycled entries 
+ * keep their block, so reopening a slot with the same layout allocates 
+ * nothing. A new block's contents are undefined.
+ */
+void *
+get_coport_block(coport_t *ptr, size_t align, size_t len)
+{
+	struct _coport_table *coport_table;
+	coport_tbl_entry_t *entry;
+	void *block;
+
+	coport_table = get_coport_table(ptr->type);
+	entry = &coport_table->coports[ptr->slot];
+	if (entry->block != NULL && entry->block_len == len && entry->block_align == align)
+		return (entry->block);
+
+	if (posix_memalign(&block, align, len) != 0)
+		return (NULL);
+	free(entry->block);
+	entry->block = cheri_setbounds(block, len);
+	entry->block_len = len;
+	entry->block_align = align;
+	return (entry->block);
+}
+
+/*
+ * Returns at least n message structs for a cocarrier, or NULL. Sealed message
+ * handles point into the array and are checked against the gen stored there,
+ * so an array is never freed or moved: a smaller cocarrier reuses a prefix, 
+ * and a larger one gets a new array while the old one is left allocated. 
+ * Capacities are powers of two, so what is left behind is at most the size of
+ * the current array. New arrays are zeroed.
+ */
+struct cocarrier_message *
+get_coport_msgs(coport_t *ptr, size_t n)
+{
+	struct _coport_table *coport_table;
+	coport_tbl_entry_t *entry;
+	struct cocarrier_message *msgs;
+
+	coport_table = get_coport_table(ptr->type);
+	entry = &coport_table->coports[ptr->slot];
+	if (entry->msgs != NULL && entry->nmsgs >= n)
+		return (entry->msgs);
+
+	msgs = calloc(n, sizeof(struct cocarrier_message));
+	if (msgs == NULL)
+		return (NULL);
+	entry->msgs = cheri_setbounds(msgs, n * sizeof(struct cocarrier_message));
+	entry->nmsgs = n;
+	return (entry->msgs);
+}
+
+/*
+ * Returns at least len bytes of COPORT_INLINE slots for a cocarrier, or NULL.
+ * Receivers keep capabilities into the slots, so like the message structs 
+ * they are never freed: inline messages are only valid until their slot is 
+ * reused, which a recycled entry does in place, and a larger cocarrier gets a
+ * new array while the old one is left allocated.
+ */
+char *
+get_coport_inline(coport_t *ptr, size_t len)
+{
+	struct _coport_table *coport_table;
+	coport_tbl_entry_t *entry;
+	char *slots;
+
+	coport_table = get_coport_table(ptr->type);
+	entry = &coport_table->coports[ptr->slot];
+	if (entry->inline_slots != NULL && entry->inline_len >= len)
+		return (entry->inline_slots);
+
+	/* naturally aligned so that bounds are exact */
+	slots = aligned_alloc(len, len);
+	if (slots == NULL)
+		return (NULL);
+	entry->inline_slots = cheri_setboundsexact(slots, len);
+	entry->inline_len = len;
+	return (entry->inline_slots);
+}
+
+/* 
+ * Makes the handle for the coport's current generation, or returns NULL. Each
+ * open gets a record of its own, so a handle reaches that copy of the coport 
+ * and nothing else in the table.
+ */
+coport_t *
+coport_handle(coport_t *ptr)
+{
+	struct _coport_table *coport_table;
+	coport_tbl_entry_t *entry;
+	coport_t *handle;
+
+	coport_table = get_coport_table(ptr->type);
+	entry = &coport_table->coports[ptr->slot];
+	handle = malloc(sizeof(coport_t));
+	if (handle == NULL)
+		return (NULL);
+	ptr->gen = atomic_load_explicit(&ptr->info->gen, memory_order_acquire);
+	memcpy(handle, ptr, sizeof(coport_t));
+	entry->handle = handle;
+	return (cheri_setboundsexact(handle, sizeof(coport_t)));
+}
+
+/* 
+ * Returns the table's own copy of the coport a handle names. Unlike the 
+ * handle, it is never freed, but it names whatever coport holds the slot now.
+ */
+coport_t *
+get_coport_slot(coport_t *ptr)
+{
+	struct _coport_table *coport_table;
+
+	coport_table = get_coport_table(ptr->type);
+	return (cheri_setboundsexact(&coport_table->coports[ptr->slot].port, sizeof(coport_t)));
+}
+
+/* ptr must be unsealed; checks it is the handle of a live entry at its current generation */
 int 
 in_coport_table(coport_t *ptr, coport_type_t type)
 {
 	struct _coport_table *coport_table = get_coport_table(type);
-	vaddr_t addr = cheri_getaddress(ptr);
-	return (cheri_is_address_inbounds(coport_table->coports, addr));
+	coport_tbl_entry_t *entry;
+
+	if (coport_table == NULL)
+		return (0);
+	else if (ptr->type != type)
+		return (0);
+	else if (ptr->slot >= atomic_load(&coport_table->next_coport))
+		return (0);
+	entry = &coport_table->coports[ptr->slot];
+	if (entry->handle == NULL || cheri_getaddress(ptr) != cheri_getaddress(entry->handle))
+		return (0);
+	return (coport_handle_current(ptr));
 }
 
 int
 can_allocate_coport(coport_type_t type)
 {
 	struct _coport_table *coport_table = get_coport_table(type);
-	if(coport_table->ncoports == max_coports)
+	if ((atomic_load(&coport_table->free_head) & FREE_INDEX_MASK) != 0)
+		return (1);
+	else if (coport_table->next_coport >= max_coports)
 		return (0);
 	else
 		return (1);
@@ -147,7 +387,7 @@ get_coport_notifier_index(coport_t *coport)
 
 	coport_table = get_coport_table(coport->type);
 	start = coport_table->first_coport;
-	idx = (cheri_getaddress(&coport_table->coports[start]) - cheri_getaddress(coport)) / sizeof(coport_t);
+	idx = coport->slot - start;
 	idx = idx % n_copoll_notifiers;
 
 	return (idx);
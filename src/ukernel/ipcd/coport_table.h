@@ -34,9 +34,19 @@
 
 #include <comsg/coport.h>
 
-#define N_COPORT_TABLES 3
+#define N_COPORT_TABLES 4
+#define COPORT_TABLE_DEFAULT_LEN 1024
 
+void set_coport_table_len(size_t len);
+size_t get_coport_table_len(void);
+void setup_coport_tables(void);
 coport_t *allocate_coport(coport_type_t type);
+void free_coport(coport_t *ptr);
+void *get_coport_block(coport_t *ptr, size_t align, size_t len);
+struct cocarrier_message *get_coport_msgs(coport_t *ptr, size_t n);
+char *get_coport_inline(coport_t *ptr, size_t len);
+coport_t *coport_handle(coport_t *ptr);
+coport_t *get_coport_slot(coport_t *ptr);
 int in_coport_table(coport_t *ptr, coport_type_t type);
 int can_allocate_coport(coport_type_t type);
 int get_coport_notifier_index(coport_t *coport);
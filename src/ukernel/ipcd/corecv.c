@@ -29,37 +29,125 @@
  * SUCH DAMAGE.
  */
 #include "corecv.h"
+#include "cobroadcast.h"
+#include "cocarrier_credit.h"
+#include "coclose.h"
+#include "cocarrier_userq.h"
 #include "ipcd.h"
 #include "ipcd_cap.h"
+#include "copoll.h"
 #include "copoll_utils.h"
 
 #include <comsg/comsg_args.h>
 #include <comsg/coport.h>
 #include <comsg/utils.h>
 
+#include <cheri/cheric.h>
+#include <cheri/cherireg.h>
 #include <sys/errno.h>
+#include <sys/param.h>
+#include <sys/time.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <string.h>
+#include <time.h>
 
 int 
 validate_corecv_args(corecv_args_t *cocall_args)
 {
-	if (!valid_cocarrier(cocall_args->cocarrier))
+	if (valid_cosubscriber(cocall_args->cocarrier))
+		return (1);
+	else if (!valid_cocarrier(cocall_args->cocarrier))
 		return (0);
 	else 
 		return (1);
 }
 
+/* 
+ * Fills queue slot index with the message described by from. COPORT_INLINE
+ * messages are copied from inline_bytes into the slot's own inline space.
+ */
+static void
+set_queued_msg(coport_t *cocarrier, size_t index, const struct cocarrier_message *from, 
+    const char *inline_bytes)
+{
+	struct cocarrier_message **cocarrier_buf, *msg;
+	char *slot;
+	size_t len;
+
+	cocarrier_buf = cocarrier->buffer->buf;
+	msg = cocarrier_buf[index];
+	msg->alloc = from->alloc;
+	msg->attachments = from->attachments;
+	msg->nattachments = from->nattachments;
+	msg->corr_id = from->corr_id;
+	if (!COCARRIER_MSG_INLINE(from)) {
+		msg->buf = from->buf;
+		return;
+	}
+	len = cheri_getlen(from->buf);
+	slot = cocarrier->cd->inline_slots + (index * COCARRIER_INLINE_LEN);
+	memcpy(slot, inline_bytes, len);
+	msg->buf = cheri_setbounds(slot, len);
+}
+
+/* 
+ * Moves the first queued message carrying corr_id to the head of the queue,
+ * shifting the messages ahead of it back by one slot. No handles to queued 
+ * messages exist yet, so only their contents move. Called with the coport 
+ * locked.
+ */
+static bool
+move_msg_to_head(coport_t *cocarrier, uint64_t corr_id)
+{
+	struct cocarrier_message **cocarrier_buf, *msg, saved;
+	char inline_bytes[COCARRIER_INLINE_LEN];
+	size_t depth, start, index, prev, pos;
+
+	cocarrier_buf = cocarrier->buffer->buf;
+	depth = COCARRIER_DEPTH(cocarrier);
+	start = cocarrier->info->start;
+	index = start;
+	for (pos = 0; pos < cocarrier->info->length; pos++) {
+		index = (start + pos) % depth;
+		if (cocarrier_buf[index]->corr_id == corr_id)
+			break;
+	}
+	if (pos == cocarrier->info->length)
+		return (false);
+	else if (pos == 0)
+		return (true);
+
+	msg = cocarrier_buf[index];
+	saved.buf = msg->buf;
+	saved.alloc = msg->alloc;
+	saved.attachments = msg->attachments;
+	saved.nattachments = msg->nattachments;
+	saved.corr_id = msg->corr_id;
+	if (COCARRIER_MSG_INLINE(msg))
+		memcpy(inline_bytes, msg->buf, cheri_getlen(msg->buf));
+	for (; index != start; index = prev) {
+		prev = (index + depth - 1) % depth;
+		set_queued_msg(cocarrier, index, cocarrier_buf[prev], cocarrier_buf[prev]->buf);
+	}
+	set_queued_msg(cocarrier, start, &saved, inline_bytes);
+	return (true);
+}
+
+/* 
+ * Takes the message at the head of the queue, or if corr_id is not 0, the 
+ * first message carrying corr_id (ENOMSG if there is none).
+ */
 static void 
-cocarrier_recv(corecv_args_t *cocall_args, void *token) 
+cocarrier_recv(corecv_args_t *cocall_args, uint64_t corr_id) 
 {
-	UNUSED(token);
 	coport_t *cocarrier;
 	struct cocarrier_message **cocarrier_buf, *msg;
 	coport_eventmask_t event;
 	coport_status_t status;
 	size_t port_len, index, new_len;
+	uint64_t gen;
 	bool closing;
 
 	cocarrier = unseal_coport(cocall_args->cocarrier);
@@ -76,25 +164,53 @@ cocarrier_recv(corecv_args_t *cocall_args, void *token)
 			closing = true;
 			break;
 		default:
+			COPORT_STAT_INC(cocarrier, cas_retries);
 			status = COPORT_OPEN;
 			break;
 		}
 	}
+	if (!coport_handle_current(cocarrier)) {
+		/* the slot was recycled while we waited; the status is another coport's */
+		atomic_store_explicit(&cocarrier->info->status, status, memory_order_release);
+		COCALL_ERR(cocall_args, EPIPE);
+	}
 	event = cocarrier->info->event;
 	port_len = cocarrier->info->length;
+	if (cocarrier->cd->userq != NULL) {
+		/* start is unused; the shared consume index says where we are */
+		if (!cocarrier_userq_claim(cocarrier, &index, true))
+			port_len = 0;
+		else
+			event |= COPOLL_IN;
+	}
 
 	if(port_len == 0 || ((event & COPOLL_IN) == 0)) {
-		cocarrier->info->event = (event | COPOLL_RERR);
-		atomic_store_explicit(&cocarrier->info->status, COPORT_OPEN, memory_order_release);
+		cocarrier->info->event = (event | COPOLL_RERR) & ~COPOLL_IN;
+		COPORT_STAT_INC(cocarrier, recv_empty);
+		atomic_store_explicit(&cocarrier->info->status, status, memory_order_release);
+		if (closing)
+			reclaim_coport(cocarrier);
 		COCALL_ERR(cocall_args, EAGAIN);
 	}
 
-	new_len = port_len - 1;
-	index = cocarrier->info->start;
-	cocarrier->info->start = (index + 1) % COCARRIER_SIZE;
+	if (corr_id != 0 && (cocarrier->cd->userq != NULL || !move_msg_to_head(cocarrier, corr_id))) {
+		atomic_store_explicit(&cocarrier->info->status, status, memory_order_release);
+		COCALL_ERR(cocall_args, ENOMSG);
+	}
+
+	if (cocarrier->cd->userq != NULL)
+		new_len = cocarrier_userq_len(cocarrier);
+	else {
+		new_len = port_len - 1;
+		index = cocarrier->info->start;
+		cocarrier->info->start = (index + 1) % COCARRIER_DEPTH(cocarrier);
+	}
 	cocarrier->info->length = new_len;
 
 	msg = cocarrier_buf[index];
+	gen = atomic_load_explicit(&msg->gen, memory_order_relaxed);
+	COPORT_STAT_INC(cocarrier, recvs);
+	COPORT_STAT_ADD(cocarrier, bytes_recvd, cheri_getlen(msg->buf));
 	if (!closing)
 		event |= COPOLL_OUT;
 	if (new_len == 0)
@@ -102,28 +218,46 @@ cocarrier_recv(corecv_args_t *cocall_args, void *token)
 	else 
 		event &= ~COPOLL_RERR;
 	cocarrier->info->event = event;
-	/* Restore status value (might be COPORT_CLOSING or COPORT_OPEN) */
-	atomic_store_explicit(&cocarrier->info->status, status, memory_order_release);
 
-	cocall_args->message = __builtin_cheri_perms_and(msg->buf, COCARRIER_MSG_PERMS);
+	/* Still locked, so a closing cocarrier cannot be torn down under us */
+	cocall_args->message = cocarrier_msg_cap(msg);
 	cocall_args->length = __builtin_cheri_length_get(msg->buf);
 	if (msg->attachments != NULL)
 		cocall_args->oob_data.attachments = __builtin_cheri_perms_and(msg->attachments, COCARRIER_OOB_PERMS);
 	else
 		cocall_args->oob_data.attachments = NULL;
 	cocall_args->oob_data.len = msg->nattachments;
+	cocall_args->corr_id = msg->corr_id;
+	if (COCARRIER_MSG_INLINE(msg)) {
+		/* nothing to free; the slot is reused when the queue wraps */
+		cocall_args->msg_handle.slot = NULL;
+		cocall_args->msg_handle.gen = 0;
+	} else {
+		cocall_args->msg_handle.slot = seal_cocarrier_msg(msg);
+		cocall_args->msg_handle.gen = gen;
+	}
 	atomic_thread_fence(memory_order_seq_cst);
 	atomic_store(&msg->recvd, true);
+	/* Restore status value (might be COPORT_CLOSING or COPORT_OPEN) */
+	atomic_store_explicit(&cocarrier->info->status, status, memory_order_release);
 
+	return_cocarrier_credits(cocarrier, 1);
 	copoll_notify(cocarrier, COPOLL_OUT);
+	if (closing && new_len == 0)
+		reclaim_coport(cocarrier);
 	COCALL_RETURN(cocall_args, cheri_getlen(cocall_args->message));
 }
 
 void coport_recv(coopen_args_t *cocall_args, void *token)
 {
+	/* COBROADCAST subscribers are not coports themselves */
+	if (valid_cosubscriber(cocall_args->cocarrier)) {
+		cobroadcast_recv(cocall_args, token);
+		return;
+	}
 	switch (coport_gettype(cocall_args->cocarrier)) {
 	case COCARRIER:
-		cocarrier_recv(cocall_args, token);
+		cocarrier_recv(cocall_args, 0);
 		break;
 	case COPIPE:
 		COCALL_ERR(cocall_args, ENOSYS);
@@ -134,3 +268,204 @@ void coport_recv(coopen_args_t *cocall_args, void *token)
 	}
 	//return/error values set by type-specific handler functions or by fallback case
 }
+
+int 
+validate_slorecv_args(corecv_args_t *cocall_args)
+{
+	return (valid_cocarrier(cocall_args->cocarrier));
+}
+
+/*
+ * Slow path for corecv_timed, called once CORECV has found the cocarrier empty.
+ * Each wake-up retries the dequeue under the coport lock, so we either take a
+ * message or go back to waiting; receivers that lose the race to another 
+ * receiver never see EAGAIN.
+ */
+void 
+cocarrier_recv_slow(corecv_args_t *cocall_args, void *token)
+{
+	UNUSED(token);
+	struct timespec deadline, curtime;
+	coport_t *cocarrier;
+	long timeout, remaining;
+
+	cocarrier = unseal_coport(cocall_args->cocarrier);
+	timeout = cocall_args->recv_timeout;
+	if (timeout > 0) {
+		deadline.tv_sec = timeout / 1000;
+		deadline.tv_nsec = (timeout % 1000) * 1000000;
+		clock_gettime(CLOCK_MONOTONIC, &curtime);
+		timespecadd(&deadline, &curtime, &deadline);
+	}
+
+	remaining = timeout;
+	for (;;) {
+		cocarrier_recv(cocall_args, 0);
+		if (cocall_args->status != -1 || cocall_args->error != EAGAIN)
+			return;
+		else if ((cocarrier->info->event & COPOLL_CLOSED) != 0)
+			COCALL_ERR(cocall_args, EPIPE);
+		if (timeout > 0) {
+			clock_gettime(CLOCK_MONOTONIC, &curtime);
+			if (!timespeccmp(&curtime, &deadline, <))
+				COCALL_ERR(cocall_args, ETIMEDOUT);
+			timespecsub(&deadline, &curtime, &curtime);
+			/* round up so we never wake just short of the deadline */
+			remaining = (curtime.tv_sec * 1000) + ((curtime.tv_nsec + 999999) / 1000000);
+		} else if (timeout == 0)
+			return;
+		cocarrier_wait(cocall_args->cocarrier, COPOLL_IN | COPOLL_CLOSED, remaining);
+		/* the slot may have been recycled while we slept */
+		if (!coport_handle_current(cocarrier))
+			COCALL_ERR(cocall_args, EPIPE);
+	}
+}
+
+/* 
+ * Takes the reply to a cotransact from anywhere in the reply port's queue,
+ * leaving any other messages where they are.
+ */
+void
+cocarrier_recv_reply(corecv_args_t *cocall_args, uint64_t corr_id)
+{
+	cocarrier_recv(cocall_args, corr_id);
+}
+
+int 
+validate_corecvv_args(corecvv_args_t *cocall_args)
+{
+	size_t perms = (CHERI_PERM_STORE | CHERI_PERM_STORE_CAP);
+
+	if (cocall_args->nmessages == 0 || cocall_args->nmessages > COCARRIER_MAX_BATCH)
+		return (0);
+	else if (cheri_gettag(cocall_args->messages) == 0)
+		return (0);
+	else if (cheri_getlen(cocall_args->messages) < cocall_args->nmessages * sizeof(void *))
+		return (0);
+	else if ((cheri_getperm(cocall_args->messages) & perms) != perms)
+		return (0);
+	else if (!valid_cocarrier(cocall_args->cocarrier))
+		return (0);
+	else if (cocall_args->msg_handles == NULL)
+		return (1);
+	else if (cheri_gettag(cocall_args->msg_handles) == 0)
+		return (0);
+	else if (cheri_getlen(cocall_args->msg_handles) < cocall_args->nmessages * sizeof(comsg_handle_t))
+		return (0);
+	else if ((cheri_getperm(cocall_args->msg_handles) & perms) != perms)
+		return (0);
+	return (1);
+}
+
+void 
+coport_recvv(corecvv_args_t *cocall_args, void *token) 
+{
+	UNUSED(token);
+	void *msgs[COCARRIER_MAX_BATCH];
+	comsg_handle_t handles[COCARRIER_MAX_BATCH];
+	coport_t *cocarrier;
+	struct cocarrier_message **cocarrier_buf, *msg;
+	coport_eventmask_t event;
+	coport_status_t status;
+	size_t port_len, index, depth, nmessages, nrecvd;
+	bool closing;
+
+	cocarrier = unseal_coport(cocall_args->cocarrier);
+	cocarrier_buf = cocarrier->buffer->buf;
+
+	status = COPORT_OPEN;
+	closing = false;
+	while(!atomic_compare_exchange_weak_explicit(&cocarrier->info->status, &status, COPORT_BUSY, memory_order_acq_rel, memory_order_relaxed)) {
+		switch (status) {
+		case COPORT_CLOSED:
+			COCALL_ERR(cocall_args, EPIPE);
+			break; /* NOTREACHED */
+		case COPORT_CLOSING:
+			closing = true;
+			break;
+		default:
+			COPORT_STAT_INC(cocarrier, cas_retries);
+			status = COPORT_OPEN;
+			break;
+		}
+	}
+	if (!coport_handle_current(cocarrier)) {
+		/* the slot was recycled while we waited; the status is another coport's */
+		atomic_store_explicit(&cocarrier->info->status, status, memory_order_release);
+		COCALL_ERR(cocall_args, EPIPE);
+	}
+	event = cocarrier->info->event;
+	port_len = cocarrier->info->length;
+	if (cocarrier->cd->userq != NULL) {
+		port_len = cocarrier_userq_len(cocarrier);
+		event = (port_len != 0) ? (event | COPOLL_IN) : (event & ~COPOLL_IN);
+	}
+
+	if(port_len == 0 || ((event & COPOLL_IN) == 0)) {
+		cocarrier->info->event = (event | COPOLL_RERR);
+		COPORT_STAT_INC(cocarrier, recv_empty);
+		atomic_store_explicit(&cocarrier->info->status, status, memory_order_release);
+		if (closing)
+			reclaim_coport(cocarrier);
+		COCALL_ERR(cocall_args, EAGAIN);
+	}
+
+	depth = COCARRIER_DEPTH(cocarrier);
+	nmessages = MIN(cocall_args->nmessages, port_len);
+	index = cocarrier->info->start;
+	for (nrecvd = 0; nrecvd < nmessages; nrecvd++) {
+		/* userspace receivers may be taking messages at the same time */
+		if (cocarrier->cd->userq != NULL && !cocarrier_userq_claim(cocarrier, &index, false))
+			break;
+		msg = cocarrier_buf[index];
+		/* messages with attachments must be received with corecv_oob */
+		if (msg->attachments != NULL)
+			break;
+		msgs[nrecvd] = cocarrier_msg_cap(msg);
+		if (COCARRIER_MSG_INLINE(msg)) {
+			handles[nrecvd].slot = NULL;
+			handles[nrecvd].gen = 0;
+		} else {
+			handles[nrecvd].slot = seal_cocarrier_msg(msg);
+			handles[nrecvd].gen = atomic_load_explicit(&msg->gen, memory_order_relaxed);
+		}
+		COPORT_STAT_ADD(cocarrier, bytes_recvd, cheri_getlen(msg->buf));
+		atomic_store_explicit(&msg->recvd, true, memory_order_relaxed);
+		index = (index + 1) % depth;
+	}
+	if (nrecvd == 0) {
+		atomic_store_explicit(&cocarrier->info->status, status, memory_order_release);
+		if (cocarrier->cd->userq != NULL && cocarrier_userq_len(cocarrier) == 0)
+			COCALL_ERR(cocall_args, EAGAIN);
+		COCALL_ERR(cocall_args, EBADMSG);
+	}
+
+	COPORT_STAT_ADD(cocarrier, recvs, nrecvd);
+	if (cocarrier->cd->userq != NULL)
+		port_len = cocarrier_userq_len(cocarrier);
+	else {
+		port_len -= nrecvd;
+		cocarrier->info->start = index;
+	}
+	cocarrier->info->length = port_len;
+
+	if (!closing)
+		event |= COPOLL_OUT;
+	if (port_len == 0)
+		event &= ~(COPOLL_RERR | COPOLL_IN);
+	else 
+		event &= ~COPOLL_RERR;
+	cocarrier->info->event = event;
+	/* Restore status value (might be COPORT_CLOSING or COPORT_OPEN) */
+	atomic_store_explicit(&cocarrier->info->status, status, memory_order_release);
+
+	memcpy(cocall_args->messages, msgs, nrecvd * sizeof(void *));
+	if (cocall_args->msg_handles != NULL)
+		memcpy(cocall_args->msg_handles, handles, nrecvd * sizeof(comsg_handle_t));
+
+	return_cocarrier_credits(cocarrier, nrecvd);
+	copoll_notify(cocarrier, COPOLL_OUT);
+	if (closing && port_len == 0)
+		reclaim_coport(cocarrier);
+	COCALL_RETURN(cocall_args, nrecvd);
+}
@@ -35,5 +35,10 @@
 
 int validate_corecv_args(corecv_args_t *cocall_args);
 void coport_recv(corecv_args_t *cocall_args, void *token);
+int validate_slorecv_args(corecv_args_t *cocall_args);
+void cocarrier_recv_slow(corecv_args_t *cocall_args, void *token);
+void cocarrier_recv_reply(corecv_args_t *cocall_args, uint64_t corr_id);
+int validate_corecvv_args(corecvv_args_t *cocall_args);
+void coport_recvv(corecvv_args_t *cocall_args, void *token);
 
 #endif //!defined(_CORECV_H)
\ No newline at end of file
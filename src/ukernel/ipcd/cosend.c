@@ -29,10 +29,18 @@
  * SUCH DAMAGE.
  */
 #include "cosend.h"
+#include "cobroadcast.h"
+#include "cocarrier_credit.h"
+#include "cocarrier_userq.h"
+#include "comsg_free.h"
+#include "copoll.h"
 #include "ipcd.h"
 #include "ipcd_cap.h"
 #include "copoll_utils.h"
+#include "sppool.h"
+#include "zcpool.h"
 
+#include <ccmalloc.h>
 #include <comsg/comsg_args.h>
 #include <comsg/coport.h>
 #include <comsg/utils.h>
@@ -49,20 +57,66 @@
 #include <sys/param.h>
 #include <sys/queue.h>
 #include <sys/mman.h>
+#include <sys/time.h>
 #include <err.h>
+#include <time.h>
 
 extern void begin_cocall(void);
 extern void end_cocall(void);
 
+/* 
+ * Sums the fragments of a cosend_iov message. Each must be tagged and hold 
+ * iov_len bytes, and the message must fit in COCARRIER_MAX_MSG_LEN.
+ */
+static bool
+gather_len(const struct iovec *iov, size_t iovcnt, size_t *msg_len)
+{
+	const void *base;
+	size_t len;
+
+	if (iovcnt == 0 || iovcnt > COCARRIER_MAX_BATCH)
+		return (false);
+	len = 0;
+	for (size_t i = 0; i < iovcnt; i++) {
+		base = iov[i].iov_base;
+		if (cheri_gettag(base) == 0)
+			return (false);
+		else if (cheri_getoffset(base) > cheri_getlen(base))
+			return (false);
+		else if (iov[i].iov_len > cheri_getlen(base) - cheri_getoffset(base))
+			return (false);
+		len += iov[i].iov_len;
+		if (len > COCARRIER_MAX_MSG_LEN)
+			return (false);
+	}
+	*msg_len = len;
+	return (true);
+}
+
+/* cosend_iov leaves message NULL and gathers nmessages fragments from iov */
+static int
+validate_cosend_iov(cosend_args_t *cocall_args)
+{
+	size_t msg_len;
+
+	if (cheri_gettag(cocall_args->iov) == 0)
+		return (0);
+	else if (cheri_getlen(cocall_args->iov) < cocall_args->nmessages * sizeof(struct iovec))
+		return (0);
+	else if (!valid_cocarrier(cocall_args->cocarrier))
+		return (0);
+	return (gather_len(cocall_args->iov, cocall_args->nmessages, &msg_len));
+}
+
 int validate_cosend_args(coopen_args_t *cocall_args)
 {
 	if (cocall_args->length > COCARRIER_MAX_MSG_LEN)
 		return (0);
-	else if (cheri_gettag(cocall_args->message) == 0)
+	else if (cheri_gettag(cocall_args->message) == 0 && !validate_cosend_iov(cocall_args))
 		return (0);
-	else if (cheri_getlen(cocall_args->message) > COCARRIER_MAX_MSG_LEN)
+	else if (cheri_gettag(cocall_args->message) != 0 && cheri_getlen(cocall_args->message) > COCARRIER_MAX_MSG_LEN)
 		return (0);
-	else if (!valid_cocarrier(cocall_args->cocarrier))
+	else if (!valid_cocarrier(cocall_args->cocarrier) && !valid_cobroadcast(cocall_args->cocarrier))
 		return (0);
 	else if (cocall_args->oob_data.len != 0) {
 		if (cheri_gettag(cocall_args->oob_data.attachments) == 0)
@@ -70,6 +124,8 @@ int validate_cosend_args(coopen_args_t *cocall_args)
 		else if (cheri_getlen(cocall_args->oob_data.attachments) < cocall_args->oob_data.len * sizeof(comsg_attachment_t))
 			return (0);
 	}
+	if (cocall_args->msg_handle.slot != NULL)
+		return (valid_zcpool_token(cocall_args->msg_handle.slot));
 	return (1);
 }
 
@@ -125,28 +181,169 @@ handle_attachments(comsg_attachment_t *attachments, size_t len)
 	return (attachment_buf);
 }
 
+/* 
+ * Called with the cocarrier locked. If the slot's previous message was 
+ * received but never freed, claim it so a stale handle cannot free the new 
+ * message; bumping gen invalidates any outstanding handles to the slot.
+ */
+void
+fill_cocarrier_slot(struct cocarrier_message *msg, void *buf, void *alloc, 
+    comsg_attachment_t *attachments, size_t nattachments, uint64_t corr_id)
+{
+	bool freed;
+
+	freed = false;
+	if (atomic_load_explicit(&msg->recvd, memory_order_acquire))
+		atomic_compare_exchange_strong(&msg->freed, &freed, true);
+	atomic_fetch_add_explicit(&msg->gen, 1, memory_order_seq_cst);
+	msg->buf = buf;
+	msg->alloc = alloc;
+	msg->attachments = attachments;
+	msg->nattachments = nattachments;
+	msg->corr_id = corr_id;
+	atomic_store_explicit(&msg->recvd, false, memory_order_relaxed);
+	atomic_store_explicit(&msg->freed, false, memory_order_release);
+}
+
+/* 
+ * Allocates ipcd's copy of a message. COPORT_SUPERPAGE ports take large 
+ * messages from the superpage pool, falling back to the slab if it is full.
+ */
+static void *
+alloc_msg(coport_t *cocarrier, size_t msg_len)
+{
+	void *msg_alloc;
+
+	if ((cocarrier->flags & COPORT_SUPERPAGE) != 0 && msg_len >= SPPOOL_MIN_MSG_LEN) {
+		msg_alloc = sppool_alloc(msg_len);
+		if (msg_alloc != NULL)
+			return (msg_alloc);
+	}
+	return (ccslab_alloc(msg_len));
+}
+
+/* COPORT_INLINE messages that fit are copied into their slot under the lock */
+static inline bool
+send_inline(coport_t *cocarrier, const void *msg_in, size_t msg_len)
+{
+	return ((cocarrier->flags & COPORT_INLINE) != 0 && 
+	    msg_len <= COCARRIER_INLINE_LEN && !zcpool_owns(msg_in));
+}
+
+/* Copies a message in from msg_in, or from the iovcnt fragments in iov */
+static void
+copy_msg(void *msg_buf, const void *msg_in, const struct iovec *iov, size_t iovcnt, size_t msg_len)
+{
+	char *msg_out;
+
+	msg_out = cheri_andperm(msg_buf, COPORT_OUTBUF_PERMS); //ensure no tags get through here
+	if (iovcnt == 0) {
+		memcpy(msg_out, msg_in, msg_len);
+		return;
+	}
+	for (size_t i = 0; i < iovcnt; i++) {
+		memcpy(msg_out, cheri_andperm(iov[i].iov_base, COPORT_INBUF_PERMS), iov[i].iov_len);
+		msg_out += iov[i].iov_len;
+	}
+}
+
+static void *
+fill_inline_msg(coport_t *cocarrier, size_t index, const void *msg_in, 
+    const struct iovec *iov, size_t iovcnt, size_t msg_len)
+{
+	char *slot;
+
+	slot = cocarrier->cd->inline_slots + (index * COCARRIER_INLINE_LEN);
+	slot = cheri_setbounds(slot, msg_len);
+	copy_msg(slot, msg_in, iov, iovcnt, msg_len);
+	return (slot);
+}
+
+/* Undo message allocation when a send fails */
+static void
+abort_msg_alloc(void *msg_alloc)
+{
+	if (msg_alloc == NULL)
+		return; /* inline */
+	else if (zcpool_owns(msg_alloc))
+		zcpool_unclaim(msg_alloc);
+	else
+		free_cocarrier_msg_alloc(msg_alloc);
+}
+
 void cocarrier_send(coopen_args_t *cocall_args, void *token)
 {
 	UNUSED(token);
 	coport_status_t status;
-	size_t port_len, index, new_len, msg_len;
+	size_t port_len, index, new_len, msg_len, depth;
 	size_t nattachments;
 	coport_eventmask_t event;
 	coport_t *cocarrier;
 	struct cocarrier_message **cocarrier_buf;
 	comsg_attachment_t *attachments;
 	struct cocarrier_message *msg;
-	void *msg_in, *msg_out, *msg_alloc;
+	struct iovec iov[COCARRIER_MAX_BATCH];
+	void *msg_in, *msg_buf, *msg_alloc;
+	size_t credits, iovcnt;
 	int error;
-	bool locked;
+	bool locked, closed;
 
 	begin_cocall();
+	cocarrier = unseal_coport(cocall_args->cocarrier);
 
-	msg_in = cheri_andperm(cocall_args->message, COPORT_INBUF_PERMS);
-	msg_len = MIN(cocall_args->length, cheri_getlen(msg_in));
-	msg_alloc = malloc(msg_len);
-	msg_out = cheri_andperm(msg_alloc, COPORT_OUTBUF_PERMS); //ensure no tags get through here
-	memcpy(msg_out, msg_in, msg_len);
+	/* A credit guarantees a slot, so take it before copying the message in */
+	credits = 0;
+	if ((cocarrier->flags & COPORT_CREDIT) != 0) {
+		credits = take_cocarrier_credits(cocarrier, 1, &closed);
+		if (credits == 0) {
+			end_cocall();
+			if (closed)
+				COCALL_ERR(cocall_args, EPIPE);
+			COPORT_STAT_INC(cocarrier, send_full);
+			COCALL_ERR(cocall_args, EAGAIN);
+		}
+	}
+
+	iovcnt = 0;
+	if (cheri_gettag(cocall_args->message) == 0) {
+		/* cosend_iov; checked again as the sender may have changed iov */
+		iovcnt = MIN(cocall_args->nmessages, COCARRIER_MAX_BATCH);
+		memcpy(iov, cocall_args->iov, iovcnt * sizeof(struct iovec));
+		if (!gather_len(iov, iovcnt, &msg_len)) {
+			return_cocarrier_credits(cocarrier, credits);
+			end_cocall();
+			COCALL_ERR(cocall_args, EINVAL);
+		}
+		msg_in = NULL;
+	} else {
+		msg_in = cheri_andperm(cocall_args->message, COPORT_INBUF_PERMS);
+		msg_len = MIN(cocall_args->length, cheri_getlen(msg_in));
+	}
+	if (send_inline(cocarrier, msg_in, msg_len)) {
+		msg_alloc = NULL;
+		msg_buf = NULL;
+	} else if (zcpool_owns(msg_in)) {
+		/* Zero-copy: take the sender's pool buffer as the message */
+		msg_alloc = NULL;
+		if (cocall_args->msg_handle.slot != NULL)
+			msg_alloc = zcpool_claim(msg_in, unseal_zcpool_token(cocall_args->msg_handle.slot), 
+			    cocall_args->msg_handle.gen, cheri_getaddress(cocarrier));
+		if (msg_alloc == NULL) {
+			return_cocarrier_credits(cocarrier, credits);
+			end_cocall();
+			COCALL_ERR(cocall_args, EINVAL);
+		}
+		msg_buf = cheri_setbounds(msg_alloc, msg_len);
+	} else {
+		msg_alloc = alloc_msg(cocarrier, msg_len);
+		if (msg_alloc == NULL) {
+			return_cocarrier_credits(cocarrier, credits);
+			end_cocall();
+			COCALL_ERR(cocall_args, ENOMEM);
+		}
+		msg_buf = ccslab_bound(msg_alloc, msg_len);
+		copy_msg(msg_buf, msg_in, iov, iovcnt, msg_len);
+	}
 
 	nattachments = cocall_args->oob_data.len;
 	attachments = handle_attachments(cocall_args->oob_data.attachments, nattachments);
@@ -157,7 +354,6 @@ void cocarrier_send(coopen_args_t *cocall_args, void *token)
 			err(EX_SOFTWARE, "%s:mlock failed! args were %p, %lu", __func__, msg->buf, cheri_getlen(msg->buf));
 	}*/
 	locked = false;
-	cocarrier = unseal_coport(cocall_args->cocarrier);
 	
 	/* Set the status to busy so we don't interleave.*/
 	/* We are not expecting high contention, and we can't sched_yield inside cocalls without slowdown */
@@ -171,51 +367,78 @@ void cocarrier_send(coopen_args_t *cocall_args, void *token)
 				if (error != 0)
 					err(EX_SOFTWARE, "%s:munlock failed! args were %p, %lu", __func__, msg->buf, cheri_getlen(msg->buf));
 			}*/
-			free(msg_out);
+			abort_msg_alloc(msg_alloc);
 			if (attachments != NULL)
 				free(attachments);
+			return_cocarrier_credits(cocarrier, credits);
 			end_cocall();
 			COCALL_ERR(cocall_args, EPIPE);
 			break; /* NOTREACHED */
 		default:
+			COPORT_STAT_INC(cocarrier, cas_retries);
 			status = COPORT_OPEN;
 			break;
 		}
 	}
+	if (!coport_handle_current(cocarrier)) {
+		/* the slot was recycled while we waited; the status is another coport's */
+		atomic_store_explicit(&cocarrier->info->status, COPORT_OPEN, memory_order_release);
+		abort_msg_alloc(msg_alloc);
+		if (attachments != NULL)
+			free(attachments);
+		return_cocarrier_credits(cocarrier, credits);
+		end_cocall();
+		COCALL_ERR(cocall_args, EPIPE);
+	}
 
 	cocarrier_buf = cocarrier->buffer->buf;
 	event = cocarrier->info->event;
 	port_len = cocarrier->info->length;
+	depth = COCARRIER_DEPTH(cocarrier);
+	if (cocarrier->cd->userq != NULL) {
+		/* receivers may have dequeued without telling us */
+		port_len = cocarrier_userq_len(cocarrier);
+		event |= (port_len < depth) ? COPOLL_OUT : NOEVENT;
+	}
 
-	if ((port_len >= COCARRIER_SIZE) || ((event & COPOLL_OUT) == 0)) {
+	if ((port_len >= depth) || ((event & COPOLL_OUT) == 0)) {
 		/*if (locked) {
 			error = munlock(msg->buf, cheri_getlen(msg->buf));
 			if (error != 0)
 				err(EX_SOFTWARE, "%s:munlock failed! args were %p, %lu", __func__, msg->buf, cheri_getlen(msg->buf));
 		}*/
-		free(msg_out);
+		abort_msg_alloc(msg_alloc);
 		if (attachments != NULL)
 			free(attachments);
 		event = (event | COPOLL_WERR);
+		COPORT_STAT_INC(cocarrier, send_full);
         atomic_store_explicit(&cocarrier->info->event, event, memory_order_release);
         atomic_store_explicit(&cocarrier->info->status, COPORT_OPEN, memory_order_release);
+		return_cocarrier_credits(cocarrier, credits);
 		end_cocall();
         COCALL_ERR(cocall_args, EAGAIN);
     }
 
     index = cocarrier->info->end;
     new_len = port_len + 1;
-    cocarrier->info->end = (index + 1) % COCARRIER_SIZE;
+    cocarrier->info->end = (index + 1) % depth;
     cocarrier->info->length = new_len;
 
 	msg = cocarrier_buf[index];
-	msg->buf = msg_alloc;
-	msg->attachments = attachments;
-	msg->nattachments = nattachments;
-	msg->freed = false;
-	msg->recvd = false;
+	if (msg_alloc == NULL)
+		msg_buf = fill_inline_msg(cocarrier, index, msg_in, iov, iovcnt, msg_len);
+	if (cocarrier->cd->userq != NULL) {
+		/* the old message was taken, perhaps by a userspace receiver */
+		atomic_store_explicit(&msg->recvd, true, memory_order_relaxed);
+		fill_cocarrier_slot(msg, msg_buf, msg_alloc, attachments, nattachments, cocall_args->corr_id);
+		cocarrier_userq_publish(cocarrier, msg);
+	} else
+		fill_cocarrier_slot(msg, msg_buf, msg_alloc, attachments, nattachments, cocall_args->corr_id);
+	COPORT_STAT_INC(cocarrier, sends);
+	COPORT_STAT_ADD(cocarrier, bytes_sent, msg_len);
+	coport_stat_level(cocarrier->info, new_len);
 
-    if(new_len == COCARRIER_SIZE)
+    if(new_len == depth)
     	event = (COPOLL_IN | event) & ~(COPOLL_WERR | COPOLL_OUT);
     else
     	event = (COPOLL_IN | event) & ~COPOLL_WERR;
@@ -236,10 +459,15 @@ void cocarrier_send(coopen_args_t *cocall_args, void *token)
 
 void coport_send(coopen_args_t *cocall_args, void *token)
 {
+	/* only ipcd tags messages with correlation IDs (see cotransact) */
+	cocall_args->corr_id = 0;
 	switch (coport_gettype(cocall_args->cocarrier)) {
 	case COCARRIER:
 		cocarrier_send(cocall_args, token);
 		break;
+	case COBROADCAST:
+		cobroadcast_send(cocall_args, token);
+		break;
 	case COPIPE:
 		COCALL_ERR(cocall_args, ENOSYS);
 		break;
@@ -248,4 +476,242 @@ void coport_send(coopen_args_t *cocall_args, void *token)
 		break;
 	}
 	//return/error values set by type-specific handler functions or by fallback case
-}
\ No newline at end of file
+}
+
+int 
+validate_slosend_args(cosend_args_t *cocall_args)
+{
+	if (!valid_cocarrier(cocall_args->cocarrier))
+		return (0);
+	else if (!cheri_gettag(cocall_args->message) && !validate_cosend_iov(cocall_args))
+		return (0);
+	else if (cocall_args->oob_data.len != 0)
+		return (0); /* attachments are copied in once, by COSEND */
+	return (1);
+}
+
+/*
+ * Sends on a cocarrier, waiting up to send_timeout ms for room if it is full.
+ * COPORT_CREDIT senders sleep on the credit word and are woken as receivers
+ * return credits; others wait for COPOLL_OUT through copoll. The message 
+ * carries cocall_args->corr_id.
+ */
+void 
+cocarrier_send_wait(cosend_args_t *cocall_args, void *token)
+{
+	struct timespec deadline, curtime;
+	coport_t *cocarrier;
+	long timeout, remaining;
+
+	cocarrier = unseal_coport(cocall_args->cocarrier);
+	timeout = cocall_args->send_timeout;
+	if (timeout > 0) {
+		deadline.tv_sec = timeout / 1000;
+		deadline.tv_nsec = (timeout % 1000) * 1000000;
+		clock_gettime(CLOCK_MONOTONIC, &curtime);
+		timespecadd(&deadline, &curtime, &deadline);
+	}
+
+	remaining = timeout;
+	for (;;) {
+		cocarrier_send(cocall_args, token);
+		if (cocall_args->status != -1 || cocall_args->error != EAGAIN)
+			return;
+		else if ((cocarrier->info->event & COPOLL_CLOSED) != 0)
+			COCALL_ERR(cocall_args, EPIPE);
+		if (timeout > 0) {
+			clock_gettime(CLOCK_MONOTONIC, &curtime);
+			if (!timespeccmp(&curtime, &deadline, <))
+				COCALL_ERR(cocall_args, ETIMEDOUT);
+			timespecsub(&deadline, &curtime, &curtime);
+			remaining = (curtime.tv_sec * 1000) + ((curtime.tv_nsec + 999999) / 1000000);
+		} else if (timeout == 0)
+			return;
+		if ((cocarrier->flags & COPORT_CREDIT) != 0)
+			wait_cocarrier_credits(cocarrier, remaining);
+		else
+			cocarrier_wait(cocall_args->cocarrier, COPOLL_OUT | COPOLL_CLOSED, remaining);
+		/* the slot may have been recycled while we slept */
+		if (!coport_handle_current(cocarrier))
+			COCALL_ERR(cocall_args, EPIPE);
+	}
+}
+
+/* Slow path for cosend_timed, called once COSEND has found the cocarrier full */
+void 
+cocarrier_send_slow(cosend_args_t *cocall_args, void *token)
+{
+	cocall_args->corr_id = 0;
+	cocarrier_send_wait(cocall_args, token);
+}
+
+int 
+validate_cosendv_args(cosendv_args_t *cocall_args)
+{
+	if (cocall_args->nmessages == 0 || cocall_args->nmessages > COCARRIER_MAX_BATCH)
+		return (0);
+	else if (cheri_gettag(cocall_args->iov) == 0)
+		return (0);
+	else if (cheri_getlen(cocall_args->iov) < cocall_args->nmessages * sizeof(struct iovec))
+		return (0);
+	else if (!valid_cocarrier(cocall_args->cocarrier))
+		return (0);
+	return (1);
+}
+
+static void
+free_msg_allocs(void **msg_allocs, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		free_cocarrier_msg_alloc(msg_allocs[i]);
+}
+
+void 
+coport_sendv(cosendv_args_t *cocall_args, void *token)
+{
+	UNUSED(token);
+	struct iovec iov[COCARRIER_MAX_BATCH];
+	void *msg_allocs[COCARRIER_MAX_BATCH];
+	void *msg_bufs[COCARRIER_MAX_BATCH];
+	coport_status_t status;
+	coport_eventmask_t event;
+	coport_t *cocarrier;
+	struct cocarrier_message **cocarrier_buf, *msg;
+	size_t nmessages, nsent, port_len, depth, index, msg_len, i, credits;
+	void *msg_in;
+	bool closed;
+
+	begin_cocall();
+
+	cocarrier = unseal_coport(cocall_args->cocarrier);
+	nmessages = cocall_args->nmessages;
+	memcpy(iov, cocall_args->iov, nmessages * sizeof(struct iovec));
+
+	/* Don't copy in messages that cannot fit. Checked again under the lock. */
+	depth = COCARRIER_DEPTH(cocarrier);
+	if (cocarrier->cd->userq != NULL)
+		port_len = cocarrier_userq_len(cocarrier);
+	else
+		port_len = MIN(atomic_load_explicit(&cocarrier->info->length, memory_order_relaxed), depth);
+	nmessages = MIN(nmessages, depth - port_len);
+	credits = 0;
+	if (nmessages != 0 && (cocarrier->flags & COPORT_CREDIT) != 0) {
+		credits = take_cocarrier_credits(cocarrier, nmessages, &closed);
+		if (closed) {
+			end_cocall();
+			COCALL_ERR(cocall_args, EPIPE);
+		}
+		nmessages = credits;
+	}
+	if (nmessages == 0) {
+		COPORT_STAT_INC(cocarrier, send_full);
+		end_cocall();
+		COCALL_ERR(cocall_args, EAGAIN);
+	}
+
+	for (i = 0; i < nmessages; i++) {
+		msg_in = cheri_andperm(iov[i].iov_base, COPORT_INBUF_PERMS);
+		if (cheri_gettag(msg_in) == 0 || iov[i].iov_len > COCARRIER_MAX_MSG_LEN) {
+			free_msg_allocs(msg_allocs, i);
+			return_cocarrier_credits(cocarrier, credits);
+			end_cocall();
+			COCALL_ERR(cocall_args, EINVAL);
+		}
+		msg_len = MIN(iov[i].iov_len, cheri_getlen(msg_in));
+		if (send_inline(cocarrier, msg_in, msg_len)) {
+			/* copied into its slot below; msg_bufs holds the source */
+			msg_allocs[i] = NULL;
+			msg_bufs[i] = cheri_setbounds(msg_in, msg_len);
+			continue;
+		}
+		msg_allocs[i] = alloc_msg(cocarrier, msg_len);
+		if (msg_allocs[i] == NULL) {
+			free_msg_allocs(msg_allocs, i);
+			return_cocarrier_credits(cocarrier, credits);
+			end_cocall();
+			COCALL_ERR(cocall_args, ENOMEM);
+		}
+		msg_bufs[i] = ccslab_bound(msg_allocs[i], msg_len);
+		memcpy(cheri_andperm(msg_bufs[i], COPORT_OUTBUF_PERMS), msg_in, msg_len);
+	}
+
+	status = COPORT_OPEN;
+	while(!atomic_compare_exchange_weak_explicit(&cocarrier->info->status, &status, COPORT_BUSY, memory_order_acq_rel, memory_order_relaxed)) {
+		switch (status) {
+		case COPORT_CLOSED:
+		case COPORT_CLOSING:
+			free_msg_allocs(msg_allocs, nmessages);
+			return_cocarrier_credits(cocarrier, credits);
+			end_cocall();
+			COCALL_ERR(cocall_args, EPIPE);
+			break; /* NOTREACHED */
+		default:
+			COPORT_STAT_INC(cocarrier, cas_retries);
+			status = COPORT_OPEN;
+			break;
+		}
+	}
+	if (!coport_handle_current(cocarrier)) {
+		atomic_store_explicit(&cocarrier->info->status, COPORT_OPEN, memory_order_release);
+		free_msg_allocs(msg_allocs, nmessages);
+		return_cocarrier_credits(cocarrier, credits);
+		end_cocall();
+		COCALL_ERR(cocall_args, EPIPE);
+	}
+
+	cocarrier_buf = cocarrier->buffer->buf;
+	event = cocarrier->info->event;
+	port_len = cocarrier->info->length;
+	if (cocarrier->cd->userq != NULL) {
+		port_len = cocarrier_userq_len(cocarrier);
+		event |= (port_len < depth) ? COPOLL_OUT : NOEVENT;
+	}
+
+	if ((port_len >= depth) || ((event & COPOLL_OUT) == 0)) {
+		free_msg_allocs(msg_allocs, nmessages);
+		event = (event | COPOLL_WERR);
+		COPORT_STAT_INC(cocarrier, send_full);
+		atomic_store_explicit(&cocarrier->info->event, event, memory_order_release);
+		atomic_store_explicit(&cocarrier->info->status, COPORT_OPEN, memory_order_release);
+		return_cocarrier_credits(cocarrier, credits);
+		end_cocall();
+		COCALL_ERR(cocall_args, EAGAIN);
+	}
+
+	nsent = MIN(nmessages, depth - port_len);
+	index = cocarrier->info->end;
+	for (i = 0; i < nsent; i++) {
+		msg = cocarrier_buf[index];
+		if (msg_allocs[i] == NULL)
+			msg_bufs[i] = fill_inline_msg(cocarrier, index, msg_bufs[i], NULL, 0, cheri_getlen(msg_bufs[i]));
+		if (cocarrier->cd->userq != NULL)
+			atomic_store_explicit(&msg->recvd, true, memory_order_relaxed);
+		fill_cocarrier_slot(msg, msg_bufs[i], msg_allocs[i], NULL, 0, 0);
+		if (cocarrier->cd->userq != NULL)
+			cocarrier_userq_publish(cocarrier, msg);
+		COPORT_STAT_ADD(cocarrier, bytes_sent, cheri_getlen(msg_bufs[i]));
+		index = (index + 1) % depth;
+	}
+	port_len += nsent;
+	COPORT_STAT_ADD(cocarrier, sends, nsent);
+	coport_stat_level(cocarrier->info, port_len);
+	cocarrier->info->end = index;
+	cocarrier->info->length = port_len;
+
+	if (port_len == depth)
+		event = (COPOLL_IN | event) & ~(COPOLL_WERR | COPOLL_OUT);
+	else
+		event = (COPOLL_IN | event) & ~COPOLL_WERR;
+	cocarrier->info->event = event;
+	atomic_thread_fence(memory_order_seq_cst);
+	atomic_store_explicit(&cocarrier->info->status, COPORT_DONE, memory_order_release);
+
+	/* one notification for the whole batch */
+	copoll_notify(cocarrier, COPOLL_IN);
+
+	free_msg_allocs(&msg_allocs[nsent], nmessages - nsent);
+	if (credits > nsent)
+		return_cocarrier_credits(cocarrier, credits - nsent);
+	end_cocall();
+	COCALL_RETURN(cocall_args, nsent);
+}
@@ -33,7 +33,16 @@
 
 #include <comsg/comsg_args.h>
 
+struct cocarrier_message;
+
 int validate_cosend_args(coopen_args_t *cocall_args);
 void coport_send(coopen_args_t *cocall_args, void *token);
+int validate_slosend_args(cosend_args_t *cocall_args);
+void cocarrier_send_slow(cosend_args_t *cocall_args, void *token);
+void cocarrier_send_wait(cosend_args_t *cocall_args, void *token);
+int validate_cosendv_args(cosendv_args_t *cocall_args);
+void coport_sendv(cosendv_args_t *cocall_args, void *token);
+void fill_cocarrier_slot(struct cocarrier_message *msg, void *buf, void *alloc, 
+    comsg_attachment_t *attachments, size_t nattachments, uint64_t corr_id);
 
 #endif
\ No newline at end of file
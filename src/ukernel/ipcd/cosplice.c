@@ -0,0 +1,283 @@
+/*
+ * Copyright (c) 2020 Peter S. Blandford-Baker
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology) under DARPA contract HR0011-18-C-0016 ("ECATS"), as part of the
+ * DARPA SSITH research programme.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include "cosplice.h"
+#include "cocarrier_credit.h"
+#include "coclose.h"
+#include "copoll_utils.h"
+#include "cosend.h"
+#include "ipcd.h"
+#include "ipcd_cap.h"
+
+#include <ccmalloc.h>
+#include <comsg/comsg_args.h>
+#include <comsg/coport.h>
+#include <comsg/utils.h>
+
+#include <cheri/cheric.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/errno.h>
+#include <sys/param.h>
+
+extern void begin_cocall(void);
+extern void end_cocall(void);
+
+int
+validate_cosplice_args(cosplice_args_t *cocall_args)
+{
+	if (cocall_args->splice_max == 0)
+		return (0);
+	else if (!valid_cocarrier(cocall_args->splice_src))
+		return (0);
+	else if (!valid_cocarrier(cocall_args->splice_dst))
+		return (0);
+	else if (cheri_getaddress(cocall_args->splice_src) == cheri_getaddress(cocall_args->splice_dst))
+		return (0);
+	return (1);
+}
+
+/*
+ * Takes a cocarrier's status lock and returns the status to restore when 
+ * done. Closing cocarriers are only locked if allow_closing is set; 
+ * COPORT_CLOSED is returned if the cocarrier could not be locked, or if its
+ * slot was recycled while we waited.
+ */
+static coport_status_t
+lock_cocarrier(coport_t *cocarrier, bool allow_closing)
+{
+	coport_status_t status;
+
+	status = COPORT_OPEN;
+	while(!atomic_compare_exchange_weak_explicit(&cocarrier->info->status, &status, COPORT_BUSY, memory_order_acq_rel, memory_order_relaxed)) {
+		switch (status) {
+		case COPORT_CLOSED:
+			return (COPORT_CLOSED);
+		case COPORT_CLOSING:
+			if (!allow_closing)
+				return (COPORT_CLOSED);
+			break;
+		default:
+			COPORT_STAT_INC(cocarrier, cas_retries);
+			status = COPORT_OPEN;
+			break;
+		}
+	}
+	if (!coport_handle_current(cocarrier)) {
+		atomic_store_explicit(&cocarrier->info->status, status, memory_order_release);
+		return (COPORT_CLOSED);
+	}
+	return (status);
+}
+
+/*
+ * Hands the message in src_msg to dst_msg, which is slot dst_index of dst. 
+ * COPORT_INLINE messages live in their source slot, so they are copied; into
+ * dst's slot if it has one, otherwise into a new slab object.
+ */
+static bool
+move_msg(coport_t *dst, size_t dst_index, struct cocarrier_message *dst_msg, 
+    struct cocarrier_message *src_msg)
+{
+	void *buf, *alloc;
+	size_t len;
+
+	buf = src_msg->buf;
+	alloc = src_msg->alloc;
+	if (COCARRIER_MSG_INLINE(src_msg)) {
+		len = cheri_getlen(src_msg->buf);
+		if (dst->cd->inline_slots != NULL)
+			buf = cheri_setbounds(dst->cd->inline_slots + (dst_index * COCARRIER_INLINE_LEN), len);
+		else {
+			alloc = ccslab_alloc(len);
+			if (alloc == NULL)
+				return (false);
+			buf = ccslab_bound(alloc, len);
+		}
+		memcpy(cheri_andperm(buf, COPORT_OUTBUF_PERMS), src_msg->buf, len);
+	}
+	fill_cocarrier_slot(dst_msg, buf, alloc, src_msg->attachments, src_msg->nattachments, src_msg->corr_id);
+
+	/* The source slot no longer owns anything; nobody holds a handle to it */
+	src_msg->buf = NULL;
+	src_msg->alloc = NULL;
+	src_msg->attachments = NULL;
+	src_msg->nattachments = 0;
+	atomic_store_explicit(&src_msg->recvd, true, memory_order_relaxed);
+	atomic_store_explicit(&src_msg->freed, true, memory_order_release);
+	return (true);
+}
+
+/*
+ * Moves up to splice_max messages from the head of splice_src to the tail of
+ * splice_dst without copying them (COPORT_INLINE messages excepted). Both 
+ * cocarriers are locked for the move, in address order so that splices in 
+ * opposite directions cannot deadlock. Returns the number of messages moved.
+ */
+void
+cocarrier_splice(cosplice_args_t *cocall_args, void *token)
+{
+	UNUSED(token);
+	struct cocarrier_message **src_buf, **dst_buf, *src_msg;
+	coport_t *src, *dst;
+	coport_status_t src_status, dst_status;
+	coport_eventmask_t src_event, dst_event;
+	size_t src_len, dst_len, src_depth, dst_depth, src_index, dst_index;
+	size_t nmax, nmoved, nbytes, credits;
+	bool closed;
+
+	begin_cocall();
+	src = unseal_coport(cocall_args->splice_src);
+	dst = unseal_coport(cocall_args->splice_dst);
+	/* userspace dequeues would race with the move */
+	if (src->cd->userq != NULL || dst->cd->userq != NULL) {
+		end_cocall();
+		COCALL_ERR(cocall_args, EOPNOTSUPP);
+	}
+
+	nmax = cocall_args->splice_max;
+	credits = 0;
+	if ((dst->flags & COPORT_CREDIT) != 0) {
+		credits = take_cocarrier_credits(dst, MIN(nmax, COCARRIER_DEPTH(dst)), &closed);
+		if (credits == 0) {
+			end_cocall();
+			if (closed)
+				COCALL_ERR(cocall_args, EPIPE);
+			COPORT_STAT_INC(dst, send_full);
+			COCALL_ERR(cocall_args, EAGAIN);
+		}
+		nmax = credits;
+	}
+
+	if (cheri_getaddress(src) < cheri_getaddress(dst)) {
+		src_status = lock_cocarrier(src, true);
+		dst_status = (src_status == COPORT_CLOSED) ? COPORT_CLOSED : lock_cocarrier(dst, false);
+	} else {
+		dst_status = lock_cocarrier(dst, false);
+		src_status = (dst_status == COPORT_CLOSED) ? COPORT_CLOSED : lock_cocarrier(src, true);
+	}
+	if (src_status == COPORT_CLOSED || dst_status == COPORT_CLOSED) {
+		/* unlock whichever one we got */
+		if (src_status != COPORT_CLOSED)
+			atomic_store_explicit(&src->info->status, src_status, memory_order_release);
+		if (dst_status != COPORT_CLOSED)
+			atomic_store_explicit(&dst->info->status, dst_status, memory_order_release);
+		return_cocarrier_credits(dst, credits);
+		end_cocall();
+		COCALL_ERR(cocall_args, EPIPE);
+	}
+
+	src_buf = src->buffer->buf;
+	dst_buf = dst->buffer->buf;
+	src_depth = COCARRIER_DEPTH(src);
+	dst_depth = COCARRIER_DEPTH(dst);
+	src_event = src->info->event;
+	dst_event = dst->info->event;
+	src_len = ((src_event & COPOLL_IN) != 0) ? src->info->length : 0;
+	dst_len = dst->info->length;
+	if ((dst_event & COPOLL_OUT) == 0)
+		nmax = 0;
+	nmax = MIN(nmax, MIN(src_len, dst_depth - dst_len));
+	if (nmax == 0) {
+		if (src_len == 0)
+			COPORT_STAT_INC(src, recv_empty);
+		else
+			COPORT_STAT_INC(dst, send_full);
+		atomic_store_explicit(&dst->info->status, dst_status, memory_order_release);
+		atomic_store_explicit(&src->info->status, src_status, memory_order_release);
+		return_cocarrier_credits(dst, credits);
+		if (src_status == COPORT_CLOSING && src_len == 0)
+			reclaim_coport(src);
+		end_cocall();
+		COCALL_ERR(cocall_args, EAGAIN);
+	}
+
+	src_index = src->info->start;
+	dst_index = dst->info->end;
+	nbytes = 0;
+	for (nmoved = 0; nmoved < nmax; nmoved++) {
+		src_msg = src_buf[src_index];
+		nbytes += cheri_getlen(src_msg->buf);
+		if (!move_msg(dst, dst_index, dst_buf[dst_index], src_msg)) {
+			nbytes -= cheri_getlen(src_msg->buf);
+			break;
+		}
+		src_index = (src_index + 1) % src_depth;
+		dst_index = (dst_index + 1) % dst_depth;
+	}
+	if (nmoved == 0) {
+		/* couldn't copy an inline message; leave both queues untouched */
+		atomic_store_explicit(&dst->info->status, dst_status, memory_order_release);
+		atomic_store_explicit(&src->info->status, src_status, memory_order_release);
+		return_cocarrier_credits(dst, credits);
+		end_cocall();
+		COCALL_ERR(cocall_args, ENOMEM);
+	}
+
+	src_len -= nmoved;
+	src->info->start = src_index;
+	src->info->length = src_len;
+	if (src_status != COPORT_CLOSING)
+		src_event |= COPOLL_OUT;
+	if (src_len == 0)
+		src_event &= ~(COPOLL_RERR | COPOLL_IN);
+	else
+		src_event &= ~COPOLL_RERR;
+	src->info->event = src_event;
+	COPORT_STAT_ADD(src, recvs, nmoved);
+	COPORT_STAT_ADD(src, bytes_recvd, nbytes);
+
+	dst_len += nmoved;
+	dst->info->end = dst_index;
+	dst->info->length = dst_len;
+	if (dst_len == dst_depth)
+		dst_event = (COPOLL_IN | dst_event) & ~(COPOLL_WERR | COPOLL_OUT);
+	else
+		dst_event = (COPOLL_IN | dst_event) & ~COPOLL_WERR;
+	dst->info->event = dst_event;
+	COPORT_STAT_ADD(dst, sends, nmoved);
+	COPORT_STAT_ADD(dst, bytes_sent, nbytes);
+	coport_stat_level(dst->info, dst_len);
+
+	atomic_thread_fence(memory_order_seq_cst);
+	atomic_store_explicit(&dst->info->status, COPORT_DONE, memory_order_release);
+	atomic_store_explicit(&src->info->status, src_status, memory_order_release);
+
+	copoll_notify(dst, COPOLL_IN);
+	return_cocarrier_credits(src, nmoved);
+	copoll_notify(src, COPOLL_OUT);
+	if (credits > nmoved)
+		return_cocarrier_credits(dst, credits - nmoved);
+	if (src_status == COPORT_CLOSING && src_len == 0)
+		reclaim_coport(src);
+	end_cocall();
+	COCALL_RETURN(cocall_args, nmoved);
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2020 Peter S. Blandford-Baker
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology) under DARPA contract HR0011-18-C-0016 ("ECATS"), as part of the
+ * DARPA SSITH research programme.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include "costat.h"
+#include "cocarrier_userq.h"
+#include "ipcd_cap.h"
+
+#include <comsg/comsg_args.h>
+#include <comsg/coport.h>
+#include <comsg/utils.h>
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/errno.h>
+#include <sys/types.h>
+
+int 
+validate_costat_args(costat_args_t *cocall_args)
+{
+	return (valid_coport(cocall_args->stat_port));
+}
+
+/*
+ * Counters are read individually and without taking the coport status, so the
+ * snapshot is not atomic as a whole; it is cheap enough to sample often.
+ */
+void
+coport_stat(costat_args_t *cocall_args, void *token)
+{
+	UNUSED(token);
+	struct _coport_counters *counters;
+	coport_stats_t *stats;
+	coport_t *port;
+
+	port = unseal_coport(cocall_args->stat_port);
+	counters = &port->info->stats;
+	stats = &cocall_args->stats;
+
+	stats->type = port->type;
+	switch (port->type) {
+	case COPIPE:
+		/* info->length is the last message length, not a backlog */
+		if ((port->flags & COPORT_RECVQ) != 0)
+			stats->length = atomic_load_explicit(&port->cd->recvq.fill_tail, memory_order_relaxed) - 
+			    atomic_load_explicit(&port->cd->recvq.reaped, memory_order_relaxed);
+		else
+			stats->length = 0;
+		break;
+	case COCHANNEL:
+		if ((port->flags & COPORT_RING) != 0)
+			stats->length = atomic_load_explicit(&port->cd->ring.prod_tail, memory_order_relaxed) - 
+			    atomic_load_explicit(&port->cd->ring.cons_tail, memory_order_relaxed);
+		else
+			stats->length = atomic_load_explicit(&port->info->length, memory_order_relaxed);
+		break;
+	case COCARRIER:
+		if (port->cd->userq != NULL)
+			stats->length = cocarrier_userq_len(port);
+		else
+			stats->length = atomic_load_explicit(&port->info->length, memory_order_relaxed);
+		break;
+	case COBROADCAST:
+		stats->length = 0; /* each subscriber has its own backlog */
+		break;
+	default:
+		stats->length = atomic_load_explicit(&port->info->length, memory_order_relaxed);
+		break;
+	}
+	stats->sends = atomic_load_explicit(&counters->sends, memory_order_relaxed);
+	stats->recvs = atomic_load_explicit(&counters->recvs, memory_order_relaxed);
+	stats->bytes_sent = atomic_load_explicit(&counters->bytes_sent, memory_order_relaxed);
+	stats->bytes_recvd = atomic_load_explicit(&counters->bytes_recvd, memory_order_relaxed);
+	stats->send_full = atomic_load_explicit(&counters->send_full, memory_order_relaxed);
+	stats->recv_empty = atomic_load_explicit(&counters->recv_empty, memory_order_relaxed);
+	stats->cas_retries = atomic_load_explicit(&counters->cas_retries, memory_order_relaxed);
+	stats->high_water = atomic_load_explicit(&counters->high_water, memory_order_relaxed);
+
+	COCALL_RETURN(cocall_args, 0);
+}
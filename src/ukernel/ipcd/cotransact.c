@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2020 Peter S. Blandford-Baker
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology) under DARPA contract HR0011-18-C-0016 ("ECATS"), as part of the
+ * DARPA SSITH research programme.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include "cotransact.h"
+#include "corecv.h"
+#include "cosend.h"
+#include "ipcd.h"
+#include "ipcd_cap.h"
+
+#include <comsg/comsg_args.h>
+#include <comsg/coport.h>
+#include <comsg/utils.h>
+
+#include <cheri/cheric.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/errno.h>
+#include <sys/queue.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/umtx.h>
+#include <time.h>
+
+/* 
+ * A cotransact waiting for its reply. The server only ever sees req_id; the
+ * reply is tagged with reply_id, so a request spliced onto the reply port 
+ * cannot pass for a reply. Both are random and never 0, which marks a message
+ * that is not part of a transaction.
+ */
+struct cotransaction {
+	LIST_ENTRY(cotransaction) entries;
+	uint64_t req_id;
+	uint64_t reply_id;
+	coport_t *reply_port; /* unsealed */
+	_Atomic uint32_t state;
+	int error; /* why the reply could not be delivered, if it could not */
+};
+
+#define COTRANSACT_WAITING	(0)
+#define COTRANSACT_REPLIED	(1)
+
+static LIST_HEAD(, cotransaction) transactions = LIST_HEAD_INITIALIZER(transactions);
+static pthread_mutex_t transactions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Called with transactions_lock held */
+static struct cotransaction *
+find_transaction(uint64_t req_id)
+{
+	struct cotransaction *txn;
+
+	LIST_FOREACH(txn, &transactions, entries) {
+		if (txn->req_id == req_id)
+			return (txn);
+	}
+	return (NULL);
+}
+
+static uint64_t
+random_corr_id(void)
+{
+	uint64_t corr_id;
+
+	do {
+		arc4random_buf(&corr_id, sizeof(corr_id));
+	} while (corr_id == 0 || find_transaction(corr_id) != NULL);
+	return (corr_id);
+}
+
+static void
+begin_transaction(struct cotransaction *txn, coport_t *reply_port)
+{
+	txn->reply_port = unseal_coport(reply_port);
+	atomic_store_explicit(&txn->state, COTRANSACT_WAITING, memory_order_relaxed);
+	txn->error = 0;
+	pthread_mutex_lock(&transactions_lock);
+	txn->req_id = random_corr_id();
+	txn->reply_id = random_corr_id();
+	LIST_INSERT_HEAD(&transactions, txn, entries);
+	pthread_mutex_unlock(&transactions_lock);
+}
+
+/* Returns true if a reply was accepted before the transaction ended */
+static bool
+end_transaction(struct cotransaction *txn)
+{
+	bool replied;
+
+	pthread_mutex_lock(&transactions_lock);
+	LIST_REMOVE(txn, entries);
+	replied = (atomic_load_explicit(&txn->state, memory_order_acquire) == COTRANSACT_REPLIED);
+	pthread_mutex_unlock(&transactions_lock);
+	return (replied);
+}
+
+int
+validate_cotransact_args(cosend_args_t *cocall_args)
+{
+	if (cocall_args->send_timeout == 0)
+		return (0); /* would never see the reply */
+	else if (!valid_cocarrier(cocall_args->reply_port))
+		return (0);
+	else if (cheri_getaddress(cocall_args->reply_port) == cheri_getaddress(cocall_args->cocarrier))
+		return (0);
+	else if ((unseal_coport(cocall_args->reply_port)->flags & COPORT_USERDEQ) != 0)
+		return (0); /* replies are taken from the middle of the queue */
+	return (validate_slosend_args(cocall_args) && validate_cosend_args(cocall_args));
+}
+
+/*
+ * Sends a request tagged with a fresh correlation ID and sleeps until the 
+ * server replies through COREPLY. The reply is then taken from wherever it is
+ * in the reply port's queue, so other messages on the reply port are left 
+ * alone. A reply that arrives as we time out is still returned. The timeout
+ * covers both the send and the wait.
+ */
+void
+cocarrier_transact(cosend_args_t *cocall_args, void *token)
+{
+	struct timespec deadline, curtime;
+	struct cotransaction txn;
+	cosend_args_t request_args;
+	corecv_args_t reply_args;
+	long timeout;
+
+	timeout = cocall_args->send_timeout;
+	if (timeout > 0) {
+		deadline.tv_sec = timeout / 1000;
+		deadline.tv_nsec = (timeout % 1000) * 1000000;
+		clock_gettime(CLOCK_MONOTONIC, &curtime);
+		timespecadd(&deadline, &curtime, &deadline);
+	}
+
+	begin_transaction(&txn, cocall_args->reply_port);
+	request_args = *cocall_args;
+	request_args.corr_id = txn.req_id;
+	cocarrier_send_wait(&request_args, token);
+	if (request_args.status == -1) {
+		end_transaction(&txn);
+		COCALL_ERR(cocall_args, request_args.error);
+	}
+
+	while (atomic_load_explicit(&txn.state, memory_order_acquire) == COTRANSACT_WAITING) {
+		if (timeout < 0) {
+			_umtx_op(&txn.state, UMTX_OP_WAIT_UINT, COTRANSACT_WAITING, NULL, NULL);
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &curtime);
+		if (!timespeccmp(&curtime, &deadline, <))
+			break;
+		timespecsub(&deadline, &curtime, &curtime);
+		_umtx_op(&txn.state, UMTX_OP_WAIT_UINT, COTRANSACT_WAITING, (void *)(uintptr_t)sizeof(curtime), &curtime);
+	}
+	if (!end_transaction(&txn))
+		COCALL_ERR(cocall_args, ETIMEDOUT);
+	else if (txn.error != 0)
+		COCALL_ERR(cocall_args, txn.error);
+
+	memset(&reply_args, '\0', sizeof(reply_args));
+	reply_args.cocarrier = cocall_args->reply_port;
+	cocarrier_recv_reply(&reply_args, txn.reply_id);
+	if (reply_args.status == -1)
+		COCALL_ERR(cocall_args, reply_args.error);
+
+	cocall_args->message = reply_args.message;
+	cocall_args->length = reply_args.length;
+	cocall_args->oob_data = reply_args.oob_data;
+	cocall_args->msg_handle = reply_args.msg_handle;
+	cocall_args->corr_id = txn.req_id;
+	COCALL_RETURN(cocall_args, reply_args.status);
+}
+
+int
+validate_coreply_args(cosend_args_t *cocall_args)
+{
+	if (cocall_args->corr_id == 0)
+		return (0);
+	else if (!valid_cocarrier(cocall_args->cocarrier))
+		return (0);
+	else if (cocall_args->oob_data.len != 0)
+		return (0);
+	return (validate_cosend_args(cocall_args));
+}
+
+/*
+ * Sends the reply to the cotransact whose request carried corr_id. It must be
+ * sent on that transaction's reply port, and only once; replies to unknown or
+ * finished transactions fail with EINVAL. If the reply port is full, the 
+ * server may try again. Any other failure is passed on to the waiting caller.
+ */
+void
+cocarrier_reply(cosend_args_t *cocall_args, void *token)
+{
+	struct cotransaction *txn;
+	cosend_args_t reply_args;
+	coport_t *port;
+
+	port = unseal_coport(cocall_args->cocarrier);
+	pthread_mutex_lock(&transactions_lock);
+	txn = find_transaction(cocall_args->corr_id);
+	if (txn == NULL || txn->reply_port->slot != port->slot || txn->reply_port->gen != port->gen ||
+	    atomic_load_explicit(&txn->state, memory_order_relaxed) != COTRANSACT_WAITING) {
+		pthread_mutex_unlock(&transactions_lock);
+		COCALL_ERR(cocall_args, EINVAL);
+	}
+	reply_args = *cocall_args;
+	reply_args.corr_id = txn->reply_id;
+	reply_args.send_timeout = 0;
+	cocarrier_send_wait(&reply_args, token);
+	if (reply_args.status != -1 || reply_args.error != EAGAIN) {
+		txn->error = (reply_args.status == -1) ? reply_args.error : 0;
+		atomic_store_explicit(&txn->state, COTRANSACT_REPLIED, memory_order_release);
+		_umtx_op(&txn->state, UMTX_OP_WAKE, INT_MAX, NULL, NULL);
+	}
+	pthread_mutex_unlock(&transactions_lock);
+
+	if (reply_args.status == -1)
+		COCALL_ERR(cocall_args, reply_args.error);
+	COCALL_RETURN(cocall_args, reply_args.status);
+}
@@ -29,7 +29,10 @@
  * SUCH DAMAGE.
  */
 #include "ipcd.h"
+#include "copoll_deliver.h"
+#include "coport_table.h"
 #include "ipcd_startup.h"
+#include "sppool.h"
 #include <cocall/endpoint.h>
 
 #include <cocall/cocalls.h>
@@ -79,12 +82,35 @@ static size_t nbuckets = 7;
 int main(int argc, char *const argv[])
 {
 	int opt, error;
+	long nnotifiers, ncoports, sppool_mb;
+	char *end;
 	void *init_cap;
 	
 	is_ukernel = true;
 
-	while((opt = getopt(argc, argv, "")) != -1) {
+	while((opt = getopt(argc, argv, "n:p:s:w")) != -1) {
 		switch (opt) {
+		case 'n':
+			nnotifiers = strtol(optarg, &end, 10);
+			if (*end != '\0' || nnotifiers < 1)
+				usage();
+			set_copoll_notifier_count(nnotifiers);
+			break;
+		case 'p':
+			ncoports = strtol(optarg, &end, 10);
+			if (*end != '\0' || ncoports < 1)
+				usage();
+			set_coport_table_len(ncoports);
+			break;
+		case 's':
+			sppool_mb = strtol(optarg, &end, 10);
+			if (*end != '\0' || sppool_mb < 1)
+				usage();
+			set_sppool_len((size_t)sppool_mb * 1024 * 1024);
+			break;
+		case 'w':
+			set_sppool_wired(true);
+			break;
 		case '?':
 		default: 
 			usage();
@@ -69,14 +69,40 @@ struct ipcd_capvec {
 	void *coselect;
 };
 
+/* COBROADCAST ring slots; the slot size is a power of two */
+struct cobroadcast_slot {
+    void *buf; /* bounded to the message */
+    void *alloc; /* whole slab object backing buf */
+};
+
+#define COBROADCAST_DEPTH(port) (__builtin_cheri_length_get((port)->buffer->buf) / sizeof(struct cobroadcast_slot))
+
+/* Number of message slots in a cocarrier queue; always a power of two */
+#define COCARRIER_DEPTH(port) (__builtin_cheri_length_get((port)->buffer->buf) / CHERICAP_SIZE)
+
 struct cocarrier_message {
-    void *buf;
+    void *buf; /* bounded to the message */
+    void *alloc; /* whole slab object backing buf */
     comsg_attachment_t *attachments;
     size_t nattachments;
     _Atomic bool freed;
 	_Atomic bool recvd;
 	_Atomic bool sent;
 	char _pad[5];
+	_Atomic uint64_t gen; /* bumped each time the slot is reused */
+	uint64_t corr_id; /* cotransact correlation ID, or 0 */
 };
 
+/* COPORT_INLINE messages have no allocation of their own */
+#define COCARRIER_MSG_INLINE(msg) ((msg)->alloc == NULL)
+
+/* The receiver's capability to a queued message */
+static inline void *
+cocarrier_msg_cap(const struct cocarrier_message *msg)
+{
+	if (COCARRIER_MSG_INLINE(msg))
+		return (__builtin_cheri_perms_and(msg->buf, COCARRIER_MSG_PERMS | COCARRIER_PERM_INLINE));
+	return (__builtin_cheri_perms_and(msg->buf, COCARRIER_MSG_PERMS));
+}
+
 #endif //!defined(_IPCD_H)
\ No newline at end of file
@@ -29,6 +29,9 @@
  * SUCH DAMAGE.
  */
 #include "ipcd_cap.h"
+#include "ipcd.h"
+#include "cobroadcast.h"
+#include "copoll_set.h"
 #include "coport_table.h"
 
 #include <comsg/coport.h>
@@ -41,14 +44,15 @@
 #include <sysexits.h>
 #include <unistd.h>
 
-static struct object_type cocarrier_otype, copipe_otype, cochannel_otype;
+static struct object_type cocarrier_otype, copipe_otype, cochannel_otype, comsg_otype, copoll_set_otype;
+static struct object_type cobroadcast_otype, cosubscriber_otype, zcpool_otype;
 static void *root_cap;
 
 static __attribute__((constructor)) void
 setup_ipcd_otypes(void)
 {
     size_t len;
-    struct object_type *otypes[] = {&copipe_otype, &cochannel_otype, &cocarrier_otype};
+    struct object_type *otypes[] = {&copipe_otype, &cochannel_otype, &cocarrier_otype, &comsg_otype, &copoll_set_otype, &cobroadcast_otype, &cosubscriber_otype, &zcpool_otype};
     
     len = sizeof(root_cap);
     assert(sysctlbyname("security.cheri.sealcap", &root_cap, &len,
@@ -61,7 +65,7 @@ setup_ipcd_otypes(void)
     /* XXX-PBB: we currently simulate the eventual role of the type manager here and in libcomsg */
     root_cap = cheri_incoffset(root_cap, 32);
 
-    root_cap = make_otypes(root_cap, 3, otypes);
+    root_cap = make_otypes(root_cap, 8, otypes);
 }
 
 coport_type_t
@@ -71,15 +75,27 @@ coport_gettype(coport_t *ptr)
     return (ptr->type);
 }
 
+static int
+is_coport_otype(long otype)
+{
+    return (otype == copipe_otype.otype || otype == cochannel_otype.otype ||
+        otype == cocarrier_otype.otype || otype == cobroadcast_otype.otype);
+}
+
 int 
 valid_coport(coport_t *addr)
 {
+    coport_t *port;
+
     if (!cheri_gettag(addr))
         return (0);
-    else if(cheri_getlen(addr) < sizeof(coport_t))
-        return (0);
-    else if(!in_coport_table(addr, coport_gettype(addr)))
+    else if (cheri_getsealed(addr) && !is_coport_otype(cheri_gettype(addr)))
+        return (0); /* e.g. a COBROADCAST subscriber */
+    else if(cheri_getlen(addr) != sizeof(coport_t))
         return (0);
+    port = unseal_coport(addr);
+    if(!in_coport_table(port, port->type))
+        return (0); /* includes handles to since-recycled coports */
     else 
         return (1);
 }
@@ -95,6 +111,17 @@ valid_cocarrier(coport_t *addr)
         return (1);
 }
 
+int 
+valid_cobroadcast(coport_t *addr)
+{
+    if (!cheri_gettag(addr))
+        return (0);
+    else if (cheri_gettype(addr) != cobroadcast_otype.otype)
+        return (0);
+    else 
+        return (valid_coport(addr));
+}
+
 coport_t *
 seal_coport(coport_t *ptr)
 {
@@ -107,6 +134,8 @@ seal_coport(coport_t *ptr)
         return (cheri_seal(ptr, copipe_otype.sc));
     else if (ptr->type == COCARRIER)
         return (cheri_seal(ptr, cocarrier_otype.sc));
+    else if (ptr->type == COBROADCAST)
+        return (cheri_seal(ptr, cobroadcast_otype.sc));
     else
         err(EX_SOFTWARE, "%s: invalid coport type %d", __func__, ptr->type); //should not be reached
 }
@@ -122,6 +151,113 @@ unseal_coport(coport_t *ptr)
         return (cheri_unseal(ptr, copipe_otype.usc));
     else if (cheri_gettype(ptr) == cochannel_otype.otype)
         return (cheri_unseal(ptr, cochannel_otype.usc));
+    else if (cheri_gettype(ptr) == cobroadcast_otype.otype)
+        return (cheri_unseal(ptr, cobroadcast_otype.usc));
     else 
         err(EX_SOFTWARE, "%s: invalid coport type %d", __func__, ptr->type); //should not be reached
-}
\ No newline at end of file
+}
+
+void *
+seal_cocarrier_msg(struct cocarrier_message *msg)
+{
+    msg = cheri_setboundsexact(msg, sizeof(struct cocarrier_message));
+    msg = cheri_clearperm(msg, CHERI_PERM_GLOBAL);
+    return (cheri_seal(msg, comsg_otype.sc));
+}
+
+int
+valid_cocarrier_msg(void *handle)
+{
+    if (!cheri_gettag(handle))
+        return (0);
+    else if (cheri_gettype(handle) != comsg_otype.otype)
+        return (0);
+    else if (cheri_getlen(handle) < sizeof(struct cocarrier_message))
+        return (0);
+    else
+        return (1);
+}
+
+struct cocarrier_message *
+unseal_cocarrier_msg(void *handle)
+{
+    return (cheri_unseal(handle, comsg_otype.usc));
+}
+
+void *
+seal_zcpool_token(void *obj)
+{
+    obj = cheri_clearperm(obj, CHERI_PERM_GLOBAL);
+    return (cheri_seal(obj, zcpool_otype.sc));
+}
+
+int
+valid_zcpool_token(void *token)
+{
+    if (!cheri_gettag(token))
+        return (0);
+    else if (cheri_gettype(token) != zcpool_otype.otype)
+        return (0);
+    else
+        return (1);
+}
+
+void *
+unseal_zcpool_token(void *token)
+{
+    return (cheri_unseal(token, zcpool_otype.usc));
+}
+
+copoll_set_t *
+seal_copoll_set(copoll_set_t *set)
+{
+    set = cheri_setboundsexact(set, sizeof(struct _copoll_set));
+    set = cheri_clearperm(set, CHERI_PERM_GLOBAL);
+    return (cheri_seal(set, copoll_set_otype.sc));
+}
+
+int
+valid_copoll_set(copoll_set_t *handle)
+{
+    if (!cheri_gettag(handle))
+        return (0);
+    else if (cheri_gettype(handle) != copoll_set_otype.otype)
+        return (0);
+    else if (cheri_getlen(handle) < sizeof(struct _copoll_set))
+        return (0);
+    else
+        return (1);
+}
+
+copoll_set_t *
+unseal_copoll_set(copoll_set_t *handle)
+{
+    return (cheri_unseal(handle, copoll_set_otype.usc));
+}
+
+coport_t *
+seal_cosubscriber(struct _cosubscriber *sub)
+{
+    sub = cheri_setboundsexact(sub, sizeof(struct _cosubscriber));
+    sub = cheri_clearperm(sub, CHERI_PERM_GLOBAL);
+    return ((coport_t *)cheri_seal(sub, cosubscriber_otype.sc));
+}
+
+int
+valid_cosubscriber(coport_t *handle)
+{
+    if (!cheri_gettag(handle))
+        return (0);
+    else if (cheri_gettype(handle) != cosubscriber_otype.otype)
+        return (0);
+    else if (cheri_getlen(handle) < sizeof(struct _cosubscriber))
+        return (0);
+    else
+        return (1);
+}
+
+struct _cosubscriber *
+unseal_cosubscriber(coport_t *handle)
+{
+    return (cheri_unseal((struct _cosubscriber *)handle, cosubscriber_otype.usc));
+}
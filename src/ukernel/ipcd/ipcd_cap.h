@@ -36,9 +36,28 @@
 
 int valid_coport(coport_t*);
 int valid_cocarrier(coport_t*);
+int valid_cobroadcast(coport_t*);
 coport_type_t coport_gettype(coport_t *ptr);
 
 coport_t *unseal_coport(coport_t*);
 coport_t *seal_coport(coport_t*);
 
+struct cocarrier_message;
+int valid_cocarrier_msg(void *);
+void *seal_cocarrier_msg(struct cocarrier_message *);
+struct cocarrier_message *unseal_cocarrier_msg(void *);
+
+int valid_zcpool_token(void *);
+void *seal_zcpool_token(void *);
+void *unseal_zcpool_token(void *);
+
+int valid_copoll_set(copoll_set_t *);
+copoll_set_t *seal_copoll_set(copoll_set_t *);
+copoll_set_t *unseal_copoll_set(copoll_set_t *);
+
+struct _cosubscriber;
+int valid_cosubscriber(coport_t *);
+coport_t *seal_cosubscriber(struct _cosubscriber *);
+struct _cosubscriber *unseal_cosubscriber(coport_t *);
+
 #endif //!defined(_IPCD_CAP_H)
\ No newline at end of file
@@ -2,12 +2,19 @@
 
 #include <comsg/comsg_args.h>
 
+#include "cobroadcast.h"
+#include "cocarrier_userq.h"
 #include "coclose.h"
 #include "coopen.h"
 #include "copoll.h"
+#include "copoll_set.h"
 #include "cosend.h"
+#include "cosplice.h"
+#include "cotransact.h"
 #include "corecv.h"
+#include "costat.h"
 #include "comsg_free.h"
+#include "comsg_alloc.h"
 
 #define COCALL_ENDPOINT_IMPL
 #include <cocall/endpoint.h>
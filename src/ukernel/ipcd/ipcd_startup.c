@@ -32,7 +32,11 @@
 #include "ipcd.h"
 
 #include "copoll_deliver.h"
+#include "coopen.h"
+#include "coport_table.h"
 #include "ipcd_endpoints.h"
+#include "sppool.h"
+#include "zcpool.h"
 
 #include <comsg/comsg_args.h>
 #include <comsg/namespace.h>
@@ -40,6 +44,7 @@
 #include <comsg/ukern_calls.h>
 
 #include <assert.h>
+#include <ccmalloc.h>
 #include <cheri/cheric.h>
 #include <err.h>
 #include <sysexits.h>
@@ -127,6 +132,11 @@ void ipcd_startup(void)
 	if (root_ns == NULL)
 		err(EX_SOFTWARE, "%s: capvec was invalid.", __func__);
 
+	ccslab_init();
+	zcpool_init();
+	sppool_init();
+	setup_coport_tables();
+	setup_coport_pools();
 	setup_copoll_notifiers();	
 
 	do {
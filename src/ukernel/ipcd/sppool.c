@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2020 Peter S. Blandford-Baker
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology) under DARPA contract HR0011-18-C-0016 ("ECATS"), as part of the
+ * DARPA SSITH research programme.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include "sppool.h"
+
+#include <comsg/coport.h>
+
+#include <cheri/cheric.h>
+#include <cheri/cherireg.h>
+#include <err.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <sysexits.h>
+#include <sys/errno.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+
+/*
+ * Pool of superpage-backed buffers for COPORT_SUPERPAGE coports.
+ *
+ * Large cocarrier messages and cochannel rings from malloc land on fresh 
+ * 4 KiB pages, so each one pays for page faults and TLB misses on both sides.
+ * This pool is a single superpage-aligned reservation split into chunks. A 
+ * chunk's pages are faulted in (and wired with ipcd -w) when it is first 
+ * carved, so the kernel can promote it to superpages. Freed objects are kept
+ * on per-class free lists and never unmapped, so they stay resident.
+ *
+ * As in zcpool, each chunk holds objects of one power-of-two size class.
+ */
+#define SPPOOL_DEFAULT_LEN (512UL * 1024 * 1024)
+#define SPPOOL_CHUNK_SHIFT (22)
+#define SPPOOL_CHUNK_LEN (1UL << SPPOOL_CHUNK_SHIFT)
+#define SPPOOL_NCLASSES (SPPOOL_CHUNK_SHIFT - PAGE_SHIFT + 1)
+
+_Static_assert(SPPOOL_CHUNK_LEN >= COCARRIER_MAX_MSG_LEN, "sppool chunks must fit the largest message");
+_Static_assert(SPPOOL_CHUNK_LEN >= COPORT_MAX_BUF_LEN, "sppool chunks must fit the largest cochannel");
+
+struct sp_free_obj {
+	SLIST_ENTRY(sp_free_obj) entries;
+};
+
+struct sp_class {
+	pthread_mutex_t lock;
+	SLIST_HEAD(, sp_free_obj) free;
+	size_t chunk_off; /* offset of the next uncarved object, 0 if none */
+	size_t chunk_end;
+};
+
+static void *sppool;
+static size_t sppool_len = SPPOOL_DEFAULT_LEN;
+static size_t sppool_nchunks;
+static bool sppool_wired = false;
+static _Atomic size_t sppool_next_chunk = 0;
+static uint8_t *chunk_shift;
+static struct sp_class sp_classes[SPPOOL_NCLASSES];
+
+/* Must be called before sppool_init */
+void
+set_sppool_len(size_t len)
+{
+	sppool_len = roundup2(MAX(len, SPPOOL_CHUNK_LEN), SPPOOL_CHUNK_LEN);
+}
+
+/* Must be called before sppool_init */
+void
+set_sppool_wired(bool wired)
+{
+	sppool_wired = wired;
+}
+
+void
+sppool_init(void)
+{
+	sppool = mmap(NULL, sppool_len, PROT_READ | PROT_WRITE, 
+	    MAP_ANON | MAP_PRIVATE | MAP_ALIGNED(SPPOOL_CHUNK_SHIFT), -1, 0);
+	if (sppool == MAP_FAILED)
+		err(EX_OSERR, "%s: mmap failed", __func__);
+	sppool_nchunks = sppool_len >> SPPOOL_CHUNK_SHIFT;
+	chunk_shift = calloc(sppool_nchunks, sizeof(uint8_t));
+	if (chunk_shift == NULL)
+		err(EX_OSERR, "%s: calloc failed", __func__);
+
+	for (size_t i = 0; i < SPPOOL_NCLASSES; i++) {
+		pthread_mutex_init(&sp_classes[i].lock, NULL);
+		SLIST_INIT(&sp_classes[i].free);
+		sp_classes[i].chunk_off = 0;
+		sp_classes[i].chunk_end = 0;
+	}
+}
+
+static inline size_t
+sppool_offset(const void *buf)
+{
+	return (cheri_getaddress(buf) - cheri_getbase(sppool));
+}
+
+bool
+sppool_owns(const void *buf)
+{
+	if (sppool == NULL || !cheri_gettag(buf))
+		return (false);
+	return (sppool_offset(buf) < sppool_len);
+}
+
+static inline size_t
+obj_len(size_t offset)
+{
+	return (1UL << chunk_shift[offset >> SPPOOL_CHUNK_SHIFT]);
+}
+
+static void *
+make_obj(size_t offset)
+{
+	void *obj;
+
+	obj = cheri_setaddress(sppool, cheri_getbase(sppool) + offset);
+	return (cheri_setboundsexact(obj, obj_len(offset)));
+}
+
+/* Faults in (or wires) a chunk so that it can be promoted to superpages */
+static void
+prefault_chunk(size_t chunk)
+{
+	static _Atomic bool warned = false;
+	volatile char *page;
+	char *chunk_buf;
+
+	chunk_buf = cheri_setaddress(sppool, cheri_getbase(sppool) + (chunk << SPPOOL_CHUNK_SHIFT));
+	chunk_buf = cheri_setboundsexact(chunk_buf, SPPOOL_CHUNK_LEN);
+	if (sppool_wired) {
+		if (mlock(chunk_buf, SPPOOL_CHUNK_LEN) == 0)
+			return;
+		if (!atomic_exchange(&warned, true))
+			warn("%s: mlock failed; sppool will not be wired", __func__);
+	}
+	for (size_t off = 0; off < SPPOOL_CHUNK_LEN; off += PAGE_SIZE) {
+		page = &chunk_buf[off];
+		*page = '\0';
+	}
+}
+
+static bool
+carve_chunk(struct sp_class *class, int shift)
+{
+	size_t chunk;
+
+	chunk = atomic_fetch_add_explicit(&sppool_next_chunk, 1, memory_order_relaxed);
+	if (chunk >= sppool_nchunks)
+		return (false);
+	prefault_chunk(chunk);
+	chunk_shift[chunk] = shift;
+	class->chunk_off = chunk << SPPOOL_CHUNK_SHIFT;
+	class->chunk_end = class->chunk_off + SPPOOL_CHUNK_LEN;
+	return (true);
+}
+
+/*
+ * Returns a capability to a resident, naturally aligned pool object of at 
+ * least len bytes, or NULL with errno set. Objects are not zeroed.
+ */
+void *
+sppool_alloc(size_t len)
+{
+	struct sp_class *class;
+	struct sp_free_obj *free_obj;
+	size_t offset;
+	int shift;
+
+	if (len == 0 || len > SPPOOL_CHUNK_LEN) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	shift = MAX(flsl(len - 1), PAGE_SHIFT);
+	class = &sp_classes[shift - PAGE_SHIFT];
+
+	pthread_mutex_lock(&class->lock);
+	free_obj = SLIST_FIRST(&class->free);
+	if (free_obj != NULL) {
+		SLIST_REMOVE_HEAD(&class->free, entries);
+		offset = sppool_offset(free_obj);
+	} else {
+		if (class->chunk_off == class->chunk_end && !carve_chunk(class, shift)) {
+			pthread_mutex_unlock(&class->lock);
+			errno = ENOMEM;
+			return (NULL);
+		}
+		offset = class->chunk_off;
+		class->chunk_off += (1UL << shift);
+	}
+	pthread_mutex_unlock(&class->lock);
+
+	return (make_obj(offset));
+}
+
+void
+sppool_free(void *obj)
+{
+	struct sp_class *class;
+	struct sp_free_obj *free_obj;
+	size_t offset;
+	uint8_t shift;
+
+	offset = sppool_offset(obj);
+	shift = chunk_shift[offset >> SPPOOL_CHUNK_SHIFT];
+	if (shift == 0 || (offset & ((1UL << shift) - 1)) != 0)
+		err(EX_SOFTWARE, "%s: %p is not a pool object", __func__, obj);
+
+	class = &sp_classes[shift - PAGE_SHIFT];
+	free_obj = make_obj(offset);
+
+	pthread_mutex_lock(&class->lock);
+	SLIST_INSERT_HEAD(&class->free, free_obj, entries);
+	pthread_mutex_unlock(&class->lock);
+}
@@ -0,0 +1,442 @@
+/*
+ * Copyright (c) 2020 Peter S. Blandford-Baker
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology) under DARPA contract HR0011-18-C-0016 ("ECATS"), as part of the
+ * DARPA SSITH research programme.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include "zcpool.h"
+
+#include <comsg/coport.h>
+
+#include <cheri/cheric.h>
+#include <cheri/cherireg.h>
+#include <cheri/libcaprevoke.h>
+#include <cheri/revoke.h>
+#include <err.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <strings.h>
+#include <sysexits.h>
+#include <sys/errno.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+
+/*
+ * Pool of page-aligned message buffers for zero-copy cocarrier sends.
+ * 
+ * Senders obtain a buffer with COPORT_MSG_ALLOC and write their message into
+ * it. When the buffer is sent, ipcd makes its pages read-only and enqueues a
+ * capability rederived from the pool, so the message is never copied and the 
+ * sender can no longer modify it. 
+ *
+ * When the receiver frees the message, the object's pages are dropped and it
+ * is quarantined: the sender and receiver still hold capabilities to it, 
+ * which must not reach its next owner's message. Once enough objects are in 
+ * quarantine, or an allocation finds nothing free, a revocation pass clears 
+ * every capability to them and they get fresh pages and become free. If the
+ * kernel cannot revoke for us, freed objects are never reused.
+ *
+ * Each allocation is bound to an owner (the cocarrier it was allocated for) 
+ * and a generation. The sender is handed a sealed token naming the object and
+ * must present it, with the generation, to send the buffer or release it 
+ * unsent; a stale capability to an object that has since been reused cannot.
+ *
+ * The pool is a single reservation split into chunks of the largest message
+ * size. Each chunk holds objects of one power-of-two size class, so an 
+ * object's class and state can be found from its address alone.
+ */
+#define ZCPOOL_LEN (1024UL * 1024 * 1024)
+#define ZCPOOL_CHUNK_SHIFT (21)
+#define ZCPOOL_CHUNK_LEN (1UL << ZCPOOL_CHUNK_SHIFT)
+#define ZCPOOL_NCHUNKS (ZCPOOL_LEN >> ZCPOOL_CHUNK_SHIFT)
+#define ZCPOOL_NPAGES (ZCPOOL_LEN >> PAGE_SHIFT)
+#define ZCPOOL_NCLASSES (ZCPOOL_CHUNK_SHIFT - PAGE_SHIFT + 1)
+#define ZCPOOL_QUARANTINE_LEN (ZCPOOL_LEN / 8)
+
+_Static_assert(ZCPOOL_CHUNK_LEN >= COCARRIER_MAX_MSG_LEN, "zcpool chunks must fit the largest message");
+
+typedef enum {ZC_FREE = 0, ZC_ALLOCATED = 1, ZC_SENT = 2, ZC_QUARANTINED = 3} zc_state_t;
+
+struct zc_free_obj {
+	SLIST_ENTRY(zc_free_obj) entries;
+};
+
+struct zc_class {
+	pthread_mutex_t lock;
+	SLIST_HEAD(, zc_free_obj) free;
+	size_t chunk_off; /* offset of the next uncarved object, 0 if none */
+	size_t chunk_end;
+};
+
+static void *zcpool;
+static _Atomic size_t zcpool_next_chunk = 0;
+static uint8_t chunk_shift[ZCPOOL_NCHUNKS];
+static _Atomic uint8_t obj_state[ZCPOOL_NPAGES];
+static _Atomic uint64_t obj_gen[ZCPOOL_NPAGES];
+static vaddr_t obj_owner[ZCPOOL_NPAGES];
+static struct zc_class zc_classes[ZCPOOL_NCLASSES];
+
+static bool zcpool_revoking = false;
+static volatile const struct cheri_revoke_info *revoke_info;
+static uint64_t *revoke_shadow;
+static pthread_mutex_t quarantine_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t quarantine_head; /* page index + 1 of the first object, 0 if none */
+static uint32_t quarantine_next[ZCPOOL_NPAGES];
+static size_t quarantine_len;
+
+void
+zcpool_init(void)
+{
+	zcpool = mmap(NULL, ZCPOOL_LEN, PROT_READ | PROT_WRITE, 
+	    MAP_ANON | MAP_PRIVATE | MAP_ALIGNED(ZCPOOL_CHUNK_SHIFT), -1, 0);
+	if (zcpool == MAP_FAILED)
+		err(EX_OSERR, "%s: mmap failed", __func__);
+
+	for (size_t i = 0; i < ZCPOOL_NCLASSES; i++) {
+		pthread_mutex_init(&zc_classes[i].lock, NULL);
+		SLIST_INIT(&zc_classes[i].free);
+		zc_classes[i].chunk_off = 0;
+		zc_classes[i].chunk_end = 0;
+	}
+	/* 
+	 * Revocation clears capabilities whose base is quarantined, so the first
+	 * chunk, where the pool capability itself starts, never holds objects.
+	 */
+	zcpool_next_chunk = 1;
+
+	if (cheri_revoke_get_shadow(CHERI_REVOKE_SHADOW_INFO_STRUCT, NULL, 
+	    (void **)&revoke_info) != 0)
+		return;
+	else if (cheri_revoke_get_shadow(CHERI_REVOKE_SHADOW_NOVMEM, NULL, 
+	    (void **)&revoke_shadow) != 0)
+		return;
+	zcpool_revoking = true;
+}
+
+static inline size_t
+zcpool_offset(const void *buf)
+{
+	return (cheri_getaddress(buf) - cheri_getbase(zcpool));
+}
+
+bool
+zcpool_owns(const void *buf)
+{
+	if (zcpool == NULL || !cheri_gettag(buf))
+		return (false);
+	return (zcpool_offset(buf) < ZCPOOL_LEN);
+}
+
+static inline size_t
+obj_len(size_t offset)
+{
+	return (1UL << chunk_shift[offset >> ZCPOOL_CHUNK_SHIFT]);
+}
+
+static inline _Atomic uint8_t *
+get_obj_state(size_t offset)
+{
+	return (&obj_state[offset >> PAGE_SHIFT]);
+}
+
+static inline _Atomic uint64_t *
+get_obj_gen(size_t offset)
+{
+	return (&obj_gen[offset >> PAGE_SHIFT]);
+}
+
+static void *
+make_obj(size_t offset)
+{
+	void *obj;
+
+	obj = cheri_setaddress(zcpool, cheri_getbase(zcpool) + offset);
+	return (cheri_setboundsexact(obj, obj_len(offset)));
+}
+
+/*
+ * Returns the offset of the pool object that buf refers to, or -1 if buf 
+ * does not refer to the start of an object.
+ */
+static ssize_t
+find_obj(const void *buf)
+{
+	size_t offset, len;
+
+	if (!zcpool_owns(buf) || cheri_getoffset(buf) != 0)
+		return (-1);
+	offset = zcpool_offset(buf);
+	if (chunk_shift[offset >> ZCPOOL_CHUNK_SHIFT] == 0)
+		return (-1);
+	len = obj_len(offset);
+	if ((offset & (len - 1)) != 0 || cheri_getlen(buf) > len)
+		return (-1);
+	return ((ssize_t)offset);
+}
+
+static bool
+carve_chunk(struct zc_class *class, int shift)
+{
+	size_t chunk;
+
+	chunk = atomic_fetch_add_explicit(&zcpool_next_chunk, 1, memory_order_relaxed);
+	if (chunk >= ZCPOOL_NCHUNKS)
+		return (false);
+	chunk_shift[chunk] = shift;
+	class->chunk_off = chunk << ZCPOOL_CHUNK_SHIFT;
+	class->chunk_end = class->chunk_off + ZCPOOL_CHUNK_LEN;
+	return (true);
+}
+
+/*
+ * Returns the offset of the object named by a token from zcpool_alloc, or -1
+ * if the token was issued to another owner or has gone stale.
+ */
+static ssize_t
+check_token(const void *token, uint64_t gen, vaddr_t owner)
+{
+	ssize_t offset;
+
+	offset = find_obj(token);
+	if (offset == -1)
+		return (-1);
+	else if (atomic_load_explicit(get_obj_gen(offset), memory_order_acquire) != gen)
+		return (-1);
+	else if (obj_owner[offset >> PAGE_SHIFT] != owner)
+		return (-1);
+	return (offset);
+}
+
+/*
+ * Moves an object named by a token out of ZC_ALLOCATED. The generation is 
+ * checked again afterwards in case the object was released and reallocated 
+ * between check_token and the state change, as then it is not ours to take.
+ */
+static bool
+take_allocated(size_t offset, uint64_t gen, uint8_t new_state)
+{
+	uint8_t state;
+
+	state = ZC_ALLOCATED;
+	if (!atomic_compare_exchange_strong(get_obj_state(offset), &state, new_state))
+		return (false);
+	if (atomic_load_explicit(get_obj_gen(offset), memory_order_seq_cst) != gen) {
+		atomic_store_explicit(get_obj_state(offset), ZC_ALLOCATED, memory_order_release);
+		return (false);
+	}
+	return (true);
+}
+
+/* Gives a quarantined object fresh pages and puts it on its class's free list */
+static void
+release_obj(size_t offset)
+{
+	struct zc_class *class;
+	struct zc_free_obj *free_obj;
+
+	class = &zc_classes[chunk_shift[offset >> ZCPOOL_CHUNK_SHIFT] - PAGE_SHIFT];
+	free_obj = make_obj(offset);
+	if (mmap(free_obj, cheri_getlen(free_obj), PROT_READ | PROT_WRITE, 
+	    MAP_FIXED | MAP_ANON | MAP_PRIVATE, -1, 0) == MAP_FAILED)
+		err(EX_OSERR, "%s: mmap failed for %p", __func__, free_obj);
+	atomic_store_explicit(get_obj_state(offset), ZC_FREE, memory_order_release);
+
+	pthread_mutex_lock(&class->lock);
+	SLIST_INSERT_HEAD(&class->free, free_obj, entries);
+	pthread_mutex_unlock(&class->lock);
+}
+
+/* 
+ * Revokes every capability to the objects in quarantine and frees them. 
+ * Returns false if there was nothing to free.
+ */
+static bool
+zcpool_revoke(void)
+{
+	struct cheri_revoke_syscall_info crsi;
+	uint32_t page;
+	size_t offset;
+	void *obj;
+
+	pthread_mutex_lock(&quarantine_lock);
+	page = quarantine_head;
+	quarantine_head = 0;
+	quarantine_len = 0;
+	pthread_mutex_unlock(&quarantine_lock);
+	if (page == 0)
+		return (false);
+
+	atomic_thread_fence(memory_order_seq_cst);
+	if (cheri_revoke(CHERI_REVOKE_LAST_PASS | CHERI_REVOKE_IGNORE_START, 0, &crsi) != 0)
+		err(EX_OSERR, "%s: cheri_revoke failed", __func__);
+	while (page != 0) {
+		offset = (size_t)(page - 1) << PAGE_SHIFT;
+		page = quarantine_next[offset >> PAGE_SHIFT];
+		obj = make_obj(offset);
+		caprev_shadow_nomap_clear_len(revoke_info->base_mem_nomap, revoke_shadow, 
+		    cheri_getbase(obj), cheri_getlen(obj));
+		release_obj(offset);
+	}
+	return (true);
+}
+
+/*
+ * Returns an ipcd-owned capability to a pool object of at least len bytes for
+ * owner, and its generation in *gen; or NULL with errno set.
+ */
+void *
+zcpool_alloc(size_t len, vaddr_t owner, uint64_t *gen)
+{
+	struct zc_class *class;
+	struct zc_free_obj *free_obj;
+	size_t offset;
+	int shift;
+
+	if (len == 0 || len > COCARRIER_MAX_MSG_LEN) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	shift = MAX(flsl(len - 1), PAGE_SHIFT);
+	class = &zc_classes[shift - PAGE_SHIFT];
+
+	for (;;) {
+		pthread_mutex_lock(&class->lock);
+		free_obj = SLIST_FIRST(&class->free);
+		if (free_obj != NULL) {
+			SLIST_REMOVE_HEAD(&class->free, entries);
+			offset = zcpool_offset(free_obj);
+			break;
+		} else if (class->chunk_off != class->chunk_end || carve_chunk(class, shift)) {
+			offset = class->chunk_off;
+			class->chunk_off += (1UL << shift);
+			break;
+		}
+		pthread_mutex_unlock(&class->lock);
+		if (!zcpool_revoke()) {
+			errno = ENOMEM;
+			return (NULL);
+		}
+	}
+	pthread_mutex_unlock(&class->lock);
+
+	obj_owner[offset >> PAGE_SHIFT] = owner;
+	*gen = atomic_fetch_add_explicit(get_obj_gen(offset), 1, memory_order_seq_cst) + 1;
+	atomic_store_explicit(get_obj_state(offset), ZC_ALLOCATED, memory_order_release);
+	return (make_obj(offset));
+}
+
+/*
+ * Takes ownership of a buffer handed to cosend on owner, along with its token.
+ * Its pages are made read-only and a capability to the whole object is 
+ * returned, or NULL if the token does not name buf's allocated, unsent object.
+ */
+void *
+zcpool_claim(const void *buf, const void *token, uint64_t gen, vaddr_t owner)
+{
+	ssize_t offset;
+	void *obj;
+
+	offset = check_token(token, gen, owner);
+	if (offset == -1 || find_obj(buf) != offset)
+		return (NULL);
+	else if (!take_allocated(offset, gen, ZC_SENT))
+		return (NULL);
+
+	obj = make_obj(offset);
+	if (mprotect(obj, cheri_getlen(obj), PROT_READ) != 0)
+		err(EX_OSERR, "%s: mprotect failed for %p", __func__, obj);
+	return (obj);
+}
+
+/* Gives a claimed object back to its sender, e.g. because the send failed. */
+void
+zcpool_unclaim(void *obj)
+{
+	if (mprotect(obj, cheri_getlen(obj), PROT_READ | PROT_WRITE) != 0)
+		err(EX_OSERR, "%s: mprotect failed for %p", __func__, obj);
+	atomic_store_explicit(get_obj_state(zcpool_offset(obj)), ZC_ALLOCATED, memory_order_release);
+}
+
+/* 
+ * Drops the object's pages, so stale capabilities to it fault, and puts it in
+ * quarantine. The quarantine is a list of page indices rather than pointers, 
+ * as revocation would clear pointers into it.
+ */
+static void
+zcpool_put(size_t offset)
+{
+	void *obj;
+	bool full;
+
+	obj = make_obj(offset);
+	if (mmap(obj, cheri_getlen(obj), PROT_NONE, 
+	    MAP_FIXED | MAP_ANON | MAP_PRIVATE, -1, 0) == MAP_FAILED)
+		err(EX_OSERR, "%s: mmap failed for %p", __func__, obj);
+	atomic_store_explicit(get_obj_state(offset), ZC_QUARANTINED, memory_order_release);
+	if (!zcpool_revoking)
+		return;
+
+	caprev_shadow_nomap_set_len(revoke_info->base_mem_nomap, revoke_shadow, 
+	    cheri_getbase(obj), cheri_getlen(obj), obj);
+	pthread_mutex_lock(&quarantine_lock);
+	quarantine_next[offset >> PAGE_SHIFT] = quarantine_head;
+	quarantine_head = (offset >> PAGE_SHIFT) + 1;
+	quarantine_len += cheri_getlen(obj);
+	full = (quarantine_len >= ZCPOOL_QUARANTINE_LEN);
+	pthread_mutex_unlock(&quarantine_lock);
+	if (full)
+		zcpool_revoke();
+}
+
+/* Frees a sent object once its receiver is done with it. */
+void
+zcpool_free(void *obj)
+{
+	size_t offset;
+
+	offset = zcpool_offset(obj);
+	if (atomic_load_explicit(get_obj_state(offset), memory_order_acquire) != ZC_SENT)
+		err(EX_SOFTWARE, "%s: %p was not sent", __func__, obj);
+	zcpool_put(offset);
+}
+
+/* Frees an object that owner allocated but never sent, given its token. */
+int
+zcpool_release_unsent(const void *token, uint64_t gen, vaddr_t owner)
+{
+	ssize_t offset;
+
+	offset = check_token(token, gen, owner);
+	if (offset == -1)
+		return (EINVAL);
+	else if (!take_allocated(offset, gen, ZC_FREE))
+		return (EINVAL);
+	zcpool_put(offset);
+	return (0);
+}